@@ -30,6 +30,26 @@ namespace TAPNet {
 	};
 	public delegate void LogCallback(LogLevel level, string msg);
 
+	[StructLayout(LayoutKind.Sequential)]
+	public struct DeviceStats {
+		public const int LatencyBuckets = 16;
+
+		public ulong RxFrames;
+		public ulong RxBytes;
+		public ulong RxErrors;
+		public ulong RxDropped;
+		public ulong RxTruncated;
+		public ulong TxFrames;
+		public ulong TxBytes;
+		public ulong TxErrors;
+		public ulong KernelRxDropped;
+		public ulong KernelTxDropped;
+		[MarshalAs(UnmanagedType.ByValArray, SizeConst=LatencyBuckets)]
+		public ulong[] RxLatency;
+		[MarshalAs(UnmanagedType.ByValArray, SizeConst=LatencyBuckets)]
+		public ulong[] TxLatency;
+	};
+
 	public abstract class NativeLib {
 		public abstract int get_version();
 		public abstract void set_log_level(IntPtr tapcfg, LogLevel logLevel);
@@ -53,6 +73,7 @@ namespace TAPNet {
 		public abstract int iface_set_ipv6(IntPtr tapcfg, string addr, byte netbits);
 		public abstract int iface_set_dhcp_options(IntPtr tapcfg, byte[] buffer, int buflen);
 		public abstract int iface_set_dhcpv6_options(IntPtr tapcfg, byte[] buffer, int buflen);
+		public abstract int get_stats(IntPtr tapcfg, out DeviceStats stats);
 
 		public static NativeLib GetInstance() {
 			if (IntPtr.Size == 8)
@@ -184,6 +205,10 @@ namespace TAPNet {
 				return tapcfg_iface_set_dhcpv6_options(tapcfg, buffer, buflen);
 			}
 
+			public override int get_stats(IntPtr tapcfg, out DeviceStats stats) {
+				return tapcfg_get_stats(tapcfg, out stats);
+			}
+
 			[DllImport("tapcfg32", CallingConvention=CallingConvention.Cdecl)]
 			private static extern int tapcfg_get_version();
 			[DllImport("tapcfg32", CallingConvention=CallingConvention.Cdecl)]
@@ -235,6 +260,9 @@ namespace TAPNet {
 			private static extern int tapcfg_iface_set_dhcp_options(IntPtr tapcfg, byte[] buffer, int buflen);
 			[DllImport("tapcfg32", CallingConvention=CallingConvention.Cdecl)]
 			private static extern int tapcfg_iface_set_dhcpv6_options(IntPtr tapcfg, byte[] buffer, int buflen);
+
+			[DllImport("tapcfg32", CallingConvention=CallingConvention.Cdecl)]
+			private static extern int tapcfg_get_stats(IntPtr tapcfg, out DeviceStats stats);
 		}
 
 		private class NativeLib64 : NativeLib {
@@ -340,6 +368,10 @@ namespace TAPNet {
 				return tapcfg_iface_set_dhcpv6_options(tapcfg, buffer, buflen);
 			}
 
+			public override int get_stats(IntPtr tapcfg, out DeviceStats stats) {
+				return tapcfg_get_stats(tapcfg, out stats);
+			}
+
 			[DllImport("tapcfg64", CallingConvention=CallingConvention.Cdecl)]
 			private static extern int tapcfg_get_version();
 			[DllImport("tapcfg64", CallingConvention=CallingConvention.Cdecl)]
@@ -391,6 +423,9 @@ namespace TAPNet {
 			private static extern int tapcfg_iface_set_dhcp_options(IntPtr tapcfg, byte[] buffer, int buflen);
 			[DllImport("tapcfg64", CallingConvention=CallingConvention.Cdecl)]
 			private static extern int tapcfg_iface_set_dhcpv6_options(IntPtr tapcfg, byte[] buffer, int buflen);
+
+			[DllImport("tapcfg64", CallingConvention=CallingConvention.Cdecl)]
+			private static extern int tapcfg_get_stats(IntPtr tapcfg, out DeviceStats stats);
 		}
 	}
 }
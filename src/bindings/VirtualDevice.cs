@@ -96,7 +96,8 @@ namespace TAPNet {
 		}
 
 		public byte[] Read() {
-			byte[] buffer = new byte[4096];
+			/* Room for the MTU and the maximum Ethernet header */
+			byte[] buffer = new byte[Math.Max(MTU + 22, 4096)];
 
 			int len = ReadTo(buffer);
 			byte[] ret = new byte[len];
@@ -186,6 +187,17 @@ namespace TAPNet {
 			}
 		}
 
+		public DeviceStats Stats {
+			get {
+				DeviceStats stats;
+
+				if (_tapcfg.get_stats(_handle, out stats) < 0) {
+					throw new Exception("Error getting TAP device statistics");
+				}
+				return stats;
+			}
+		}
+
 		public void SetAddress(IPAddress address, byte netbits) {
 			int ret;
 
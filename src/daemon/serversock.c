@@ -44,8 +44,8 @@ struct serversock_s {
 	int fd;
 };
 
-serversock_t *
-serversock_tcp(unsigned short *local_port, int use_ipv6, int public)
+static serversock_t *
+serversock_create(unsigned short *local_port, int use_ipv6, int public, int type)
 {
 	serversock_t *server;
 	int server_fd = -1;
@@ -89,7 +89,7 @@ serversock_tcp(unsigned short *local_port, int use_ipv6, int public)
 	saddr4.sin_addr.s_addr = htonl(public ? INADDR_ANY : INADDR_LOOPBACK);
 	saddr4.sin_port = htons(*local_port);
 
-	server_fd = socket(socket_domain, SOCK_STREAM, 0);
+	server_fd = socket(socket_domain, type, 0);
 	if (server_fd == -1) {
 		/* XXX Error opening socket */
 		goto err;
@@ -110,7 +110,8 @@ serversock_tcp(unsigned short *local_port, int use_ipv6, int public)
 #endif
 	}
 
-	if (listen(server_fd, 0) == -1) {
+	/* Hundreds of peers may connect at once, don't drop them */
+	if (type == SOCK_STREAM && listen(server_fd, SOMAXCONN) == -1) {
 		/* XXX Error starting to listen socket */
 		goto err;
 	}
@@ -128,6 +129,18 @@ err:
 	return NULL;
 }
 
+serversock_t *
+serversock_tcp(unsigned short *local_port, int use_ipv6, int public)
+{
+	return serversock_create(local_port, use_ipv6, public, SOCK_STREAM);
+}
+
+serversock_t *
+serversock_udp(unsigned short *local_port, int use_ipv6, int public)
+{
+	return serversock_create(local_port, use_ipv6, public, SOCK_DGRAM);
+}
+
 int
 serversock_get_fd(serversock_t *server)
 {
@@ -21,6 +21,7 @@
 typedef struct serversock_s serversock_t;
 
 serversock_t *serversock_tcp(unsigned short *local_port, int use_ipv6, int public);
+serversock_t *serversock_udp(unsigned short *local_port, int use_ipv6, int public);
 int serversock_get_fd(serversock_t *server);
 int serversock_accept(serversock_t *server);
 void serversock_destroy(serversock_t *server);
@@ -44,9 +44,10 @@ handle_sigint(int sign)
 static void usage(char *prog)
 {
 	printf("Usage of the program:\n");
-	printf("    %s server <port>\n", prog);
-	printf("    %s client [-4|-6] <host> <port>\n", prog);
-	printf("    %s forwarder <port>\n", prog);
+	printf("    %s [-u] server <port>\n", prog);
+	printf("    %s [-u] client [-4|-6] <host> <port>\n", prog);
+	printf("    %s [-u] forwarder <port>\n", prog);
+	printf("With -u the frames are sent over UDP instead of TCP\n");
 }
 
 int main(int argc, char *argv[]) {
@@ -54,7 +55,9 @@ int main(int argc, char *argv[]) {
 	tapserver_t *server = NULL;
 	unsigned short port = 0;
 	char buffer[256];
+	char *prog = argv[0];
 	int listen = 1;
+	int udp = 0;
 	int id;
 
 #ifdef _WIN32
@@ -78,12 +81,18 @@ int main(int argc, char *argv[]) {
 		return -1;
 	}
 #endif
+	if (argc > 1 && !strcmp(argv[1], "-u")) {
+		udp = 1;
+		argc--;
+		argv++;
+	}
+
 	if (argc < 2 ||
 	    (!strcmp(argv[1], "server") && argc < 3) ||
 	    (!strcmp(argv[1], "client") && argc < 5) ||
 	    (!strcmp(argv[1], "forwarder") && argc < 3)) {
 		printf("Too few arguments for the application\n");
-		usage(argv[0]);
+		usage(prog);
 		return -1;
 	}
 
@@ -91,7 +100,7 @@ int main(int argc, char *argv[]) {
 	    strcmp(argv[1], "client") &&
 	    strcmp(argv[1], "forwarder")) {
 		printf("Invalid command: \"%s\"\n", argv[1]);
-		usage(argv[0]);
+		usage(prog);
 		return -1;
 	}
 
@@ -112,6 +121,7 @@ int main(int argc, char *argv[]) {
 
 	if (!strcmp(argv[1], "client")) {
 		int sfd = -1;
+		int peered = 0;
 #ifdef HAVE_GETADDRINFO
 		struct addrinfo hints, *result, *saddr;
 
@@ -120,9 +130,9 @@ int main(int argc, char *argv[]) {
 			hints.ai_family = AF_INET;
 		else
 			hints.ai_family = AF_INET6;
-		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_socktype = udp ? SOCK_DGRAM : SOCK_STREAM;
 		hints.ai_flags = 0;
-		hints.ai_protocol = IPPROTO_TCP;
+		hints.ai_protocol = udp ? IPPROTO_UDP : IPPROTO_TCP;
 
 		if (getaddrinfo(argv[3], argv[4], &hints, &result)) {
 			printf("Unable to resolve host name and port: %s %s\n",
@@ -131,6 +141,13 @@ int main(int argc, char *argv[]) {
 		}
 
 		for (saddr = result; saddr != NULL; saddr = saddr->ai_next) {
+			if (udp) {
+				/* Nothing to connect, the first address is used */
+				peered = !tapserver_add_peer(server, saddr->ai_addr,
+				                             saddr->ai_addrlen);
+				break;
+			}
+
 			sfd = socket(saddr->ai_family, saddr->ai_socktype,
 			             saddr->ai_protocol);
 			if (sfd == -1)
@@ -150,8 +167,10 @@ int main(int argc, char *argv[]) {
 		saddr.sin_addr.s_addr = inet_addr(argv[3]);
 		saddr.sin_port = atoi(argv[4]); 
 
-		sfd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-		if (sfd != -1) {
+		if (udp) {
+			peered = !tapserver_add_peer(server, (struct sockaddr *) &saddr,
+			                             sizeof(saddr));
+		} else if ((sfd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) != -1) {
 			if (connect(sfd, (struct sockaddr *) &saddr, sizeof(saddr)) == -1) {
 				close(sfd);
 				sfd = -1;
@@ -159,13 +178,15 @@ int main(int argc, char *argv[]) {
 		}
 #endif
 
-		if (sfd == -1) {
+		if (sfd == -1 && !peered) {
 			printf("Could not connect to host: %s %s\n",
 			       argv[3], argv[4]);
 			goto exit;
 		}
 
-		tapserver_add_client(server, sfd);
+		if (!udp) {
+			tapserver_add_client(server, sfd);
+		}
 		listen = 0;
 	}
 
@@ -185,7 +206,6 @@ int main(int argc, char *argv[]) {
 
 		ifname = tapcfg_get_ifname(tapcfg);
 		printf("Got ifname: %s\n", ifname);
-		free(ifname);
 
 		srand(time(NULL));
 		id = rand()%0x1000;
@@ -213,7 +233,8 @@ int main(int argc, char *argv[]) {
 		}
 	}
 
-	if (tapserver_start(server, port, listen) < 0) {
+	if ((udp ? tapserver_start_udp(server, port, listen) :
+	           tapserver_start(server, port, listen)) < 0) {
 		printf("Error starting the tapserver\n");
 		goto exit;
 	}
@@ -226,7 +247,20 @@ int main(int argc, char *argv[]) {
 
 exit:
 	if (server) {
+		tapserver_stats_t stats;
+
 		tapserver_stop(server);
+		tapserver_get_stats(server, &stats);
+		printf("Sent %llu frames to clients, dropped %llu frames (%llu bytes), "
+		       "%llu send errors, %llu clients disconnected\n",
+		       stats.sent_frames, stats.dropped_frames, stats.dropped_bytes,
+		       stats.send_errors, stats.disconnected);
+		if (udp) {
+			printf("Sent %llu datagrams, received %llu datagrams, "
+			       "dropped %llu datagrams\n",
+			       stats.sent_datagrams, stats.received_datagrams,
+			       stats.dropped_datagrams);
+		}
 		tapserver_destroy(server);
 	}
 	if (tapcfg) {
@@ -13,6 +13,11 @@
  *  Lesser General Public License for more details.
  */
 
+#if defined(__linux__)
+/* Needed for the batched datagram calls */
+#  define _GNU_SOURCE
+#endif
+
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
@@ -25,17 +30,113 @@
 #  include <windows.h>
 #  include <winsock2.h>
 #  include <ws2tcpip.h>
+#  define SHUT_RDWR SD_BOTH
+#  define SOCKET_WOULDBLOCK() (WSAGetLastError() == WSAEWOULDBLOCK)
+typedef WSABUF iovec_t;
+#  define IOVEC_SET(iov, base, size) \
+	((iov).buf = (char *) (base), (iov).len = (size))
 #else
 #  include <netinet/in.h>
+#  include <netinet/tcp.h>
 #  include <sys/types.h>
 #  include <sys/socket.h>
+#  include <sys/uio.h>
+#  include <fcntl.h>
+#  include <time.h>
+#  define SOCKET_WOULDBLOCK() (errno == EAGAIN || errno == EWOULDBLOCK)
+typedef struct iovec iovec_t;
+#  define IOVEC_SET(iov, base, size) \
+	((iov).iov_base = (void *) (base), (iov).iov_len = (size))
+#endif
+#ifndef MSG_NOSIGNAL
+#  define MSG_NOSIGNAL 0
+#endif
+#if defined(__linux__)
+#  include <sys/epoll.h>
 #endif
 
 #include "tapserver.h"
 #include "serversock.h"
 #include "threads.h"
 
-#define MAX_CLIENTS 5
+/* Frames are prefixed with a 16-bit length on the wire, so this is the
+ * largest frame we can ever transfer, which also covers jumbo frames */
+#define TAPSERVER_BUFSIZE 65535
+
+/* Data read from a client with a single call, big enough for the
+ * largest frame and the partial frame left over from the last read */
+#define TAPSERVER_RECVSIZE (2 * (TAPSERVER_BUFSIZE + 2))
+
+/* Number of ready sockets handled after a single wait */
+#define TAPSERVER_MAXEVENTS 64
+
+/* Default limit of the data waiting to be sent to a single client */
+#define TAPSERVER_QUEUESIZE (256*1024)
+
+/* Frames held back for coalescing are sent when this much is pending,
+ * even if the latency budget is not used up */
+#define TAPSERVER_COALESCE (64*1024)
+
+#define TAPSERVER_READABLE 1
+#define TAPSERVER_WRITABLE 2
+
+typedef struct tapserver_event_s {
+	void *ptr;
+	int events;
+} tapserver_event_t;
+
+/* Clients are allocated separately, so that the poller can keep
+ * pointing to them while the table is grown and reordered */
+typedef struct tapserver_client_s {
+	int fd;
+	int idx;
+
+	/* Sending to the client failed, removed by the writer thread */
+	int failed;
+
+	/* The socket blocked and is waited for writability */
+	int writing;
+
+	/* Received data, starting with a partial frame if any */
+	unsigned char *recvbuf;
+	int recvlen;
+
+	/* Frames not accepted by the socket yet, allocated when the
+	 * socket first blocks and sent when it becomes writable */
+	unsigned char *queue;
+	int queue_size;
+	int queue_head;
+	int queue_len;
+} tapserver_client_t;
+
+/* Most datagrams queued for a single peer before a flush */
+#define TAPSERVER_UDP_MAXDGRAMS 256
+
+/* Data read from the datagram socket with a single receive, with
+ * receive offload the kernel can merge datagrams up to this size */
+#define TAPSERVER_UDP_RECVSIZE 65536
+
+/* Peers of the datagram transport are identified by their address,
+ * the configured ones are kept and the learned ones time out */
+typedef struct tapserver_peer_s {
+	struct sockaddr_storage addr;
+	int addrlen;
+	int idx;
+	int permanent;
+
+	/* Next peer in the same bucket of the address hash */
+	struct tapserver_peer_s *hnext;
+
+	/* Times of the last datagram in both directions, in milliseconds */
+	unsigned long long last_seen;
+	unsigned long long last_sent;
+
+	/* Datagrams waiting for the next flush, stored back to back */
+	unsigned char *sendbuf;
+	int sendlen;
+	int dgrams[TAPSERVER_UDP_MAXDGRAMS];
+	int ndgrams;
+} tapserver_peer_t;
 
 struct tapserver_s {
 	serversock_t *serversock;
@@ -47,18 +148,199 @@ struct tapserver_s {
 	mutex_handle_t run_mutex;
 
 	int listening;
-	int max_clients;
 	tapcfg_t *tapcfg;
 	int waitms;
 
 	int clients;
-	int clienttab[MAX_CLIENTS];
+	int maxclients;
+	tapserver_client_t **clienttab;
 	mutex_handle_t mutex;
 
+	int queue_size;
+	int queue_policy;
+	int latency;
+	tapserver_stats_t stats;
+
+	/* The epoll instance and a pipe waking it up when stopping,
+	 * both are -1 on systems where the sockets are selected */
+	int epoll_fd;
+	int wakeup_fd[2];
+
+	/* Datagram socket used instead of the stream sockets, frames are
+	 * exchanged with the peers and unknown senders are learned only
+	 * if the socket is listening */
+	int udp;
+	int udp_fd;
+	int udp_accept;
+	int udp_gso;
+	int udp_gro;
+	unsigned char *udp_recvbuf;
+	unsigned long long udp_maintained;
+
+	int peers;
+	int maxpeers;
+	tapserver_peer_t **peertab;
+
+	/* Peers hashed by their address and port, the number of buckets
+	 * is the size of the peer table so that it stays a power of two */
+	tapserver_peer_t **peerhash;
+
 	thread_handle_t reader;
 	thread_handle_t writer;
 };
 
+#if defined(__linux__)
+static int
+tapserver_poll_ctl(tapserver_t *server, int op, int fd, void *ptr, int events)
+{
+	struct epoll_event event;
+
+	memset(&event, 0, sizeof(event));
+	if (events & TAPSERVER_READABLE)
+		event.events |= EPOLLIN;
+	if (events & TAPSERVER_WRITABLE)
+		event.events |= EPOLLOUT;
+	event.data.ptr = ptr;
+
+	return epoll_ctl(server->epoll_fd, op, fd, &event);
+}
+#endif
+
+static int
+tapserver_poll_add(tapserver_t *server, int fd, void *ptr)
+{
+#if defined(__linux__)
+	return tapserver_poll_ctl(server, EPOLL_CTL_ADD, fd, ptr,
+	                          TAPSERVER_READABLE);
+#else
+	/* The selected fds are collected from the client table */
+	return 0;
+#endif
+}
+
+/* Clients are waited for writability while their socket is blocked */
+static void
+tapserver_poll_update(tapserver_t *server, tapserver_client_t *client)
+{
+#if defined(__linux__)
+	tapserver_poll_ctl(server, EPOLL_CTL_MOD, client->fd, client,
+	                   TAPSERVER_READABLE |
+	                   (client->writing ? TAPSERVER_WRITABLE : 0));
+#endif
+}
+
+static void
+tapserver_poll_remove(tapserver_t *server, int fd)
+{
+#if defined(__linux__)
+	/* Old kernels require the event even though it's not used */
+	tapserver_poll_ctl(server, EPOLL_CTL_DEL, fd, NULL, 0);
+#endif
+}
+
+/* Wait until some of the sockets are ready and fill in the pointers
+ * they were added with, the listening socket is &server->server_fd, the
+ * datagram socket &server->udp_fd and the wakeup pipe server->wakeup_fd.
+ * Timeout is in milliseconds or -1. Returns the number of events. */
+static int
+tapserver_poll_wait(tapserver_t *server, tapserver_event_t *ready, int maxready,
+                    int timeout)
+{
+#if defined(__linux__)
+	struct epoll_event events[TAPSERVER_MAXEVENTS];
+	int i, ret;
+
+	if (maxready > TAPSERVER_MAXEVENTS) {
+		maxready = TAPSERVER_MAXEVENTS;
+	}
+
+	/* Stopping the server writes into the wakeup pipe */
+	ret = epoll_wait(server->epoll_fd, events, maxready, timeout);
+	if (ret == -1) {
+		return (errno == EINTR) ? 0 : -1;
+	}
+	for (i=0; i<ret; i++) {
+		ready[i].ptr = events[i].data.ptr;
+		ready[i].events = 0;
+		/* Errors are noticed when reading from the socket */
+		if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+			ready[i].events |= TAPSERVER_READABLE;
+		if (events[i].events & EPOLLOUT)
+			ready[i].events |= TAPSERVER_WRITABLE;
+	}
+
+	return ret;
+#else
+	fd_set rfds, wfds;
+	struct timeval tv;
+	int highest_fd = -1;
+	int i, count = 0;
+
+	FD_ZERO(&rfds);
+	FD_ZERO(&wfds);
+
+	MUTEX_LOCK(server->mutex);
+	if (server->listening) {
+		FD_SET(server->server_fd, &rfds);
+		highest_fd = server->server_fd;
+	}
+	if (server->udp) {
+		FD_SET(server->udp_fd, &rfds);
+		if (server->udp_fd > highest_fd) {
+			highest_fd = server->udp_fd;
+		}
+	}
+	for (i=0; i<server->clients; i++) {
+		tapserver_client_t *client = server->clienttab[i];
+
+		FD_SET(client->fd, &rfds);
+		if (client->writing) {
+			FD_SET(client->fd, &wfds);
+		}
+		if (client->fd > highest_fd) {
+			highest_fd = client->fd;
+		}
+	}
+	MUTEX_UNLOCK(server->mutex);
+
+	/* Without a wakeup pipe the running flag is checked regularly */
+	if (timeout < 0 || timeout > server->waitms) {
+		timeout = server->waitms;
+	}
+	tv.tv_sec = timeout / 1000;
+	tv.tv_usec = (timeout % 1000) * 1000;
+	if (select(highest_fd+1, &rfds, &wfds, NULL, &tv) < 0) {
+		return -1;
+	}
+
+	if (server->listening && FD_ISSET(server->server_fd, &rfds)) {
+		ready[count].ptr = &server->server_fd;
+		ready[count].events = TAPSERVER_READABLE;
+		count++;
+	}
+	if (server->udp && FD_ISSET(server->udp_fd, &rfds)) {
+		ready[count].ptr = &server->udp_fd;
+		ready[count].events = TAPSERVER_READABLE;
+		count++;
+	}
+	MUTEX_LOCK(server->mutex);
+	for (i=0; i<server->clients && count<maxready; i++) {
+		tapserver_client_t *client = server->clienttab[i];
+
+		ready[count].ptr = client;
+		ready[count].events = 0;
+		if (FD_ISSET(client->fd, &rfds))
+			ready[count].events |= TAPSERVER_READABLE;
+		if (FD_ISSET(client->fd, &wfds))
+			ready[count].events |= TAPSERVER_WRITABLE;
+		if (ready[count].events)
+			count++;
+	}
+	MUTEX_UNLOCK(server->mutex);
+
+	return count;
+#endif
+}
 
 tapserver_t *
 tapserver_init(tapcfg_t *tapcfg, int waitms)
@@ -69,85 +351,459 @@ tapserver_init(tapcfg_t *tapcfg, int waitms)
 	if (!server) {
 		return NULL;
 	}
-	server->max_clients = MAX_CLIENTS;
 	server->tapcfg = tapcfg;
 	server->waitms = waitms;
+	server->queue_size = TAPSERVER_QUEUESIZE;
+	server->queue_policy = TAPSERVER_POLICY_DROP;
 	MUTEX_CREATE(server->run_mutex);
 	MUTEX_CREATE(server->mutex);
 
+	server->epoll_fd = -1;
+	server->wakeup_fd[0] = -1;
+	server->wakeup_fd[1] = -1;
+#if defined(__linux__)
+	server->epoll_fd = epoll_create(64);
+	if (server->epoll_fd == -1 || pipe(server->wakeup_fd) == -1 ||
+	    tapserver_poll_add(server, server->wakeup_fd[0],
+	                       server->wakeup_fd) == -1) {
+		tapserver_destroy(server);
+		return NULL;
+	}
+#endif
+
 	return server;
 }
 
 void
 tapserver_destroy(tapserver_t *server)
 {
+	int i;
+
 	if (server) {
+		for (i=0; i<server->clients; i++) {
+			close(server->clienttab[i]->fd);
+			free(server->clienttab[i]->recvbuf);
+			free(server->clienttab[i]->queue);
+			free(server->clienttab[i]);
+		}
+		free(server->clienttab);
+
+		for (i=0; i<server->peers; i++) {
+			free(server->peertab[i]->sendbuf);
+			free(server->peertab[i]);
+		}
+		free(server->peertab);
+		free(server->peerhash);
+		free(server->udp_recvbuf);
+
+		if (server->epoll_fd != -1)
+			close(server->epoll_fd);
+		if (server->wakeup_fd[0] != -1)
+			close(server->wakeup_fd[0]);
+		if (server->wakeup_fd[1] != -1)
+			close(server->wakeup_fd[1]);
+
 		MUTEX_DESTROY(server->mutex);
 		MUTEX_DESTROY(server->run_mutex);
 	}
 	free(server);
 }
 
+void
+tapserver_set_queue(tapserver_t *server, int size, int policy)
+{
+	assert(server);
+
+	/* The queue has to fit at least a single frame */
+	if (size < TAPSERVER_BUFSIZE + 2) {
+		size = TAPSERVER_BUFSIZE + 2;
+	}
+
+	MUTEX_LOCK(server->mutex);
+	server->queue_size = size;
+	server->queue_policy = policy;
+	MUTEX_UNLOCK(server->mutex);
+}
+
+void
+tapserver_set_latency(tapserver_t *server, int usec)
+{
+	assert(server);
+
+	MUTEX_LOCK(server->mutex);
+	server->latency = (usec > 0) ? usec : 0;
+	MUTEX_UNLOCK(server->mutex);
+}
+
+void
+tapserver_get_stats(tapserver_t *server, tapserver_stats_t *stats)
+{
+	assert(server);
+	assert(stats);
+
+	MUTEX_LOCK(server->mutex);
+	memcpy(stats, &server->stats, sizeof(tapserver_stats_t));
+	MUTEX_UNLOCK(server->mutex);
+}
+
+static int
+set_nonblocking(int fd)
+{
+#if defined(_WIN32) || defined(_WIN64)
+	u_long enabled = 1;
+
+	return (ioctlsocket(fd, FIONBIO, &enabled) == 0) ? 0 : -1;
+#else
+	int flags;
+
+	flags = fcntl(fd, F_GETFL);
+	if (flags == -1) {
+		return -1;
+	}
+
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+#endif
+}
+
 int
 tapserver_add_client(tapserver_t *server, int fd)
 {
+	tapserver_client_t *client;
+	int nodelay = 1;
+
 	assert(server);
 
+	/* Sends to the client must never block the other clients */
+	if (set_nonblocking(fd) == -1) {
+		return -1;
+	}
+
+	/* Frames are coalesced before sending, so Nagle would only add
+	 * delay to the last segment of every flush */
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (void *) &nodelay, sizeof(nodelay));
+
+	client = calloc(1, sizeof(tapserver_client_t));
+	if (!client) {
+		return -1;
+	}
+	client->fd = fd;
+
 	MUTEX_LOCK(server->mutex);
-	if (server->clients >= server->max_clients) {
+	if (server->clients == server->maxclients) {
+		tapserver_client_t **clienttab;
+		int maxclients;
+
+		maxclients = server->maxclients ? server->maxclients * 2 : 16;
+		clienttab = realloc(server->clienttab,
+		                    maxclients * sizeof(tapserver_client_t *));
+		if (!clienttab) {
+			MUTEX_UNLOCK(server->mutex);
+			free(client);
+			return -1;
+		}
+		server->clienttab = clienttab;
+		server->maxclients = maxclients;
+	}
+
+	/* Added while locked, so the writer can't remove it before
+	 * it's found in the table */
+	if (tapserver_poll_add(server, fd, client) == -1) {
 		MUTEX_UNLOCK(server->mutex);
+		free(client);
 		return -1;
 	}
-	server->clienttab[server->clients] = fd;
-	server->clients++;
+	client->idx = server->clients;
+	server->clienttab[server->clients++] = client;
 	MUTEX_UNLOCK(server->mutex);
 
 	return 0;
 }
 
+/* Has to be called with the mutex locked and only by the writer thread,
+ * so that no returned event can point to the freed client */
 static void
-remove_client(tapserver_t *server, int idx)
+remove_client(tapserver_t *server, tapserver_client_t *client)
 {
+	tapserver_client_t *last;
+
 	assert(server);
-	assert(idx < server->clients);
+	assert(client->idx < server->clients);
+
+	tapserver_poll_remove(server, client->fd);
+	close(client->fd);
+	free(client->recvbuf);
+	free(client->queue);
+
+	/* The order of the clients doesn't matter */
+	last = server->clienttab[--server->clients];
+	server->clienttab[client->idx] = last;
+	last->idx = client->idx;
+	free(client);
+}
 
-	if (idx < (server->clients-1)) {
-		memmove(&server->clienttab[idx],
-			&server->clienttab[idx+1],
-			sizeof(int) *
-			(server->clients - idx - 1));
+/* Has to be called with the mutex locked, the shutdown makes the socket
+ * readable and the writer thread removes the client when it notices */
+static void
+fail_client(tapserver_client_t *client)
+{
+	if (!client->failed) {
+		client->failed = 1;
+		shutdown(client->fd, SHUT_RDWR);
 	}
-	server->clients--;
 }
 
+static unsigned long long
+tapserver_usec()
+{
+#if defined(_WIN32) || defined(_WIN64)
+	LARGE_INTEGER now, freq;
+
+	QueryPerformanceCounter(&now);
+	QueryPerformanceFrequency(&freq);
+	return now.QuadPart * 1000000 / freq.QuadPart;
+#else
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+#endif
+}
+
+/* All the buffers are sent with a single system call */
 static int
-send_data(int s, void *buf, int len)
+send_iov(int s, iovec_t *iov, int iovcnt)
 {
-	int sent = 0;
+#if defined(_WIN32) || defined(_WIN64)
+	DWORD sent;
 
-	while (len > sent) {
-		int ret = send(s, buf+sent, len-sent, 0);
-		if (ret == -1)
-			return -1;
-		sent += ret;
+	if (WSASend(s, iov, iovcnt, &sent, 0, NULL, NULL) != 0) {
+		return -1;
 	}
-
 	return sent;
+#else
+	struct msghdr msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+
+	return sendmsg(s, &msg, MSG_NOSIGNAL);
+#endif
 }
 
+#include "tapserver_udp.h"
+
+static void
+client_set_writing(tapserver_t *server, tapserver_client_t *client, int writing)
+{
+	if (client->writing != writing) {
+		client->writing = writing;
+		tapserver_poll_update(server, client);
+	}
+}
+
+/* Has to be called with the mutex locked, sends the queued data
+ * until the socket would block. Returns -1 if the sending failed. */
 static int
-recv_data(int s, void *buf, int len)
+client_flush(tapserver_t *server, tapserver_client_t *client)
 {
-	int recvd = 0;
+	iovec_t iov[2];
+	int len, ret;
+
+	while (client->queue_len) {
+		/* The queued data may wrap around the end of the buffer */
+		len = client->queue_size - client->queue_head;
+		if (len > client->queue_len)
+			len = client->queue_len;
+		IOVEC_SET(iov[0], client->queue + client->queue_head, len);
+		IOVEC_SET(iov[1], client->queue, client->queue_len - len);
+
+		ret = send_iov(client->fd, iov, (client->queue_len > len) ? 2 : 1);
+		if (ret == -1) {
+			if (!SOCKET_WOULDBLOCK())
+				return -1;
+			break;
+		}
+		client->queue_head = (client->queue_head + ret) % client->queue_size;
+		client->queue_len -= ret;
+	}
+	client_set_writing(server, client, client->queue_len != 0);
 
-	while (len > recvd) {
-		int ret = recv(s, buf+recvd, len-recvd, 0);
-		if (ret == -1)
-			return -1;
-		recvd += ret;
+	return 0;
+}
+
+/* Has to be called with the mutex locked, sends the frames held back
+ * for coalescing to all the clients */
+static void
+flush_clients(tapserver_t *server)
+{
+	tapserver_client_t *client;
+	int i;
+
+	for (i=0; i<server->clients; i++) {
+		client = server->clienttab[i];
+		if (client->failed || client->writing || !client->queue_len) {
+			continue;
+		}
+		if (client_flush(server, client) == -1) {
+			server->stats.send_errors++;
+			fail_client(client);
+		}
 	}
+	udp_flush(server);
+}
+
+static void
+client_enqueue(tapserver_client_t *client, const unsigned char *data, int len)
+{
+	int tail, chunk;
 
-	return recvd;
+	tail = (client->queue_head + client->queue_len) % client->queue_size;
+	chunk = client->queue_size - tail;
+	if (chunk > len)
+		chunk = len;
+
+	memcpy(client->queue + tail, data, chunk);
+	memcpy(client->queue, data + chunk, len - chunk);
+	client->queue_len += len;
+}
+
+/* Has to be called with the mutex locked. Without flush the frame is
+ * only queued and sent later with the other frames by flush_clients.
+ * When flushing and nothing is queued the length and the frame are
+ * sent right away with a single call, whatever the socket doesn't
+ * accept is queued. If the queue is full the frame is dropped or the
+ * client is disconnected, depending on the policy of the server. */
+static void
+client_send(tapserver_t *server, tapserver_client_t *client,
+            const unsigned char *buf, int len, int flush)
+{
+	unsigned char sizebuf[2];
+	iovec_t iov[2];
+	int total, sent = 0;
+	int direct, ret;
+
+	if (client->failed) {
+		return;
+	}
+
+	total = len + 2;
+	if (!client->queue) {
+		client->queue_size = server->queue_size;
+	}
+	if (client->queue_len + total > client->queue_size) {
+		if (server->queue_policy == TAPSERVER_POLICY_DISCONNECT) {
+			server->stats.disconnected++;
+			fail_client(client);
+		} else {
+			server->stats.dropped_frames++;
+			server->stats.dropped_bytes += len;
+		}
+		return;
+	}
+
+	sizebuf[0] = (len >> 8) & 0xff;
+	sizebuf[1] = len & 0xff;
+
+	direct = flush && !client->queue_len;
+	if (direct) {
+		IOVEC_SET(iov[0], sizebuf, 2);
+		IOVEC_SET(iov[1], buf, len);
+		ret = send_iov(client->fd, iov, 2);
+		if (ret == -1) {
+			if (!SOCKET_WOULDBLOCK()) {
+				server->stats.send_errors++;
+				fail_client(client);
+				return;
+			}
+			ret = 0;
+		}
+		sent = ret;
+		if (sent == total) {
+			server->stats.sent_frames++;
+			return;
+		}
+	}
+
+	if (!client->queue) {
+		client->queue = malloc(client->queue_size);
+		if (!client->queue) {
+			/* The rest of the frame can't be sent */
+			server->stats.disconnected++;
+			fail_client(client);
+			return;
+		}
+	}
+	if (sent < 2) {
+		client_enqueue(client, sizebuf + sent, 2 - sent);
+		client_enqueue(client, buf, len);
+	} else {
+		client_enqueue(client, buf + sent - 2, total - sent);
+	}
+	server->stats.sent_frames++;
+
+	if (direct) {
+		/* The socket didn't take the whole frame */
+		client_set_writing(server, client, 1);
+	} else if (flush && !client->writing &&
+	           client_flush(server, client) == -1) {
+		server->stats.send_errors++;
+		fail_client(client);
+	}
+}
+
+/* Reads the frames available from the device and sends them to the
+ * clients or peers. With a latency budget frames are held back while more of
+ * them keep arriving, so that they are sent together in full segments
+ * and no frame waits longer than the budget. */
+static int
+reader_batch(tapserver_t *server, unsigned char *buf)
+{
+	tapcfg_t *tapcfg = server->tapcfg;
+	unsigned long long start, elapsed = 0;
+	int latency, pending = 0;
+	int i, len;
+
+	MUTEX_LOCK(server->mutex);
+	latency = server->latency;
+	MUTEX_UNLOCK(server->mutex);
+
+	start = tapserver_usec();
+	do {
+		len = tapcfg_read(tapcfg, buf, TAPSERVER_BUFSIZE);
+		if (len <= 0) {
+			break;
+		}
+
+		/* Sending doesn't block, so a slow client can't stop
+		 * the device from being read */
+		MUTEX_LOCK(server->mutex);
+		for (i=0; i<server->clients; i++) {
+			client_send(server, server->clienttab[i], buf, len, !latency);
+		}
+		for (i=0; i<server->peers; i++) {
+			udp_send(server, server->peertab[i], buf, len);
+		}
+		if (!latency) {
+			udp_flush(server);
+		}
+		MUTEX_UNLOCK(server->mutex);
+
+		pending += len + 2;
+		if (!latency || pending >= TAPSERVER_COALESCE) {
+			break;
+		}
+		elapsed = tapserver_usec() - start;
+	} while (elapsed < latency &&
+	         tapcfg_wait_readable(tapcfg, (latency - elapsed) / 1000));
+
+	if (latency && pending) {
+		MUTEX_LOCK(server->mutex);
+		flush_clients(server);
+		MUTEX_UNLOCK(server->mutex);
+	}
+
+	return len;
 }
 
 static THREAD_RETVAL
@@ -155,9 +811,8 @@ reader_thread(void *arg)
 {
 	tapserver_t *server = arg;
 	tapcfg_t *tapcfg = server->tapcfg;
-	unsigned char buf[4096];
+	unsigned char *buf;
 	int running;
-	int i, tmp;
 
 	assert(server);
 
@@ -166,47 +821,105 @@ reader_thread(void *arg)
 		return 0;
 	}
 
+	buf = malloc(TAPSERVER_BUFSIZE);
+	if (!buf) {
+		return 0;
+	}
+
 	printf("Starting reader thread\n");
 
 	do {
 		while (tapcfg_wait_readable(tapcfg, server->waitms)) {
-			int len;
-
-			len = tapcfg_read(tapcfg, buf, sizeof(buf));
-			if (len <= 0) {
+			if (reader_batch(server, buf) <= 0) {
 				/* XXX: We could quite more nicely */
 				break;
 			}
-			printf("Read %d bytes from the device\n", len);
+		}
 
-			MUTEX_LOCK(server->mutex);
-			for (i=0; i<server->clients; i++) { 
-				unsigned char sizebuf[2];
+		MUTEX_LOCK(server->run_mutex);
+		running = server->running;
+		MUTEX_UNLOCK(server->run_mutex);
+	} while (running);
 
-				sizebuf[0] = (len >> 8) & 0xff;
-				sizebuf[1] = len & 0xff;
+	printf("Stopping reader thread\n");
+	free(buf);
 
-				/* Write received data length */
-				tmp = send_data(server->clienttab[i], sizebuf, 2);
-				if (tmp > 0) {
-					/* Write received data */
-					tmp = send_data(server->clienttab[i], buf, len);
-				}
+	return 0;
+}
+
+/* Reads what the client has sent with a single call and handles all
+ * the complete frames, a partial frame is kept for the next read.
+ * Returns -1 if writing to the device failed and the server stops. */
+static int
+client_readable(tapserver_t *server, tapserver_client_t *client)
+{
+	tapcfg_t *tapcfg = server->tapcfg;
+	unsigned char *frame;
+	int pos = 0;
+	int i, len, ret;
+
+	/* Only the writer thread removes clients, so it can be read
+	 * without the lock held */
+	if (client->failed) {
+		goto remove;
+	}
+	if (!client->recvbuf) {
+		client->recvbuf = malloc(TAPSERVER_RECVSIZE);
+		if (!client->recvbuf) {
+			goto remove;
+		}
+	}
+
+	ret = recv(client->fd, client->recvbuf + client->recvlen,
+	           TAPSERVER_RECVSIZE - client->recvlen, 0);
+	if (ret == -1 && SOCKET_WOULDBLOCK()) {
+		return 0;
+	} else if (ret <= 0) {
+		goto remove;
+	}
+	client->recvlen += ret;
 
-				if (tmp <= 0) {
-					remove_client(server, i);
+	while (client->recvlen - pos >= 2) {
+		len = client->recvbuf[pos] << 8 | client->recvbuf[pos+1];
+		if (!len) {
+			/* XXX: Empty frame handled as read error */
+			goto remove;
+		}
+		if (client->recvlen - pos < len + 2) {
+			break;
+		}
+		frame = client->recvbuf + pos + 2;
+		pos += len + 2;
+
+		if (tapcfg) {
+			if (tapcfg_write(tapcfg, frame, len) <= 0) {
+				MUTEX_LOCK(server->run_mutex);
+				server->running = 0;
+				MUTEX_UNLOCK(server->run_mutex);
+				return -1;
+			}
+		} else {
+			MUTEX_LOCK(server->mutex);
+			for (i=0; i<server->clients; i++) {
+				/* Sent together when the batch has been handled */
+				if (server->clienttab[i] != client) {
+					client_send(server, server->clienttab[i], frame, len, 0);
 				}
-				printf("Wrote %d bytes to the client\n", len);
 			}
 			MUTEX_UNLOCK(server->mutex);
 		}
+	}
 
-		MUTEX_LOCK(server->run_mutex);
-		running = server->running;
-		MUTEX_UNLOCK(server->run_mutex);
-	} while (running);
+	/* The buffer always has room for the rest of the partial frame */
+	client->recvlen -= pos;
+	memmove(client->recvbuf, client->recvbuf + pos, client->recvlen);
 
-	printf("Stopping reader thread\n");
+	return 0;
+
+remove:
+	MUTEX_LOCK(server->mutex);
+	remove_client(server, client);
+	MUTEX_UNLOCK(server->mutex);
 
 	return 0;
 }
@@ -215,113 +928,82 @@ static THREAD_RETVAL
 writer_thread(void *arg)
 {
 	tapserver_t *server = arg;
-	tapcfg_t *tapcfg = server->tapcfg;
-	unsigned char buf[4096];
+	tapserver_event_t ready[TAPSERVER_MAXEVENTS];
 	int running;
-	int i, j, tmp;
+	int i, count;
 
 	assert(server);
 
 	printf("Starting writer thread\n");
 
 	do {
-		fd_set rfds;
-		struct timeval tv;
-		int highest_fd = -1;
-
-		FD_ZERO(&rfds);
-
 		MUTEX_LOCK(server->mutex);
-		if (server->listening && server->clients < server->max_clients) {
-			FD_SET(server->server_fd, &rfds);
-			highest_fd = server->server_fd;
-		}
-		for (i=0; i<server->clients; i++) {
-			FD_SET(server->clienttab[i], &rfds);
-			if (server->clienttab[i] > highest_fd) {
-				highest_fd = server->clienttab[i];
-			}
-		}
+		count = server->clients;
 		MUTEX_UNLOCK(server->mutex);
 
-		if (highest_fd == -1) {
+		if (!server->listening && !server->udp && !count) {
 			break;
 		}
 
-		tv.tv_sec = server->waitms / 1000;
-		tv.tv_usec = (server->waitms % 1000) * 1000;
-		tmp = select(highest_fd+1, &rfds, NULL, NULL, &tv);
-		if (tmp < 0) {
-			printf("Error when selecting for fds\n");
+		/* Peers are checked even if nothing is received */
+		count = tapserver_poll_wait(server, ready, TAPSERVER_MAXEVENTS,
+		                            server->udp ? TAPSERVER_MAINTAIN : -1);
+		if (count < 0) {
+			printf("Error when polling for fds\n");
 			break;
 		}
 
-		MUTEX_LOCK(server->mutex);
-		for (i=0; i<server->clients; i++) {
-			unsigned char sizebuf[2];
-			int len;
+		for (i=0; i<count; i++) {
+			tapserver_client_t *client = ready[i].ptr;
 
-			if (!FD_ISSET(server->clienttab[i], &rfds))
+			if (ready[i].ptr == server->wakeup_fd) {
+				/* Stopping, checked after the batch */
 				continue;
+			} else if (ready[i].ptr == &server->server_fd) {
+				int client_fd;
+
+				/* Accept a client and add it to the client table */
+				printf("Accepting a new client\n");
+				client_fd = serversock_accept(server->serversock);
+				if (client_fd == -1) {
+					/* XXX: This error should definitely be reported */
+					goto exit;
+				}
+				printf("Accepted a new client\n");
 
-			tmp = recv_data(server->clienttab[i], sizebuf, 2);
-			if (tmp > 0) {
-				len = (sizebuf[0]&0xff) << 8 | sizebuf[1];
-				if (len <= sizeof(buf)) {
-					tmp = recv_data(server->clienttab[i], buf, len);
-				} else {
-					/* XXX: Buffer size error handled as read error */
-					tmp = -1;
+				if (tapserver_add_client(server, client_fd) == -1) {
+					close(client_fd);
 				}
-			}
-			if (tmp <= 0) {
-				remove_client(server, i);
 				continue;
-			}
-			printf("Read %d bytes from the client\n", len);
-
-			if (tapcfg) {
-				tmp = tapcfg_write(tapcfg, buf, len);
-				if (tmp <= 0) {
-					MUTEX_LOCK(server->run_mutex);
-					server->running = 0;
-					MUTEX_UNLOCK(server->run_mutex);
-					MUTEX_UNLOCK(server->mutex);
+			} else if (ready[i].ptr == &server->udp_fd) {
+				if (udp_readable(server) == -1) {
 					goto exit;
 				}
-				printf("Wrote %d bytes to the device\n", len);
-			} else {
-				for (j=0; j<server->clients; j++) {
-					if (i == j) {
-						continue;
-					}
-
-					tmp = send_data(server->clienttab[j], sizebuf, 2);
-					if (tmp > 0) {
-						tmp = send_data(server->clienttab[j], buf, len);
-					}
-					if (tmp <= 0) {
-						remove_client(server, j);
-					}
-					printf("Wrote %d bytes to the client\n", len);
-				}
+				continue;
 			}
-		}
-		MUTEX_UNLOCK(server->mutex);
 
-		/* Accept a client and add it to the client table */
-		if (server->listening && FD_ISSET(server->server_fd, &rfds)) {
-			int client_fd;
-
-			printf("Accepting a new client\n");
-			client_fd = serversock_accept(server->serversock);
-			if (client_fd == -1) {
-				/* XXX: This error should definitely be reported */
+			/* Flushed first, reading may remove the client */
+			if (ready[i].events & TAPSERVER_WRITABLE) {
+				MUTEX_LOCK(server->mutex);
+				if (!client->failed && client_flush(server, client) == -1) {
+					server->stats.send_errors++;
+					fail_client(client);
+				}
+				MUTEX_UNLOCK(server->mutex);
+			}
+			if ((ready[i].events & TAPSERVER_READABLE) &&
+			    client_readable(server, client) == -1) {
 				goto exit;
 			}
-			printf("Accepted a new client\n");
+		}
 
-			tapserver_add_client(server, client_fd);
+		if (!server->tapcfg) {
+			MUTEX_LOCK(server->mutex);
+			flush_clients(server);
+			MUTEX_UNLOCK(server->mutex);
+		}
+		if (server->udp) {
+			udp_maintain(server);
 		}
 
 		MUTEX_LOCK(server->run_mutex);
@@ -335,6 +1017,16 @@ exit:
 	return 0;
 }
 
+static void
+tapserver_start_threads(tapserver_t *server)
+{
+	server->running = 1;
+	server->joined = 0;
+
+	THREAD_CREATE(server->reader, reader_thread, server);
+	THREAD_CREATE(server->writer, writer_thread, server);
+}
+
 int
 tapserver_start(tapserver_t *server, unsigned short port, int listen)
 {
@@ -346,15 +1038,85 @@ tapserver_start(tapserver_t *server, unsigned short port, int listen)
 			return -1;
 
 		server->server_fd = serversock_get_fd(server->serversock);
+		if (tapserver_poll_add(server, server->server_fd,
+		                       &server->server_fd) == -1) {
+			serversock_destroy(server->serversock);
+			server->serversock = NULL;
+			return -1;
+		}
 		server->listening = 1;
 	} else {
 		server->listening = 0;
 	}
-	server->running = 1;
-	server->joined = 0;
+	tapserver_start_threads(server);
 
-	THREAD_CREATE(server->reader, reader_thread, server);
-	THREAD_CREATE(server->writer, writer_thread, server);
+	return 0;
+}
+
+int
+tapserver_add_peer(tapserver_t *server, const struct sockaddr *addr, int addrlen)
+{
+	tapserver_peer_t *peer;
+
+	assert(server);
+	assert(addr);
+
+	MUTEX_LOCK(server->mutex);
+	peer = udp_find_peer(server, addr, addrlen);
+	if (peer) {
+		peer->permanent = 1;
+	} else {
+		peer = udp_new_peer(server, addr, addrlen, 1);
+	}
+	MUTEX_UNLOCK(server->mutex);
+
+	return peer ? 0 : -1;
+}
+
+/* Exchanges the frames with the peers over UDP instead of accepting
+ * clients. When listening the peers sending to the port are learned,
+ * otherwise the socket is bound to any port and only the peers added
+ * with tapserver_add_peer are talked to. */
+int
+tapserver_start_udp(tapserver_t *server, unsigned short port, int listen)
+{
+	int use_ipv6 = 0;
+
+	assert(server);
+
+	MUTEX_LOCK(server->mutex);
+	if (!listen && !server->peers) {
+		MUTEX_UNLOCK(server->mutex);
+		return -1;
+	}
+	if (server->peers &&
+	    server->peertab[0]->addr.ss_family == AF_INET6) {
+		/* The socket has to be of the same family as the peers */
+		use_ipv6 = 1;
+	}
+	MUTEX_UNLOCK(server->mutex);
+
+	if (!listen) {
+		port = 0;
+	}
+	server->serversock = serversock_udp(&port, use_ipv6, 1);
+	if (!server->serversock)
+		return -1;
+	server->udp_fd = serversock_get_fd(server->serversock);
+
+	server->udp_recvbuf = malloc(TAPSERVER_UDP_BATCH * TAPSERVER_UDP_RECVSIZE);
+	if (!server->udp_recvbuf || set_nonblocking(server->udp_fd) == -1 ||
+	    tapserver_poll_add(server, server->udp_fd, &server->udp_fd) == -1) {
+		serversock_destroy(server->serversock);
+		server->serversock = NULL;
+		return -1;
+	}
+	udp_setup_socket(server);
+
+	server->udp = 1;
+	server->udp_accept = listen;
+	server->listening = 0;
+	tapserver_start_threads(server);
 
 	return 0;
 }
@@ -373,6 +1135,15 @@ tapserver_stop(tapserver_t *server)
 	server->joined = 1;
 	MUTEX_UNLOCK(server->run_mutex);
 
+	if (server->wakeup_fd[1] != -1) {
+		char c = 0;
+
+		/* The pipe is only written once, so this can't block */
+		if (write(server->wakeup_fd[1], &c, 1) != 1) {
+			printf("Error waking up the writer thread\n");
+		}
+	}
+
 	THREAD_JOIN(server->reader);
 	THREAD_JOIN(server->writer);
 
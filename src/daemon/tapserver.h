@@ -18,12 +18,36 @@
 
 #include "tapcfg.h"
 
+/* What to do when the send queue of a client is full */
+#define TAPSERVER_POLICY_DROP       0
+#define TAPSERVER_POLICY_DISCONNECT 1
+
 typedef struct tapserver_s tapserver_t;
 
+typedef struct tapserver_stats_s {
+	unsigned long long sent_frames;
+	unsigned long long dropped_frames;
+	unsigned long long dropped_bytes;
+	unsigned long long send_errors;
+	unsigned long long disconnected;
+
+	/* Only counted when running over UDP */
+	unsigned long long sent_datagrams;
+	unsigned long long received_datagrams;
+	unsigned long long dropped_datagrams;
+} tapserver_stats_t;
+
+struct sockaddr;
+
 tapserver_t *tapserver_init(tapcfg_t *tapcfg, int waitms);
 void tapserver_destroy(tapserver_t *server);
+void tapserver_set_queue(tapserver_t *server, int size, int policy);
+void tapserver_set_latency(tapserver_t *server, int usec);
+void tapserver_get_stats(tapserver_t *server, tapserver_stats_t *stats);
 int tapserver_add_client(tapserver_t *server, int fd);
+int tapserver_add_peer(tapserver_t *server, const struct sockaddr *addr, int addrlen);
 int tapserver_start(tapserver_t *server, unsigned short port, int listen);
+int tapserver_start_udp(tapserver_t *server, unsigned short port, int listen);
 void tapserver_stop(tapserver_t *server);
 
 
@@ -0,0 +1,615 @@
+/**
+ *  tapcfg - A cross-platform configuration utility for TAP driver
+ *  Copyright (C) 2008-2009  Juho Vähä-Herttua
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/* Datagrams carry one or more frames with the same 16-bit length
+ * prefix used on the stream sockets, an empty datagram is a keepalive */
+
+#if defined(__linux__)
+#  include <netinet/udp.h>
+#  ifndef SOL_UDP
+#    define SOL_UDP 17
+#  endif
+/* Missing from older headers, the kernel refuses them if unsupported */
+#  ifndef UDP_SEGMENT
+#    define UDP_SEGMENT 103
+#  endif
+#  ifndef UDP_GRO
+#    define UDP_GRO 104
+#  endif
+#endif
+
+/* Small frames are packed together up to this size, which fits the
+ * path MTU of most links including the tunnel and IPv6 headers */
+#define TAPSERVER_DGRAMSIZE 1400
+
+/* Largest payload of a single UDP datagram */
+#define TAPSERVER_UDP_MAXDGRAM 65507
+
+/* Datagrams queued for a peer before they have to be sent */
+#define TAPSERVER_UDP_SENDSIZE (128*1024)
+
+/* Limits of a segmentation offload send set by the kernel */
+#define TAPSERVER_GSO_SIZE 65000
+#define TAPSERVER_GSO_SEGMENTS 64
+
+/* Datagrams are not flow controlled, so bursts have to fit into the
+ * socket buffers, the kernel may limit these further */
+#define TAPSERVER_UDP_SOCKBUF (4*1024*1024)
+
+/* Messages sent or received with a single system call */
+#define TAPSERVER_UDP_BATCH 16
+
+/* Learned peers are forgotten when they have been silent for this
+ * long, configured peers send keepalives more often than that */
+#define TAPSERVER_PEER_TIMEOUT 60000
+#define TAPSERVER_KEEPALIVE 10000
+
+/* How often the writer thread checks the peers, in milliseconds */
+#define TAPSERVER_MAINTAIN 1000
+
+/* One send, with GSO it contains several equal sized datagrams */
+typedef struct tapserver_udp_msg_s {
+	tapserver_peer_t *peer;
+	unsigned char *data;
+	int len;
+	int segsize;
+	int count;
+} tapserver_udp_msg_t;
+
+static void
+udp_setup_socket(tapserver_t *server)
+{
+	int bufsize = TAPSERVER_UDP_SOCKBUF;
+#if defined(__linux__)
+	int segsize = 0;
+	int enabled = 1;
+#endif
+
+	setsockopt(server->udp_fd, SOL_SOCKET, SO_RCVBUF,
+	           (void *) &bufsize, sizeof(bufsize));
+	setsockopt(server->udp_fd, SOL_SOCKET, SO_SNDBUF,
+	           (void *) &bufsize, sizeof(bufsize));
+
+#if defined(__linux__)
+	/* Probing with a zero size only checks that the kernel knows it,
+	 * the segment size is given separately with every send */
+	server->udp_gso = 0;
+	if (setsockopt(server->udp_fd, SOL_UDP, UDP_SEGMENT,
+	               &segsize, sizeof(segsize)) == 0) {
+		server->udp_gso = 1;
+	}
+	server->udp_gro = 0;
+	if (setsockopt(server->udp_fd, SOL_UDP, UDP_GRO,
+	               &enabled, sizeof(enabled)) == 0) {
+		server->udp_gro = 1;
+	}
+#endif
+}
+
+/* Only the address and the port are hashed, the rest of the socket
+ * address is compared when looking the peer up */
+static int
+udp_hash_peer(const void *addr, int size)
+{
+	const struct sockaddr *sa = addr;
+	const unsigned char *ptr;
+	unsigned long value;
+	int i, len, bits = 0;
+
+	if (sa->sa_family == AF_INET6) {
+		const struct sockaddr_in6 *sin6 = addr;
+
+		ptr = (const unsigned char *) &sin6->sin6_addr;
+		len = sizeof(sin6->sin6_addr);
+		value = sin6->sin6_port;
+	} else {
+		const struct sockaddr_in *sin = addr;
+
+		ptr = (const unsigned char *) &sin->sin_addr;
+		len = sizeof(sin->sin_addr);
+		value = sin->sin_port;
+	}
+	for (i=0; i<len; i++) {
+		value = value * 31 + ptr[i];
+	}
+
+	/* The multiplication mixes everything into the high bits of the
+	 * 32-bit product, so the bucket is taken from those */
+	while ((1 << bits) < size) {
+		bits++;
+	}
+	value = (value * 2654435761UL) & 0xffffffffUL;
+
+	return bits ? (int) (value >> (32 - bits)) : 0;
+}
+
+static tapserver_peer_t *
+udp_find_peer(tapserver_t *server, const void *addr, int addrlen)
+{
+	tapserver_peer_t *peer;
+
+	if (!server->maxpeers) {
+		return NULL;
+	}
+
+	peer = server->peerhash[udp_hash_peer(addr, server->maxpeers)];
+	while (peer && (peer->addrlen != addrlen ||
+	                memcmp(&peer->addr, addr, addrlen))) {
+		peer = peer->hnext;
+	}
+
+	return peer;
+}
+
+static void
+udp_hash_insert(tapserver_t *server, tapserver_peer_t *peer)
+{
+	int bucket = udp_hash_peer(&peer->addr, server->maxpeers);
+
+	peer->hnext = server->peerhash[bucket];
+	server->peerhash[bucket] = peer;
+}
+
+/* Has to be called with the mutex locked */
+static tapserver_peer_t *
+udp_new_peer(tapserver_t *server, const void *addr, int addrlen, int permanent)
+{
+	tapserver_peer_t *peer;
+
+	if (addrlen > sizeof(peer->addr)) {
+		return NULL;
+	}
+
+	if (server->peers == server->maxpeers) {
+		tapserver_peer_t **peertab, **peerhash;
+		int maxpeers, i;
+
+		maxpeers = server->maxpeers ? server->maxpeers * 2 : 16;
+		peerhash = calloc(maxpeers, sizeof(tapserver_peer_t *));
+		if (!peerhash) {
+			return NULL;
+		}
+		peertab = realloc(server->peertab,
+		                  maxpeers * sizeof(tapserver_peer_t *));
+		if (!peertab) {
+			free(peerhash);
+			return NULL;
+		}
+		free(server->peerhash);
+		server->peertab = peertab;
+		server->peerhash = peerhash;
+		server->maxpeers = maxpeers;
+
+		/* The buckets depend on the size, so everything is rehashed */
+		for (i=0; i<server->peers; i++) {
+			udp_hash_insert(server, server->peertab[i]);
+		}
+	}
+
+	peer = calloc(1, sizeof(tapserver_peer_t));
+	if (!peer) {
+		return NULL;
+	}
+	memcpy(&peer->addr, addr, addrlen);
+	peer->addrlen = addrlen;
+	peer->permanent = permanent;
+	peer->last_seen = tapserver_usec() / 1000;
+
+	peer->idx = server->peers;
+	server->peertab[server->peers++] = peer;
+	udp_hash_insert(server, peer);
+
+	return peer;
+}
+
+/* Has to be called with the mutex locked and only by the writer thread */
+static void
+udp_remove_peer(tapserver_t *server, tapserver_peer_t *peer)
+{
+	tapserver_peer_t *last, **prev;
+
+	prev = &server->peerhash[udp_hash_peer(&peer->addr, server->maxpeers)];
+	while (*prev != peer) {
+		prev = &(*prev)->hnext;
+	}
+	*prev = peer->hnext;
+
+	/* The order of the peers doesn't matter */
+	last = server->peertab[--server->peers];
+	server->peertab[peer->idx] = last;
+	last->idx = peer->idx;
+
+	free(peer->sendbuf);
+	free(peer);
+}
+
+/* Returns the number of messages that were sent */
+static int
+udp_send_batch(tapserver_t *server, tapserver_udp_msg_t *msgs, int nmsgs)
+{
+#if defined(__linux__)
+	struct mmsghdr mmsg[TAPSERVER_UDP_BATCH];
+	struct iovec iov[TAPSERVER_UDP_BATCH];
+	union {
+		char buf[CMSG_SPACE(sizeof(unsigned short))];
+		struct cmsghdr align;
+	} control[TAPSERVER_UDP_BATCH];
+	struct cmsghdr *cmsg;
+	unsigned short segsize;
+	int i, ret, sent = 0;
+
+	memset(mmsg, 0, sizeof(mmsg));
+	for (i=0; i<nmsgs; i++) {
+		iov[i].iov_base = msgs[i].data;
+		iov[i].iov_len = msgs[i].len;
+		mmsg[i].msg_hdr.msg_name = &msgs[i].peer->addr;
+		mmsg[i].msg_hdr.msg_namelen = msgs[i].peer->addrlen;
+		mmsg[i].msg_hdr.msg_iov = &iov[i];
+		mmsg[i].msg_hdr.msg_iovlen = 1;
+		if (!msgs[i].segsize) {
+			continue;
+		}
+
+		/* The kernel splits the payload into datagrams */
+		segsize = msgs[i].segsize;
+		mmsg[i].msg_hdr.msg_control = control[i].buf;
+		mmsg[i].msg_hdr.msg_controllen = sizeof(control[i].buf);
+		cmsg = CMSG_FIRSTHDR(&mmsg[i].msg_hdr);
+		cmsg->cmsg_level = SOL_UDP;
+		cmsg->cmsg_type = UDP_SEGMENT;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(segsize));
+		memcpy(CMSG_DATA(cmsg), &segsize, sizeof(segsize));
+	}
+
+	while (sent < nmsgs) {
+		ret = sendmmsg(server->udp_fd, mmsg + sent, nmsgs - sent, 0);
+		if (ret == -1 && errno == EINTR) {
+			continue;
+		} else if (ret == -1 && SOCKET_WOULDBLOCK()) {
+			break;
+		} else if (ret == -1) {
+			/* Devices without checksum offload refuse GSO */
+			if (msgs[sent].segsize && (errno == EIO || errno == EINVAL)) {
+				printf("Disabling UDP segmentation offload\n");
+				server->udp_gso = 0;
+			}
+			server->stats.send_errors++;
+			server->stats.dropped_datagrams += msgs[sent].count;
+			sent++;
+			continue;
+		}
+
+		for (i=sent; i<sent+ret; i++) {
+			server->stats.sent_datagrams += msgs[i].count;
+		}
+		sent += ret;
+	}
+#else
+	int i, off, len, sent;
+
+	for (sent=0; sent<nmsgs; sent++) {
+		for (i=0; i<msgs[sent].count; i++) {
+			off = i * msgs[sent].segsize;
+			len = msgs[sent].segsize ? msgs[sent].segsize : msgs[sent].len;
+			if (off + len > msgs[sent].len)
+				len = msgs[sent].len - off;
+
+			if (sendto(server->udp_fd, (char *) msgs[sent].data + off, len, 0,
+			           (struct sockaddr *) &msgs[sent].peer->addr,
+			           msgs[sent].peer->addrlen) == -1) {
+				if (SOCKET_WOULDBLOCK())
+					return sent;
+				server->stats.send_errors++;
+				server->stats.dropped_datagrams++;
+				continue;
+			}
+			server->stats.sent_datagrams++;
+		}
+	}
+#endif
+
+	return sent;
+}
+
+/* Has to be called with the mutex locked, sends the datagrams queued
+ * for all the peers. Runs of equal sized datagrams to the same peer
+ * are given to the kernel as a single segmentation offload send. */
+static void
+udp_flush(tapserver_t *server)
+{
+	tapserver_udp_msg_t msgs[TAPSERVER_UDP_BATCH];
+	tapserver_peer_t *peer;
+	int nmsgs = 0;
+	int i, d, e, off, size, total, sent;
+	unsigned long long now = 0;
+
+	for (i=0; i<server->peers; i++) {
+		peer = server->peertab[i];
+		if (!peer->ndgrams) {
+			continue;
+		}
+		if (!now) {
+			now = tapserver_usec() / 1000;
+		}
+		peer->last_sent = now;
+
+		off = 0;
+		for (d=0; d<peer->ndgrams; d=e) {
+			size = peer->dgrams[d];
+			total = size;
+			e = d + 1;
+			if (server->udp_gso && size <= TAPSERVER_DGRAMSIZE) {
+				/* Only the last datagram may be shorter */
+				while (e < peer->ndgrams && e - d < TAPSERVER_GSO_SEGMENTS &&
+				       peer->dgrams[e] <= size &&
+				       total + peer->dgrams[e] <= TAPSERVER_GSO_SIZE) {
+					total += peer->dgrams[e];
+					if (peer->dgrams[e++] < size)
+						break;
+				}
+			}
+
+			msgs[nmsgs].peer = peer;
+			msgs[nmsgs].data = peer->sendbuf + off;
+			msgs[nmsgs].len = total;
+			msgs[nmsgs].segsize = (e - d > 1) ? size : 0;
+			msgs[nmsgs].count = e - d;
+			off += total;
+
+			if (++nmsgs == TAPSERVER_UDP_BATCH) {
+				sent = udp_send_batch(server, msgs, nmsgs);
+				for (; sent<nmsgs; sent++) {
+					/* The socket buffer is full, these are lost */
+					server->stats.dropped_datagrams += msgs[sent].count;
+				}
+				nmsgs = 0;
+			}
+		}
+	}
+	if (nmsgs) {
+		sent = udp_send_batch(server, msgs, nmsgs);
+		for (; sent<nmsgs; sent++) {
+			server->stats.dropped_datagrams += msgs[sent].count;
+		}
+	}
+
+	/* The buffers are not touched until everything has been sent */
+	for (i=0; i<server->peers; i++) {
+		server->peertab[i]->ndgrams = 0;
+		server->peertab[i]->sendlen = 0;
+	}
+}
+
+/* Has to be called with the mutex locked, queues the frame into the
+ * datagram of the peer and sends it with the next flush */
+static void
+udp_send(tapserver_t *server, tapserver_peer_t *peer,
+         const unsigned char *buf, int len)
+{
+	unsigned char *ptr;
+	int pack;
+
+	if (len + 2 > TAPSERVER_UDP_MAXDGRAM) {
+		server->stats.dropped_frames++;
+		server->stats.dropped_bytes += len;
+		return;
+	}
+	if (!peer->sendbuf) {
+		peer->sendbuf = malloc(TAPSERVER_UDP_SENDSIZE);
+		if (!peer->sendbuf) {
+			server->stats.dropped_frames++;
+			server->stats.dropped_bytes += len;
+			return;
+		}
+	}
+
+	pack = peer->ndgrams &&
+	       peer->dgrams[peer->ndgrams-1] + len + 2 <= TAPSERVER_DGRAMSIZE;
+	if (peer->sendlen + len + 2 > TAPSERVER_UDP_SENDSIZE ||
+	    (!pack && peer->ndgrams == TAPSERVER_UDP_MAXDGRAMS)) {
+		udp_flush(server);
+		pack = 0;
+	}
+	if (!pack) {
+		peer->dgrams[peer->ndgrams++] = 0;
+	}
+
+	ptr = peer->sendbuf + peer->sendlen;
+	ptr[0] = (len >> 8) & 0xff;
+	ptr[1] = len & 0xff;
+	memcpy(ptr + 2, buf, len);
+	peer->sendlen += len + 2;
+	peer->dgrams[peer->ndgrams-1] += len + 2;
+	server->stats.sent_frames++;
+}
+
+/* Returns -1 if writing to the device failed and the server stops */
+static int
+udp_received(tapserver_t *server, const void *addr, int addrlen,
+             unsigned char *buf, int len)
+{
+	tapserver_peer_t *peer;
+	int i, pos, framelen;
+
+	MUTEX_LOCK(server->mutex);
+	peer = udp_find_peer(server, addr, addrlen);
+	if (!peer && server->udp_accept) {
+		peer = udp_new_peer(server, addr, addrlen, 0);
+		if (peer) {
+			printf("Added a new peer\n");
+		}
+	}
+	if (peer) {
+		peer->last_seen = tapserver_usec() / 1000;
+	}
+	MUTEX_UNLOCK(server->mutex);
+
+	/* Datagrams from unknown addresses are ignored when connecting */
+	if (!peer) {
+		return 0;
+	}
+	server->stats.received_datagrams++;
+
+	/* Only the writer thread removes peers, so the peer stays valid */
+	for (pos=0; len - pos >= 2; pos += framelen + 2) {
+		framelen = buf[pos] << 8 | buf[pos+1];
+		if (!framelen || len - pos < framelen + 2) {
+			/* Malformed datagram, the rest of it is ignored */
+			break;
+		}
+
+		if (server->tapcfg) {
+			if (tapcfg_write(server->tapcfg, buf + pos + 2, framelen) <= 0) {
+				MUTEX_LOCK(server->run_mutex);
+				server->running = 0;
+				MUTEX_UNLOCK(server->run_mutex);
+				return -1;
+			}
+		} else {
+			MUTEX_LOCK(server->mutex);
+			for (i=0; i<server->peers; i++) {
+				/* Sent together when the batch has been handled */
+				if (server->peertab[i] != peer) {
+					udp_send(server, server->peertab[i],
+					         buf + pos + 2, framelen);
+				}
+			}
+			MUTEX_UNLOCK(server->mutex);
+		}
+	}
+
+	return 0;
+}
+
+/* Reads a batch of datagrams, with GRO each message may contain several
+ * datagrams of the same size. Returns -1 if the server stops. */
+static int
+udp_readable(tapserver_t *server)
+{
+#if defined(__linux__)
+	struct mmsghdr mmsg[TAPSERVER_UDP_BATCH];
+	struct iovec iov[TAPSERVER_UDP_BATCH];
+	struct sockaddr_storage addr[TAPSERVER_UDP_BATCH];
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control[TAPSERVER_UDP_BATCH];
+	struct cmsghdr *cmsg;
+	unsigned char *buf;
+	int i, ret, len, off, segsize;
+
+	memset(mmsg, 0, sizeof(mmsg));
+	for (i=0; i<TAPSERVER_UDP_BATCH; i++) {
+		iov[i].iov_base = server->udp_recvbuf + i * TAPSERVER_UDP_RECVSIZE;
+		iov[i].iov_len = TAPSERVER_UDP_RECVSIZE;
+		mmsg[i].msg_hdr.msg_name = &addr[i];
+		mmsg[i].msg_hdr.msg_namelen = sizeof(addr[i]);
+		mmsg[i].msg_hdr.msg_iov = &iov[i];
+		mmsg[i].msg_hdr.msg_iovlen = 1;
+		mmsg[i].msg_hdr.msg_control = control[i].buf;
+		mmsg[i].msg_hdr.msg_controllen = sizeof(control[i].buf);
+	}
+
+	ret = recvmmsg(server->udp_fd, mmsg, TAPSERVER_UDP_BATCH, 0, NULL);
+	if (ret == -1) {
+		/* Nothing to read after all, or an error of an earlier send */
+		return 0;
+	}
+
+	for (i=0; i<ret; i++) {
+		buf = iov[i].iov_base;
+		len = mmsg[i].msg_len;
+
+		segsize = 0;
+		for (cmsg = CMSG_FIRSTHDR(&mmsg[i].msg_hdr); cmsg;
+		     cmsg = CMSG_NXTHDR(&mmsg[i].msg_hdr, cmsg)) {
+			if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+				memcpy(&segsize, CMSG_DATA(cmsg), sizeof(segsize));
+			}
+		}
+		if (segsize <= 0 || segsize > len) {
+			segsize = len;
+		}
+
+		/* Keepalives are empty, so the loop runs at least once */
+		off = 0;
+		do {
+			if (udp_received(server, &addr[i], mmsg[i].msg_hdr.msg_namelen,
+			                 buf + off, (len - off < segsize) ? len - off : segsize) == -1) {
+				return -1;
+			}
+			off += segsize;
+		} while (off < len);
+	}
+#else
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	int i, ret;
+
+	for (i=0; i<TAPSERVER_UDP_BATCH; i++) {
+		addrlen = sizeof(addr);
+		ret = recvfrom(server->udp_fd, (char *) server->udp_recvbuf,
+		               TAPSERVER_UDP_RECVSIZE, 0,
+		               (struct sockaddr *) &addr, &addrlen);
+		if (ret == -1) {
+			break;
+		}
+		if (udp_received(server, &addr, addrlen,
+		                 server->udp_recvbuf, ret) == -1) {
+			return -1;
+		}
+	}
+#endif
+
+	return 0;
+}
+
+/* Called regularly by the writer thread, sends keepalives to the
+ * configured peers and forgets the learned ones that went silent */
+static void
+udp_maintain(tapserver_t *server)
+{
+	tapserver_peer_t *peer;
+	unsigned long long now;
+	int i;
+
+	now = tapserver_usec() / 1000;
+	if (server->udp_maintained && now - server->udp_maintained < TAPSERVER_MAINTAIN) {
+		return;
+	}
+	server->udp_maintained = now;
+
+	MUTEX_LOCK(server->mutex);
+	for (i=0; i<server->peers; i++) {
+		peer = server->peertab[i];
+
+		if (peer->permanent) {
+			if (peer->last_sent && now - peer->last_sent < TAPSERVER_KEEPALIVE) {
+				continue;
+			}
+			if (sendto(server->udp_fd, "", 0, 0,
+			           (struct sockaddr *) &peer->addr, peer->addrlen) != -1) {
+				peer->last_sent = now;
+			}
+		} else if (now - peer->last_seen > TAPSERVER_PEER_TIMEOUT) {
+			printf("Removing a silent peer\n");
+			udp_remove_peer(server, peer);
+
+			/* The last peer was moved here */
+			i--;
+		}
+	}
+	MUTEX_UNLOCK(server->mutex);
+}
@@ -10,7 +10,7 @@
 
 /* Current API version number, should be kept up to date */
 #define TAPCFG_VERSION_MAJOR  1
-#define TAPCFG_VERSION_MINOR  1
+#define TAPCFG_VERSION_MINOR  2
 #define TAPCFG_VERSION ((TAPCFG_VERSION_MAJOR << 16) | TAPCFG_VERSION_MINOR)
 
 /* Define syslog style log levels */
@@ -23,6 +23,9 @@
 #define TAPLOG_INFO        6       /* informational */
 #define TAPLOG_DEBUG       7       /* debug-level messages */
 
+/* Returned by reads and writes in non-blocking mode when they would block */
+#define TAPCFG_EAGAIN            (-2)
+
 #define TAPCFG_STATUS_ALL_DOWN   0x0000
 #define TAPCFG_STATUS_ALL_UP     0xffff
 
@@ -33,14 +36,173 @@
 #define TAPCFG_STATUS_IPV6_RADV  0x0020
 #define TAPCFG_STATUS_IPV6_ALL   0x00f0
 
+#define TAPCFG_OFFLOAD_NONE       0x0000
+#define TAPCFG_OFFLOAD_CSUM       0x0001
+#define TAPCFG_OFFLOAD_TSO4       0x0002
+#define TAPCFG_OFFLOAD_TSO6       0x0004
+#define TAPCFG_OFFLOAD_TSO_ECN    0x0008
+#define TAPCFG_OFFLOAD_ALL        0x000f
+
+#define TAPCFG_VNET_F_NEEDS_CSUM  0x01
+#define TAPCFG_VNET_F_DATA_VALID  0x02
+
+#define TAPCFG_VNET_GSO_NONE      0x00
+#define TAPCFG_VNET_GSO_TCPV4     0x01
+#define TAPCFG_VNET_GSO_UDP       0x03
+#define TAPCFG_VNET_GSO_TCPV6     0x04
+#define TAPCFG_VNET_GSO_ECN       0x80
+
+#define TAPCFG_ENGINE_DEFAULT     0
+#define TAPCFG_ENGINE_URING       1
+#define TAPCFG_ENGINE_PACKET      2
+
+#define TAPCFG_POLL_READABLE      0x0001
+#define TAPCFG_POLL_WRITABLE      0x0002
+#define TAPCFG_POLL_EDGE          0x0004
+#define TAPCFG_POLL_ERROR         0x0008
+
+#define TAPCFG_CONFIG_HWADDR      0x0001
+#define TAPCFG_CONFIG_MTU         0x0002
+#define TAPCFG_CONFIG_IPV4        0x0004
+#define TAPCFG_CONFIG_IPV6        0x0008
+#define TAPCFG_CONFIG_STATUS      0x0010
+
+#define TAPCFG_LINK_STATUS        0x0001
+#define TAPCFG_LINK_MTU           0x0002
+#define TAPCFG_LINK_HWADDR        0x0004
+#define TAPCFG_LINK_IPV4          0x0008
+
 typedef void (*taplog_callback_t)(int level, char *msg);
 
+/**
+ * Offload information attached to each frame when offloads are
+ * enabled, the layout matches the Linux struct virtio_net_hdr and
+ * all the values are in host byte order.
+ */
+typedef struct tapcfg_vnet_hdr_s {
+	unsigned char flags;        /* TAPCFG_VNET_F_* flags */
+	unsigned char gso_type;     /* TAPCFG_VNET_GSO_* type */
+	unsigned short hdr_len;     /* length of the headers to copy */
+	unsigned short gso_size;    /* segment size for segmentation */
+	unsigned short csum_start;  /* where to start checksumming */
+	unsigned short csum_offset; /* where to store the checksum */
+} tapcfg_vnet_hdr_t;
+
 /**
  * Typedef to the structure used by the library, should never
  * be accessed directly.
  */
 typedef struct tapcfg_s tapcfg_t;
 
+/**
+ * Callback called by the link monitor when the interface attributes
+ * are changed, changed is a combination of TAPCFG_LINK_* flags. It
+ * is called from the monitor thread and must not stop the device or
+ * change the monitoring of any device.
+ */
+typedef void (*tapcfg_link_callback_t)(tapcfg_t *tapcfg, int changed, void *data);
+
+/**
+ * Typedef to the context used for asynchronous configuration,
+ * should never be accessed directly.
+ */
+typedef struct tapcfg_async_s tapcfg_async_t;
+
+/**
+ * Callback called when an asynchronous configuration is completed,
+ * result is negative if an error happened and zero otherwise.
+ */
+typedef void (*tapcfg_async_callback_t)(tapcfg_t *tapcfg, int result, void *data);
+
+/**
+ * Frame descriptor used by the batched read and write functions.
+ * For reads buf and size describe the buffer supplied by the caller
+ * and len and status are filled by the library. For writes buf and
+ * len describe the frame and status is filled by the library.
+ */
+typedef struct tapcfg_frame_s {
+	void *buf;      /* pointer to the frame data buffer */
+	int size;       /* size of the buffer, only used for reads */
+	int len;        /* length of the frame in bytes */
+	int status;     /* zero on success, negative on error */
+	tapcfg_vnet_hdr_t hdr; /* offload information, if enabled */
+} tapcfg_frame_t;
+
+/**
+ * Interface configuration applied at once, only the settings
+ * selected in fields are changed and the rest are ignored.
+ */
+typedef struct tapcfg_iface_config_s {
+	int fields;                  /* TAPCFG_CONFIG_* flags of the used fields */
+	char hwaddr[6];              /* hardware address */
+	int mtu;                     /* maximum transfer unit */
+	const char *ipv4;            /* IPv4 address in numeric format */
+	unsigned char ipv4_netbits;  /* IPv4 network length */
+	const char *ipv6;            /* IPv6 address in numeric format */
+	unsigned char ipv6_netbits;  /* IPv6 network length */
+	int status;                  /* TAPCFG_STATUS_* flags */
+} tapcfg_iface_config_t;
+
+/**
+ * Typedef to the poller structure used for waiting on multiple
+ * devices at once, should never be accessed directly.
+ */
+typedef struct tapcfg_poller_s tapcfg_poller_t;
+
+/**
+ * Event reported by the poller for each device that is ready.
+ */
+typedef struct tapcfg_poll_event_s {
+	tapcfg_t *tapcfg; /* the device this event is for */
+	int events;       /* TAPCFG_POLL_* flags that are ready */
+	void *data;       /* user data given when adding the device */
+} tapcfg_poll_event_t;
+
+/**
+ * Typedef to the pool structure used for handing out pre-created
+ * devices, should never be accessed directly.
+ */
+typedef struct tapcfg_pool_s tapcfg_pool_t;
+
+/**
+ * Metrics of a device pool, latencies are in microseconds and
+ * measured over all the devices handed out so far.
+ */
+typedef struct tapcfg_pool_stats_s {
+	int depth;              /* devices ready in the pool right now */
+	int size;               /* depth the pool is refilled to */
+	unsigned long allocs;   /* devices handed out */
+	unsigned long misses;   /* hand-outs that found the pool empty */
+	unsigned long failures; /* background refills that failed */
+	unsigned long avg_usec; /* average allocation latency */
+	unsigned long max_usec; /* worst allocation latency */
+} tapcfg_pool_stats_t;
+
+/* Number of buckets in the latency histograms of tapcfg_stats_t */
+#define TAPCFG_STATS_BUCKETS 16
+
+/**
+ * Data path counters of a device. The read and write latencies are
+ * histograms of the time spent in a single call, bucket 0 counts the
+ * calls under 1 microsecond and bucket n the calls taking from 2^(n-1)
+ * up to 2^n microseconds, the last bucket includes all slower calls.
+ * Blocking reads include the time spent waiting for the next frame.
+ */
+typedef struct tapcfg_stats_s {
+	unsigned long long rx_frames;    /* frames read */
+	unsigned long long rx_bytes;     /* bytes of the frames read */
+	unsigned long long rx_errors;    /* failed reads, including the ones below */
+	unsigned long long rx_dropped;   /* frames too big for the internal buffer */
+	unsigned long long rx_truncated; /* reads with the buffer not big enough */
+	unsigned long long tx_frames;    /* frames written */
+	unsigned long long tx_bytes;     /* bytes of the frames written */
+	unsigned long long tx_errors;    /* failed writes */
+	unsigned long long kernel_rx_dropped; /* drops reported by the system */
+	unsigned long long kernel_tx_dropped; /* drops reported by the system */
+	unsigned long long rx_latency[TAPCFG_STATS_BUCKETS];
+	unsigned long long tx_latency[TAPCFG_STATS_BUCKETS];
+} tapcfg_stats_t;
+
 /**
  * Get the current version of the library, this number only
  * changes when the API is changed. In general it should be
@@ -68,6 +230,40 @@ TAPCFG_API void tapcfg_set_log_level(tapcfg_t *tapcfg, int level);
  */
 TAPCFG_API void tapcfg_set_log_callback(tapcfg_t *tapcfg, taplog_callback_t callback);
 
+/**
+ * Queue the log messages and format them on a background thread,
+ * so that logging doesn't slow down the reads and writes even with
+ * debug messages enabled. The messages are passed to the callback
+ * or printed to stderr by the logging thread in the same order as
+ * they were logged. If the queue fills up the extra messages are
+ * dropped and their count is logged. Destroying the device flushes
+ * all its queued messages.
+ * @param tapcfg is a pointer to an inited structure
+ * @param enabled is non-zero to queue the messages, zero to log
+ *        them synchronously
+ * @return Negative value if an error happened, non-negative otherwise.
+ */
+TAPCFG_API int tapcfg_set_log_async(tapcfg_t *tapcfg, int enabled);
+
+/**
+ * Limit the rate of the messages logged at the given level. Each
+ * place in the code logging a message has its own limit, so that an
+ * error repeating for every frame doesn't flood the log or hide the
+ * other messages. Messages over the limit are dropped and their count
+ * is logged once the limit would let the next one through, with that
+ * message if there is one. Without asynchronous logging the counts are
+ * only logged from the rate limited messages that follow.
+ * By default none of the levels are limited.
+ * @param tapcfg is a pointer to an inited structure
+ * @param level is the level to limit, one of the TAPLOG_* values
+ * @param rate is the number of messages allowed per second, zero
+ *        removes the limit
+ * @param burst is the number of messages allowed at once before
+ *        the rate limit applies
+ * @return Negative value if an error happened, non-negative otherwise.
+ */
+TAPCFG_API int tapcfg_set_log_rate_limit(tapcfg_t *tapcfg, int level, int rate, int burst);
+
 /**
  * Initializes a new tapcfg_t structure and allocates
  * the required memory for it.
@@ -103,6 +299,147 @@ TAPCFG_API void tapcfg_destroy(tapcfg_t *tapcfg);
  */
 TAPCFG_API int tapcfg_start(tapcfg_t *tapcfg, const char *ifname, int fallback);
 
+/**
+ * Attach to an existing persistent TAP device, for example one left
+ * behind by an earlier run of the program. The device is not created
+ * or reconfigured, its hardware address, MTU, IPv4 address and status are
+ * kept as they are and can be read back with the tapcfg_iface_get_*
+ * functions. Not supported on Solaris, on Windows this is the same
+ * as tapcfg_start without fallback.
+ * @param tapcfg is a pointer to an inited structure
+ * @param ifname is the name of the existing interface
+ * @return Negative value if an error happened, non-negative otherwise.
+ */
+TAPCFG_API int tapcfg_attach(tapcfg_t *tapcfg, const char *ifname);
+
+/**
+ * Make the started device persistent, so that it stays with all its
+ * configuration after the device is stopped or the program exits.
+ * It can be attached to again later with tapcfg_attach. Only
+ * supported on Linux, on other systems the devices either always
+ * or never persist and only that setting is accepted.
+ * @param tapcfg is a pointer to a started structure
+ * @param persistent is non-zero to keep the device after stopping it
+ * @return Negative value if an error happened, non-negative otherwise.
+ */
+TAPCFG_API int tapcfg_set_persistent(tapcfg_t *tapcfg, int persistent);
+
+/**
+ * Creates a new network interface like tapcfg_start, but with
+ * multiple queues that can be read and written independently from
+ * separate threads. Each queue has its own handle that is accessed
+ * with tapcfg_get_queue and works with all the read, write and wait
+ * functions. This is only supported on Linux, but calling it with
+ * nqueues set to 1 works everywhere.
+ * @param tapcfg is a pointer to an inited structure
+ * @param ifname is a pointer to the suggested name for
+ *        the device in question in UTF-8 encoding, can be
+ *        null for system default
+ * @param nqueues is the number of queues to create
+ * @return Negative value on error, non-negative on success.
+ */
+TAPCFG_API int tapcfg_start_multiqueue(tapcfg_t *tapcfg, const char *ifname, int nqueues);
+
+/**
+ * Get the number of queues of a started device.
+ * @param tapcfg is a pointer to an inited structure
+ * @return Number of queues, zero if the device is not started.
+ */
+TAPCFG_API int tapcfg_get_queue_count(tapcfg_t *tapcfg);
+
+/**
+ * Get the handle of a single queue of the device. The handle of
+ * the first queue is the device handle itself. The handles of the
+ * other queues are owned by the device, they are freed when the
+ * device is stopped and should never be destroyed by the caller.
+ * The interface configuration functions should always be called
+ * using the device handle.
+ * @param tapcfg is a pointer to an inited structure
+ * @param index is the index of the queue, starting from 0
+ * @return Pointer to the queue handle, NULL if index is invalid.
+ */
+TAPCFG_API tapcfg_t *tapcfg_get_queue(tapcfg_t *tapcfg, int index);
+
+/**
+ * Enable or disable a single queue of a multiqueue device. The kernel
+ * will not pass any frames to a disabled queue, so this can be used
+ * to scale the number of worker threads according to the load.
+ * @param queue is a pointer to a queue handle
+ * @param enabled is non-zero for enabling the queue, zero otherwise
+ * @return Negative value if an error happened, non-negative otherwise.
+ */
+TAPCFG_API int tapcfg_queue_set_enabled(tapcfg_t *queue, int enabled);
+
+/**
+ * Enable checksum and segmentation offloads on the device. This
+ * has to be called before tapcfg_start and is only supported on
+ * Linux. With offloads enabled the kernel hands over frames of up
+ * to 64kB with the checksums left uncalculated, and the details
+ * needed to finish them are passed in a tapcfg_vnet_hdr_t that can
+ * be accessed through tapcfg_read_vnet and tapcfg_write_vnet. The
+ * plain read and write functions still work, but they discard the
+ * offload information of the read frames, so the buffers used for
+ * reading should be big enough for the largest frames.
+ * @param tapcfg is a pointer to an inited structure
+ * @param flags is a combination of the TAPCFG_OFFLOAD_* flags
+ * @return Negative value if an error happened, non-negative otherwise.
+ */
+TAPCFG_API int tapcfg_set_offload(tapcfg_t *tapcfg, int flags);
+
+/**
+ * Select the engine used for receiving frames. This has to be called
+ * before tapcfg_start. The default engine uses a read system call for
+ * every frame. TAPCFG_ENGINE_URING is available on Linux 5.7 and later
+ * when built with io_uring support, it keeps reads posted into a ring
+ * of registered buffers all the time, so frames are received without
+ * system calls while traffic keeps flowing. The frame size is fixed
+ * when the device is started, so the MTU can't be raised beyond it.
+ * TAPCFG_ENGINE_PACKET is available on Linux, it receives the frames
+ * from a TPACKET_V3 ring of a packet socket bound to the interface and
+ * hands them over from shared memory in blocks. It doesn't support
+ * offloads or multiple queues, and the frames dropped from the tap
+ * queue show up in the interface statistics as transmit drops.
+ * @param tapcfg is a pointer to an inited structure
+ * @param engine is one of the TAPCFG_ENGINE_* values
+ * @return Negative value if the engine is not supported or the device
+ *         is already started, non-negative otherwise.
+ */
+TAPCFG_API int tapcfg_set_engine(tapcfg_t *tapcfg, int engine);
+
+/**
+ * Set the device into non-blocking mode. In non-blocking mode the read
+ * and write functions return TAPCFG_EAGAIN instead of blocking, so all
+ * the queued frames can be drained after a single readiness event by
+ * reading until TAPCFG_EAGAIN is returned. This can be called before
+ * or after starting the device and also applies to its queues.
+ * @param tapcfg is a pointer to an inited structure
+ * @param enabled is non-zero to enable and zero to disable the mode
+ * @return Negative value if an error happened, non-negative otherwise.
+ */
+TAPCFG_API int tapcfg_set_nonblocking(tapcfg_t *tapcfg, int enabled);
+
+/**
+ * Enable busy polling for lower receive latency. When waiting for a
+ * frame the device is polled in a loop for up to the given budget
+ * before falling back to a normal blocking wait, which avoids the cost
+ * of the thread being put to sleep and woken up again. If the budget
+ * runs out several times in a row the device is considered idle and
+ * spinning is skipped until a frame arrives again. Busy polling costs
+ * a full CPU core while spinning, it is disabled by default.
+ * @param tapcfg is a pointer to an inited structure
+ * @param usec is the spinning budget in microseconds, 0 to disable
+ * @return Negative value if an error happened, non-negative otherwise.
+ */
+TAPCFG_API int tapcfg_set_busy_poll(tapcfg_t *tapcfg, int usec);
+
+/**
+ * Get the busy polling statistics for tuning the spinning budget.
+ * @param tapcfg is a pointer to an inited structure
+ * @param hits is set to the number of frames found while spinning
+ * @param misses is set to the number of times the budget ran out
+ */
+TAPCFG_API void tapcfg_get_busy_poll_stats(tapcfg_t *tapcfg, unsigned long *hits, unsigned long *misses);
+
 /**
  * Stops the network interface and frees all resources
  * related to it. After this a new interface using the
@@ -136,11 +473,15 @@ TAPCFG_API int tapcfg_wait_readable(tapcfg_t *tapcfg, int msec);
  * avoided by making sure there is data available by using
  * the tapcfg_wait_readable function. The buffer should
  * always have enough space for a complete Ethernet frame
- * or the read will simply fail.
+ * or the read will simply fail. In that case the frame is
+ * kept and returned by the next call with a bigger buffer.
+ * In non-blocking mode the function returns TAPCFG_EAGAIN
+ * instead of blocking when there is no frame available.
  * @param tapcfg is a pointer to an inited structure
  * @param buf is a pointer to the buffer where data is read to
  * @param count is the maximum size of the buffer
- * @return Negative value on error, number of bytes read otherwise.
+ * @return TAPCFG_EAGAIN if the read would block in non-blocking mode,
+ *         other negative value on error, number of bytes read otherwise.
  */
 TAPCFG_API int tapcfg_read(tapcfg_t *tapcfg, void *buf, int count);
 
@@ -168,10 +509,213 @@ TAPCFG_API int tapcfg_wait_writable(tapcfg_t *tapcfg, int msec);
  * @param tapcfg is a pointer to an inited structure
  * @param buf is a pointer to the buffer where data is written from
  * @param count is the number of bytes in the buffer
- * @return Negative value on error, number of bytes written otherwise.
+ * @return TAPCFG_EAGAIN if the write would block in non-blocking mode,
+ *         other negative value on error, number of bytes written otherwise.
  */
 TAPCFG_API int tapcfg_write(tapcfg_t *tapcfg, void *buf, int count);
 
+/**
+ * Read data and its offload information from the device. Works
+ * otherwise like tapcfg_read, but if offloads are enabled by
+ * tapcfg_set_offload the offload information of the frame is
+ * stored into hdr. If offloads are not enabled hdr is cleared.
+ * @param tapcfg is a pointer to an inited structure
+ * @param hdr is a pointer where the offload information is stored
+ * @param buf is a pointer to the buffer where data is read to
+ * @param count is the maximum size of the buffer
+ * @return Negative value on error, number of bytes read otherwise.
+ */
+TAPCFG_API int tapcfg_read_vnet(tapcfg_t *tapcfg, tapcfg_vnet_hdr_t *hdr, void *buf, int count);
+
+/**
+ * Write data and its offload information to the device. Works
+ * otherwise like tapcfg_write, but if offloads are enabled by
+ * tapcfg_set_offload the offload information is passed to the
+ * kernel together with the frame. If offloads are not enabled or
+ * hdr is null the frame is treated as a complete Ethernet frame.
+ * @param tapcfg is a pointer to an inited structure
+ * @param hdr is a pointer to the offload information, can be null
+ * @param buf is a pointer to the buffer where data is written from
+ * @param count is the number of bytes in the buffer
+ * @return Negative value on error, number of bytes written otherwise.
+ */
+TAPCFG_API int tapcfg_write_vnet(tapcfg_t *tapcfg, const tapcfg_vnet_hdr_t *hdr, void *buf, int count);
+
+/**
+ * Read multiple frames from the device with as few system calls
+ * as possible. This function will block until at least one frame
+ * is readable and then reads all the frames that are immediately
+ * available, up to nframes. Frames that don't fit into the buffer
+ * of their descriptor are dropped, their status is set negative
+ * and len is set to the size of the dropped frame. If offloads
+ * are enabled the hdr of each descriptor is filled as well.
+ * In non-blocking mode TAPCFG_EAGAIN is returned instead of
+ * blocking when no frames are available.
+ * @param tapcfg is a pointer to an inited structure
+ * @param frames is a pointer to an array of frame descriptors
+ * @param nframes is the number of descriptors in the array
+ * @return Negative value on error, number of descriptors filled otherwise.
+ */
+TAPCFG_API int tapcfg_read_batch(tapcfg_t *tapcfg, tapcfg_frame_t *frames, int nframes);
+
+/**
+ * Write multiple frames to the device with as few system calls
+ * as possible. The frames are written in order and the status
+ * of each descriptor is set according to the result of its write.
+ * If offloads are enabled the hdr of each descriptor is used.
+ * @param tapcfg is a pointer to an inited structure
+ * @param frames is a pointer to an array of frame descriptors
+ * @param nframes is the number of descriptors in the array
+ * @return Negative value on error, number of frames written otherwise.
+ */
+TAPCFG_API int tapcfg_write_batch(tapcfg_t *tapcfg, tapcfg_frame_t *frames, int nframes);
+
+/**
+ * Get the data path counters of the device. The counters are updated
+ * without locking by the threads reading and writing, so they can be
+ * read at any time but may be slightly behind the latest calls. For
+ * multiqueue devices the counters of all the queues are summed. The
+ * kernel drop counters are only available on Linux, where the kernel
+ * counts the frames it drops as tx_dropped when the application is
+ * not reading fast enough.
+ * @param tapcfg is a pointer to an inited structure
+ * @param stats is a pointer to the structure to fill
+ * @return Negative value if an error happened, non-negative otherwise.
+ */
+TAPCFG_API int tapcfg_get_stats(tapcfg_t *tapcfg, tapcfg_stats_t *stats);
+
+/**
+ * Start capturing the frames read and written into a pcapng file.
+ * Frames are copied into preallocated memory and written to the file
+ * by a background thread, so the capture doesn't block the data path.
+ * If the thread can't keep up the frames are dropped from the capture
+ * and a warning is logged when it's stopped. Directions are those of
+ * the interface like in a capture taken on it by the system, so read
+ * frames that the system sent are marked outbound and written frames
+ * inbound. Frames of all the queues of a multiqueue device are
+ * captured. If a capture is already running it is stopped first.
+ * @param tapcfg is a pointer to an inited structure
+ * @param filename is the name of the capture file
+ * @param snaplen is the maximum number of bytes saved of each frame,
+ *        zero or negative to save the whole frames
+ * @param maxsize is the size in bytes after which the capture moves
+ *        to the next file, zero or negative for no limit
+ * @param nfiles is the number of files rotated, if it's more than one
+ *        the files are named with the index appended after a dot
+ * @return Negative value if an error happened, non-negative otherwise.
+ */
+TAPCFG_API int tapcfg_capture_start(tapcfg_t *tapcfg, const char *filename,
+                                    int snaplen, long maxsize, int nfiles);
+
+/**
+ * Stop the capture and write the remaining frames into the file.
+ * Does nothing if no capture is running.
+ * @param tapcfg is a pointer to an inited structure
+ */
+TAPCFG_API void tapcfg_capture_stop(tapcfg_t *tapcfg);
+
+/**
+ * Initialize a new poller for waiting on multiple devices with a
+ * single call. On Linux this uses epoll and there is no limit for
+ * the number of devices or the file descriptor numbers used.
+ * @return NULL on error, pointer to the new poller otherwise.
+ */
+TAPCFG_API tapcfg_poller_t *tapcfg_poller_init();
+
+/**
+ * Destroy the poller. The devices added to it are not affected.
+ * @param poller is a pointer to an inited poller
+ */
+TAPCFG_API void tapcfg_poller_destroy(tapcfg_poller_t *poller);
+
+/**
+ * Add a started device to the poller. With TAPCFG_POLL_EDGE the
+ * device is only reported when its state changes, so the caller
+ * has to read or write until it would block before waiting again.
+ * Edge triggering is only a hint on systems without epoll. The
+ * device has to be removed from the poller before it is stopped.
+ * @param poller is a pointer to an inited poller
+ * @param tapcfg is a pointer to a started device
+ * @param events is a combination of TAPCFG_POLL_* flags to wait for
+ * @param data is a pointer returned in the events of this device
+ * @return Negative value if an error happened, non-negative otherwise.
+ */
+TAPCFG_API int tapcfg_poller_add(tapcfg_poller_t *poller, tapcfg_t *tapcfg, int events, void *data);
+
+/**
+ * Change the events and user data of a device in the poller.
+ * @param poller is a pointer to an inited poller
+ * @param tapcfg is a pointer to a device added to the poller
+ * @param events is a combination of TAPCFG_POLL_* flags to wait for
+ * @param data is a pointer returned in the events of this device
+ * @return Negative value if an error happened, non-negative otherwise.
+ */
+TAPCFG_API int tapcfg_poller_modify(tapcfg_poller_t *poller, tapcfg_t *tapcfg, int events, void *data);
+
+/**
+ * Remove a device from the poller.
+ * @param poller is a pointer to an inited poller
+ * @param tapcfg is a pointer to a device added to the poller
+ * @return Negative value if an error happened, non-negative otherwise.
+ */
+TAPCFG_API int tapcfg_poller_remove(tapcfg_poller_t *poller, tapcfg_t *tapcfg);
+
+/**
+ * Wait for any of the devices in the poller to become ready and
+ * report all the ready devices with a single call. A frame kept
+ * after a failed read with too small buffer is not reported, it
+ * should be read again with a bigger buffer right away. The poller
+ * should not be modified while another thread is waiting on it.
+ * @param poller is a pointer to an inited poller
+ * @param events is a pointer to an array where events are stored
+ * @param maxevents is the number of events in the array
+ * @param msec is the time in milliseconds to wait, can be 0 in
+ *        which case the function will return immediately and
+ *        negative in which case it waits indefinitely
+ * @return Negative value on error, number of events stored otherwise.
+ */
+TAPCFG_API int tapcfg_poller_wait(tapcfg_poller_t *poller, tapcfg_poll_event_t *events, int maxevents, int msec);
+
+/**
+ * Initialize a pool of pre-created devices. A background thread
+ * starts devices until the pool holds size of them and refills
+ * the pool after every hand-out, so that getting a device does
+ * not have to wait for the driver.
+ * @param ifname is the suggested interface name in UTF-8 encoding,
+ *        devices fall back to any available name
+ * @param mtu is the maximum transfer unit set on every device,
+ *        zero keeps the system default
+ * @param size is the number of devices kept ready in the pool
+ * @return NULL in case of an error, pointer to the pool otherwise.
+ */
+TAPCFG_API tapcfg_pool_t *tapcfg_pool_init(const char *ifname, int mtu, int size);
+
+/**
+ * Stop the refill thread and destroy all the devices still in
+ * the pool. Devices already handed out are not affected.
+ * @param pool is a pointer to an inited pool
+ */
+TAPCFG_API void tapcfg_pool_destroy(tapcfg_pool_t *pool);
+
+/**
+ * Take a started device from the pool. If the pool is empty the
+ * device is started synchronously instead, which is counted as
+ * a miss in the pool statistics.
+ * @param pool is a pointer to an inited pool
+ * @return NULL in case of an error, pointer to a started device
+ *         otherwise. The caller owns the device and should free
+ *         it with tapcfg_destroy.
+ */
+TAPCFG_API tapcfg_t *tapcfg_pool_get(tapcfg_pool_t *pool);
+
+/**
+ * Get the current depth and the allocation latency metrics of
+ * the pool.
+ * @param pool is a pointer to an inited pool
+ * @param stats is a pointer to the structure to fill
+ */
+TAPCFG_API void tapcfg_pool_get_stats(tapcfg_pool_t *pool, tapcfg_pool_stats_t *stats);
+
 
 /**
  * Get the current name of the interface. This can be called
@@ -242,9 +786,12 @@ TAPCFG_API int tapcfg_iface_get_mtu(tapcfg_t *tapcfg);
  * Set the maximum transfer unit for the device if possible, this function
  * will fail on some systems like Windows 2000 or Windows XP and that is ok.
  * The IP stack on those platforms doesn't support dynamic MTU and it should
- * not cause trouble in any other functionality.
+ * not cause trouble in any other functionality. Jumbo frames are supported
+ * and the internal frame buffers of the device and its queues grow to fit
+ * the new MTU when they are next read, so other threads may be reading.
  * @param tapcfg is a pointer to an inited structure
- * @param mtu is the new maximum transfer unit after calling the function
+ * @param mtu is the new maximum transfer unit after calling the function,
+ *        between 68 and 65532 bytes
  * @return Negative value if an error happened, non-negative otherwise.
  */
 TAPCFG_API int tapcfg_iface_set_mtu(tapcfg_t *tapcfg, int mtu);
@@ -260,6 +807,18 @@ TAPCFG_API int tapcfg_iface_set_mtu(tapcfg_t *tapcfg, int mtu);
  */
 TAPCFG_API int tapcfg_iface_set_ipv4(tapcfg_t *tapcfg, const char *addr, unsigned char netbits);
 
+/**
+ * Get the IPv4 address currently configured on the interface.
+ * Not supported on Windows where the driver hands out the address.
+ * @param tapcfg is a pointer to an inited structure
+ * @param addr is a pointer to the buffer where the address is stored
+ * @param addrlen is the size of the address buffer, 16 is enough
+ * @param netbits is set to the network length if not NULL
+ * @return Negative value if an error happened or there is no address,
+ *         non-negative otherwise.
+ */
+TAPCFG_API int tapcfg_iface_get_ipv4(tapcfg_t *tapcfg, char *addr, int addrlen, unsigned char *netbits);
+
 /**
  * Set the IPv6 address and netmask of the interface and update
  * the routing tables accordingly.
@@ -271,6 +830,102 @@ TAPCFG_API int tapcfg_iface_set_ipv4(tapcfg_t *tapcfg, const char *addr, unsigne
  */
 TAPCFG_API int tapcfg_iface_set_ipv6(tapcfg_t *tapcfg, const char *addr, unsigned char netbits);
 
+/**
+ * Apply several interface settings with one call. All the values are
+ * validated before anything is changed and the status is changed last,
+ * so the interface is never brought up half configured. On Linux all
+ * the other settings are sent to the kernel in a single netlink
+ * request. The hardware address can't be changed while the interface
+ * is up, same as with tapcfg_iface_set_hwaddr.
+ * @param tapcfg is a pointer to an inited structure
+ * @param config is a pointer to the settings to apply
+ * @return Negative value if an error happened, non-negative otherwise.
+ *         If an error happens when applying the settings some of them
+ *         might have been applied already.
+ */
+TAPCFG_API int tapcfg_iface_configure(tapcfg_t *tapcfg, const tapcfg_iface_config_t *config);
+
+/**
+ * Initialize a context for asynchronous configuration. One context
+ * can be shared by any number of devices and keeps their requests
+ * pipelined to the kernel without waiting for each of them.
+ * @return NULL in case of an error, pointer to the context otherwise.
+ */
+TAPCFG_API tapcfg_async_t *tapcfg_async_init();
+
+/**
+ * Destroy the context, callbacks of the unfinished configurations
+ * are not called.
+ * @param async is a pointer to an inited context
+ */
+TAPCFG_API void tapcfg_async_destroy(tapcfg_async_t *async);
+
+/**
+ * Get the file descriptor that becomes readable when configurations
+ * are completed, tapcfg_async_process should be called then. It can
+ * be added to the event loop of the application.
+ * @param async is a pointer to an inited context
+ * @return The file descriptor, -1 on platforms where everything is
+ *         completed synchronously.
+ */
+TAPCFG_API int tapcfg_async_get_fd(tapcfg_async_t *async);
+
+/**
+ * Get the number of configurations that are not completed yet.
+ * @param async is a pointer to an inited context
+ * @return Number of pending configurations.
+ */
+TAPCFG_API int tapcfg_async_pending(tapcfg_async_t *async);
+
+/**
+ * Handle the completed configurations without blocking, calling their
+ * callbacks, and send the queued ones to the kernel.
+ * @param async is a pointer to an inited context
+ * Configurations whose acknowledgements were lost are completed with
+ * a negative result.
+ * @return Number of completed configurations.
+ */
+TAPCFG_API int tapcfg_async_process(tapcfg_async_t *async);
+
+/**
+ * Apply the settings like tapcfg_iface_configure, but don't wait for
+ * the kernel. The settings are validated right away and queued, the
+ * callback is called from tapcfg_async_process once they are applied.
+ * If nothing needs to be sent to the kernel, or the platform doesn't
+ * support asynchronous configuration, the callback is called before
+ * this function returns. Configurations of the same device are applied
+ * one after another and completed in the order they were queued, all
+ * of them through the same context. Stopping or destroying the device
+ * completes its pending configurations with a negative result, their
+ * callbacks are still called from tapcfg_async_process and must not
+ * use the device if it was destroyed.
+ * @param async is a pointer to an inited context
+ * @param tapcfg is a pointer to a started structure
+ * @param config is a pointer to the settings to apply, the strings
+ *        can be freed after this function returns
+ * @param callback is called when the configuration is completed
+ * @param data is passed to the callback
+ * @return Negative value if the settings were invalid or the device has
+ *         configurations pending in another context, non-negative if
+ *         they were queued.
+ */
+TAPCFG_API int tapcfg_iface_configure_async(tapcfg_async_t *async, tapcfg_t *tapcfg, const tapcfg_iface_config_t *config, tapcfg_async_callback_t callback, void *data);
+
+/**
+ * Keep the interface attributes up to date in the background. While
+ * the device is monitored the status, MTU, hardware address and IPv4
+ * address getters return the cached values without system calls and
+ * they notice changes made outside of the library. Only supported on
+ * Linux, where one thread listening for link and address events serves
+ * all the monitored devices. Monitoring ends when the device is stopped.
+ * @param tapcfg is a pointer to a started structure
+ * @param enabled is non-zero to start monitoring and zero to stop it
+ * @param callback is called for each change, can be NULL
+ * @param data is passed to the callback
+ * @return Negative value if an error happened, non-negative otherwise.
+ */
+TAPCFG_API int tapcfg_set_link_monitor(tapcfg_t *tapcfg, int enabled, tapcfg_link_callback_t callback, void *data);
+
 /**
  * Set a DHCP options if the IPv4 address of the interface is configured by
  * using DHCP instead of basic IPv4 address setting. Basically this function
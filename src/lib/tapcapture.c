@@ -0,0 +1,584 @@
+/**
+ *  tapcfg - A cross-platform configuration utility for TAP driver
+ *  Copyright (C) 2008-2011  Juho Vähä-Herttua
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+#if defined(_WIN32) || defined(_WIN64)
+#  include <windows.h>
+#else
+#  include <time.h>
+#  include <sys/mman.h>
+#endif
+
+#include "tapcfg.h"
+#include "taplog.h"
+#include "tapthread.h"
+#include "tapcapture.h"
+
+/* Frames are collected into a ring of buffers, full buffers are
+ * written out by the capture thread while the next one is filled */
+#define TAPCAPTURE_BUFSIZE (1024*1024)
+#define TAPCAPTURE_BUFFERS 4
+
+/* Used when no snaplen is given, big enough for offloaded frames */
+#define TAPCAPTURE_MAXSNAP 262144
+
+/* Fixed part of an enhanced packet block with the flags option */
+#define TAPCAPTURE_EPB_SIZE 44
+
+/* Longest interface name stored in the interface description */
+#define TAPCAPTURE_MAXNAME 256
+
+#define TAPCAPTURE_PAD(len) (((len) + 3) & ~3)
+
+struct tapcapture_s {
+	taplog_t *taplog;
+
+	/* Checked without locking to skip the frames quickly */
+	volatile int active;
+
+	/* Frames reserve space in the buffer being filled with an atomic
+	 * add, the first one that doesn't fit sets the length of the buffer
+	 * and the mutex is only taken to switch to the next buffer */
+	char *buffers[TAPCAPTURE_BUFFERS];
+	volatile long reserved[TAPCAPTURE_BUFFERS];
+	volatile long written[TAPCAPTURE_BUFFERS];
+	volatile long lengths[TAPCAPTURE_BUFFERS];
+	volatile int fill;
+	int head;
+	int count;
+	unsigned long dropped;
+
+	int running;
+	thread_handle_t thread;
+	mutex_handle_t mutex;
+	cond_handle_t flush;
+
+	char *filename;
+	char *ifname;
+	int snaplen;
+	long maxsize;
+	int nfiles;
+
+	/* Only accessed by the capture thread while it's running */
+	FILE *file;
+	int fileidx;
+	long filesize;
+	long headersize;
+	int failed;
+};
+
+static unsigned long long
+tapcapture_time()
+{
+#if defined(_WIN32) || defined(_WIN64)
+	FILETIME ft;
+	ULARGE_INTEGER now;
+
+	/* File times are in 100ns units since the year 1601 */
+	GetSystemTimeAsFileTime(&ft);
+	now.LowPart = ft.dwLowDateTime;
+	now.HighPart = ft.dwHighDateTime;
+	return (now.QuadPart - 116444736000000000ULL) * 100;
+#else
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+#endif
+}
+
+static char *
+tapcapture_alloc(int size)
+{
+#if defined(_WIN32) || defined(_WIN64)
+	return VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+#else
+	void *ptr;
+	int flags = MAP_PRIVATE;
+
+#  if defined(MAP_ANONYMOUS)
+	flags |= MAP_ANONYMOUS;
+#  else
+	flags |= MAP_ANON;
+#  endif
+#  if defined(MAP_POPULATE)
+	/* Fault the pages in now instead of on the data path */
+	flags |= MAP_POPULATE;
+#  endif
+
+	ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+	return (ptr == MAP_FAILED) ? NULL : ptr;
+#endif
+}
+
+static void
+tapcapture_free(char *ptr, int size)
+{
+#if defined(_WIN32) || defined(_WIN64)
+	VirtualFree(ptr, 0, MEM_RELEASE);
+#else
+	munmap(ptr, size);
+#endif
+}
+
+static int
+tapcapture_open_file(tapcapture_t *capture)
+{
+	unsigned char header[128 + TAPCAPTURE_MAXNAME];
+	unsigned int value;
+	unsigned short code, len;
+	char *filename;
+	int idblen, namelen = 0;
+	int pos = 0;
+
+	filename = malloc(strlen(capture->filename) + 16);
+	if (!filename) {
+		return -1;
+	}
+	if (capture->nfiles > 1) {
+		sprintf(filename, "%s.%d", capture->filename, capture->fileidx);
+	} else {
+		strcpy(filename, capture->filename);
+	}
+
+	capture->file = fopen(filename, "wb");
+	if (!capture->file) {
+		taplog_log(capture->taplog, TAPLOG_ERR,
+		           "Error opening capture file %s: %s",
+		           filename, strerror(errno));
+		free(filename);
+		return -1;
+	}
+	free(filename);
+	setvbuf(capture->file, NULL, _IONBF, 0);
+
+	/* Section header block, the magic tells the byte order */
+	value = 0x0A0D0D0A;
+	memcpy(header + pos, &value, 4); pos += 4;
+	value = 28;
+	memcpy(header + pos, &value, 4); pos += 4;
+	value = 0x1A2B3C4D;
+	memcpy(header + pos, &value, 4); pos += 4;
+	code = 1;
+	memcpy(header + pos, &code, 2); pos += 2;
+	code = 0;
+	memcpy(header + pos, &code, 2); pos += 2;
+	memset(header + pos, 0xff, 8); pos += 8;
+	value = 28;
+	memcpy(header + pos, &value, 4); pos += 4;
+
+	/* Interface description block with nanosecond timestamps */
+	if (capture->ifname) {
+		namelen = strlen(capture->ifname);
+	}
+	idblen = 20 + 8 + 4 + (namelen ? 4 + TAPCAPTURE_PAD(namelen) : 0);
+	value = 1;
+	memcpy(header + pos, &value, 4); pos += 4;
+	value = idblen;
+	memcpy(header + pos, &value, 4); pos += 4;
+	code = 1;
+	memcpy(header + pos, &code, 2); pos += 2;
+	code = 0;
+	memcpy(header + pos, &code, 2); pos += 2;
+	value = (capture->snaplen < TAPCAPTURE_MAXSNAP) ? capture->snaplen : 0;
+	memcpy(header + pos, &value, 4); pos += 4;
+	if (namelen) {
+		code = 2;
+		len = namelen;
+		memcpy(header + pos, &code, 2); pos += 2;
+		memcpy(header + pos, &len, 2); pos += 2;
+		memset(header + pos, 0, TAPCAPTURE_PAD(namelen));
+		memcpy(header + pos, capture->ifname, namelen);
+		pos += TAPCAPTURE_PAD(namelen);
+	}
+	code = 9;
+	len = 1;
+	memcpy(header + pos, &code, 2); pos += 2;
+	memcpy(header + pos, &len, 2); pos += 2;
+	memset(header + pos, 0, 4);
+	header[pos] = 9;
+	pos += 4;
+	memset(header + pos, 0, 4); pos += 4;
+	value = idblen;
+	memcpy(header + pos, &value, 4); pos += 4;
+
+	if (fwrite(header, pos, 1, capture->file) != 1) {
+		taplog_log(capture->taplog, TAPLOG_ERR,
+		           "Error writing capture file header: %s",
+		           strerror(errno));
+		fclose(capture->file);
+		capture->file = NULL;
+		return -1;
+	}
+	capture->filesize = pos;
+	capture->headersize = pos;
+
+	return 0;
+}
+
+static int
+tapcapture_append(tapcapture_t *capture, const char *buf, int len)
+{
+	if (len && fwrite(buf, len, 1, capture->file) != 1) {
+		taplog_log(capture->taplog, TAPLOG_ERR,
+		           "Error writing capture file, stopping the capture: %s",
+		           strerror(errno));
+		return -1;
+	}
+	capture->filesize += len;
+
+	return 0;
+}
+
+static void
+tapcapture_write(tapcapture_t *capture, const char *buf, int len)
+{
+	unsigned int reclen;
+	long filesize;
+	int start = 0, pos = 0;
+
+	if (capture->failed) {
+		return;
+	}
+
+	while (pos < len) {
+		memcpy(&reclen, buf + pos + 4, 4);
+
+		/* Switch to the next file before the block that doesn't fit,
+		 * unless the file has nothing else and the block is too big */
+		filesize = capture->filesize + (pos - start);
+		if (capture->maxsize > 0 && filesize + reclen > capture->maxsize &&
+		    filesize > capture->headersize) {
+			if (tapcapture_append(capture, buf + start, pos - start) == -1) {
+				capture->failed = 1;
+				return;
+			}
+			fclose(capture->file);
+			capture->file = NULL;
+
+			capture->fileidx = (capture->fileidx + 1) % capture->nfiles;
+			if (tapcapture_open_file(capture) == -1) {
+				capture->failed = 1;
+				return;
+			}
+			start = pos;
+		}
+		pos += reclen;
+	}
+
+	if (tapcapture_append(capture, buf + start, pos - start) == -1) {
+		capture->failed = 1;
+	}
+}
+
+static THREAD_RETVAL
+tapcapture_thread(void *arg)
+{
+	tapcapture_t *capture = arg;
+	char *buf;
+	int head, len;
+
+	MUTEX_LOCK(capture->mutex);
+	while (capture->running || capture->count) {
+		if (!capture->count) {
+			COND_WAIT(capture->flush, capture->mutex);
+			continue;
+		}
+
+		head = capture->head;
+		buf = capture->buffers[head];
+		len = capture->lengths[head];
+		MUTEX_UNLOCK(capture->mutex);
+
+		/* Frames that got their space before the buffer was queued
+		 * may still be copied, nothing else touches it anymore */
+		while (capture->written[head] != len) {
+			THREAD_YIELD();
+		}
+		MEMORY_BARRIER();
+
+		tapcapture_write(capture, buf, len);
+
+		MUTEX_LOCK(capture->mutex);
+		capture->head = (capture->head + 1) % TAPCAPTURE_BUFFERS;
+		capture->count--;
+	}
+	MUTEX_UNLOCK(capture->mutex);
+
+	return 0;
+}
+
+tapcapture_t *
+tapcapture_init(taplog_t *taplog)
+{
+	tapcapture_t *capture;
+
+	assert(taplog);
+
+	capture = calloc(1, sizeof(tapcapture_t));
+	if (!capture) {
+		return NULL;
+	}
+	capture->taplog = taplog;
+
+	MUTEX_CREATE(capture->mutex);
+	COND_CREATE(capture->flush);
+
+	return capture;
+}
+
+void
+tapcapture_destroy(tapcapture_t *capture)
+{
+	int i;
+
+	if (!capture) {
+		return;
+	}
+
+	tapcapture_stop(capture);
+	for (i=0; i<TAPCAPTURE_BUFFERS; i++) {
+		if (capture->buffers[i]) {
+			tapcapture_free(capture->buffers[i], TAPCAPTURE_BUFSIZE);
+		}
+	}
+
+	COND_DESTROY(capture->flush);
+	MUTEX_DESTROY(capture->mutex);
+	free(capture->filename);
+	free(capture->ifname);
+	free(capture);
+}
+
+int
+tapcapture_start(tapcapture_t *capture, const char *filename,
+                 const char *ifname, int snaplen, long maxsize, int nfiles)
+{
+	int i;
+
+	assert(capture);
+	assert(filename);
+
+	tapcapture_stop(capture);
+
+	for (i=0; i<TAPCAPTURE_BUFFERS; i++) {
+		if (!capture->buffers[i]) {
+			capture->buffers[i] = tapcapture_alloc(TAPCAPTURE_BUFSIZE);
+		}
+		if (!capture->buffers[i]) {
+			taplog_log(capture->taplog, TAPLOG_ERR,
+			           "Error allocating capture buffers");
+			return -1;
+		}
+	}
+
+	free(capture->filename);
+	free(capture->ifname);
+	capture->filename = strdup(filename);
+	capture->ifname = ifname ? strdup(ifname) : NULL;
+	if (!capture->filename) {
+		return -1;
+	}
+	if (capture->ifname && strlen(capture->ifname) > TAPCAPTURE_MAXNAME) {
+		capture->ifname[TAPCAPTURE_MAXNAME] = '\0';
+	}
+	capture->snaplen = (snaplen > 0 && snaplen < TAPCAPTURE_MAXSNAP) ?
+	                   snaplen : TAPCAPTURE_MAXSNAP;
+	capture->maxsize = maxsize;
+	capture->nfiles = (nfiles > 1) ? nfiles : 1;
+
+	capture->fileidx = 0;
+	capture->failed = 0;
+	if (tapcapture_open_file(capture) == -1) {
+		return -1;
+	}
+
+	capture->head = 0;
+	capture->count = 0;
+	capture->fill = 0;
+	capture->reserved[0] = 0;
+	capture->written[0] = 0;
+	capture->lengths[0] = -1;
+	capture->dropped = 0;
+
+	capture->running = 1;
+	THREAD_CREATE(capture->thread, tapcapture_thread, capture);
+	if (!capture->thread) {
+		taplog_log(capture->taplog, TAPLOG_ERR,
+		           "Error starting the capture thread");
+		capture->running = 0;
+		fclose(capture->file);
+		capture->file = NULL;
+		return -1;
+	}
+
+	MUTEX_LOCK(capture->mutex);
+	capture->active = 1;
+	MUTEX_UNLOCK(capture->mutex);
+
+	return 0;
+}
+
+void
+tapcapture_stop(tapcapture_t *capture)
+{
+	long offset;
+	int fill;
+
+	assert(capture);
+
+	MUTEX_LOCK(capture->mutex);
+	if (!capture->running) {
+		MUTEX_UNLOCK(capture->mutex);
+		return;
+	}
+
+	/* Close the partially filled buffer like a frame that doesn't fit,
+	 * queue it and let the thread finish */
+	capture->active = 0;
+	fill = capture->fill;
+	offset = ATOMIC_ADD(&capture->reserved[fill], TAPCAPTURE_BUFSIZE + 1);
+	if (offset <= TAPCAPTURE_BUFSIZE) {
+		capture->lengths[fill] = offset;
+	}
+	while (capture->lengths[fill] < 0) {
+		THREAD_YIELD();
+	}
+	if (capture->lengths[fill]) {
+		capture->count++;
+	}
+	capture->running = 0;
+	COND_SIGNAL(capture->flush);
+	MUTEX_UNLOCK(capture->mutex);
+
+	THREAD_JOIN(capture->thread);
+	if (capture->file) {
+		fclose(capture->file);
+		capture->file = NULL;
+	}
+
+	if (capture->dropped) {
+		taplog_log(capture->taplog, TAPLOG_WARNING,
+		           "Capture buffers were full, %lu frames were not captured",
+		           capture->dropped);
+	}
+}
+
+/* Called when the frame didn't fit into the buffer being filled,
+ * returns -1 if the frame has to be dropped and 0 to try again */
+static int
+tapcapture_rotate(tapcapture_t *capture, int fill)
+{
+	int next, ret = 0;
+
+	MUTEX_LOCK(capture->mutex);
+	if (!capture->active) {
+		ret = -1;
+	} else if (capture->fill != fill) {
+		/* Another frame switched the buffer already */
+	} else if (capture->lengths[fill] < 0) {
+		/* Frame that closes the buffer hasn't set its length yet */
+		MUTEX_UNLOCK(capture->mutex);
+		THREAD_YIELD();
+		return 0;
+	} else if (capture->count == TAPCAPTURE_BUFFERS - 1) {
+		/* The thread is not keeping up with the traffic */
+		capture->dropped++;
+		ret = -1;
+	} else {
+		next = (fill + 1) % TAPCAPTURE_BUFFERS;
+		capture->reserved[next] = 0;
+		capture->written[next] = 0;
+		capture->lengths[next] = -1;
+		MEMORY_BARRIER();
+		capture->fill = next;
+
+		capture->count++;
+		COND_SIGNAL(capture->flush);
+	}
+	MUTEX_UNLOCK(capture->mutex);
+
+	return ret;
+}
+
+void
+tapcapture_frame(tapcapture_t *capture, int direction, const void *buf, int len)
+{
+	static const unsigned short flagsopt[2] = { 2, 4 };
+	unsigned int block[7], trailer[3];
+	unsigned long long ts;
+	int caplen, padded, reclen, fill;
+	long offset;
+	char *ptr;
+
+	if (!capture->active) {
+		return;
+	}
+
+	caplen = (len < capture->snaplen) ? len : capture->snaplen;
+	padded = TAPCAPTURE_PAD(caplen);
+	reclen = TAPCAPTURE_EPB_SIZE + padded;
+	ts = tapcapture_time();
+
+	/* Enhanced packet block with the direction in the flags option */
+	block[0] = 6;
+	block[1] = reclen;
+	block[2] = 0;
+	block[3] = (unsigned int) (ts >> 32);
+	block[4] = (unsigned int) ts;
+	block[5] = caplen;
+	block[6] = len;
+	trailer[0] = direction;
+	trailer[1] = 0;
+	trailer[2] = reclen;
+
+	while (1) {
+		fill = capture->fill;
+
+		/* Checked first so that the offset of a full buffer
+		 * doesn't keep growing while the frames are dropped */
+		offset = capture->reserved[fill];
+		if (offset <= TAPCAPTURE_BUFSIZE) {
+			offset = ATOMIC_ADD(&capture->reserved[fill], reclen);
+			if (offset + reclen <= TAPCAPTURE_BUFSIZE) {
+				break;
+			}
+			if (offset <= TAPCAPTURE_BUFSIZE) {
+				/* First frame that doesn't fit, the buffer ends here */
+				capture->lengths[fill] = offset;
+				MEMORY_BARRIER();
+			}
+		}
+		if (tapcapture_rotate(capture, fill) == -1) {
+			return;
+		}
+	}
+
+	ptr = capture->buffers[fill] + offset;
+	memcpy(ptr, block, sizeof(block));
+	memcpy(ptr + 28, buf, caplen);
+	memset(ptr + 28 + caplen, 0, padded - caplen);
+	memcpy(ptr + 28 + padded, flagsopt, sizeof(flagsopt));
+	memcpy(ptr + 32 + padded, trailer, sizeof(trailer));
+
+	/* Lets the thread know that the space is filled in */
+	MEMORY_BARRIER();
+	ATOMIC_ADD(&capture->written[fill], reclen);
+}
@@ -0,0 +1,35 @@
+/**
+ *  tapcfg - A cross-platform configuration utility for TAP driver
+ *  Copyright (C) 2008-2011  Juho Vähä-Herttua
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#ifndef TAPCAPTURE_H
+#define TAPCAPTURE_H
+
+/* Directions as encoded in the pcapng packet flags, seen from the
+ * interface, so frames read from the device are outbound */
+#define TAPCAPTURE_INBOUND  1
+#define TAPCAPTURE_OUTBOUND 2
+
+typedef struct tapcapture_s tapcapture_t;
+
+tapcapture_t *tapcapture_init(taplog_t *taplog);
+void tapcapture_destroy(tapcapture_t *capture);
+
+int tapcapture_start(tapcapture_t *capture, const char *filename,
+                     const char *ifname, int snaplen, long maxsize, int nfiles);
+void tapcapture_stop(tapcapture_t *capture);
+
+void tapcapture_frame(tapcapture_t *capture, int direction, const void *buf, int len);
+
+#endif /* TAPCAPTURE_H */
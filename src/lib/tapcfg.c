@@ -17,13 +17,82 @@
 
 #include "tapcfg.h"
 #include "taplog.h"
+#include "tapcapture.h"
 
 #define TAPCFG_BUFSIZE 4096
 
+/* Largest frames are up to 64kB plus the Ethernet header */
+#define TAPCFG_MAX_BUFSIZE (65536 + 18)
+
+#define TAPCFG_CACHELINE 64
+
+/* Counters of one direction of the data path. They are only updated
+ * by the thread reading or writing, the padding keeps the directions
+ * on separate cache lines so the two threads don't slow each other */
+typedef struct tapcfg_counters_s {
+	unsigned long long frames;
+	unsigned long long bytes;
+	unsigned long long errors;
+	unsigned long long dropped;
+	unsigned long long truncated;
+	unsigned long long latency[TAPCFG_STATS_BUCKETS];
+	char pad[TAPCFG_CACHELINE];
+} tapcfg_counters_t;
+
 #define TAPCFG_COMMON \
 	int started; \
 	int status; \
-	taplog_t taplog
+	taplog_t taplog; \
+	tapcfg_counters_t rx_counters; \
+	tapcfg_counters_t tx_counters; \
+	tapcapture_t *capture
+
+static void
+tapcfg_count_latency(tapcfg_counters_t *counters, long usec)
+{
+	int bucket;
+
+	for (bucket=0; bucket<TAPCFG_STATS_BUCKETS-1; bucket++) {
+		if (usec < (1L << bucket))
+			break;
+	}
+	counters->latency[bucket]++;
+}
+
+/* Account a finished read or write call, the frames of batches
+ * are counted as they complete and are not included here */
+static void
+tapcfg_count_call(tapcfg_counters_t *counters, int ret, long usec)
+{
+	/* Calls that would have blocked didn't do anything */
+	if (ret == TAPCFG_EAGAIN) {
+		return;
+	} else if (ret < 0) {
+		counters->errors++;
+	}
+	tapcfg_count_latency(counters, usec);
+}
+
+static void
+tapcfg_add_counters(tapcfg_stats_t *stats,
+                    const tapcfg_counters_t *rx,
+                    const tapcfg_counters_t *tx)
+{
+	int i;
+
+	stats->rx_frames += rx->frames;
+	stats->rx_bytes += rx->bytes;
+	stats->rx_errors += rx->errors;
+	stats->rx_dropped += rx->dropped;
+	stats->rx_truncated += rx->truncated;
+	stats->tx_frames += tx->frames;
+	stats->tx_bytes += tx->bytes;
+	stats->tx_errors += tx->errors;
+	for (i=0; i<TAPCFG_STATS_BUCKETS; i++) {
+		stats->rx_latency[i] += rx->latency[i];
+		stats->tx_latency[i] += tx->latency[i];
+	}
+}
 
 #if defined(_WIN32) || defined(_WIN64)
 #  include "tapcfg_windows.c"
@@ -31,6 +100,48 @@
 #  include "tapcfg_unix.c"
 #endif
 
+int
+tapcfg_capture_start(tapcfg_t *tapcfg, const char *filename,
+                     int snaplen, long maxsize, int nfiles)
+{
+	tapcapture_t *capture;
+
+	assert(tapcfg);
+	assert(filename);
+
+	capture = tapcfg->capture;
+	if (!capture) {
+		capture = tapcapture_init(&tapcfg->taplog);
+		if (!capture) {
+			return -1;
+		}
+	}
+
+	if (tapcapture_start(capture, filename, tapcfg_get_ifname(tapcfg),
+	                     snaplen, maxsize, nfiles) == -1) {
+		if (!tapcfg->capture) {
+			tapcapture_destroy(capture);
+		}
+		return -1;
+	}
+
+	/* Kept until the device is destroyed, so the data path can
+	 * check it without locking */
+	tapcfg->capture = capture;
+
+	return 0;
+}
+
+void
+tapcfg_capture_stop(tapcfg_t *tapcfg)
+{
+	assert(tapcfg);
+
+	if (tapcfg->capture) {
+		tapcapture_stop(tapcfg->capture);
+	}
+}
+
 int
 tapcfg_get_version()
 {
@@ -48,3 +159,15 @@ tapcfg_set_log_callback(tapcfg_t *tapcfg, taplog_callback_t callback)
 {
 	taplog_set_callback(&tapcfg->taplog, callback);
 }
+
+int
+tapcfg_set_log_async(tapcfg_t *tapcfg, int enabled)
+{
+	return taplog_set_async(&tapcfg->taplog, enabled);
+}
+
+int
+tapcfg_set_log_rate_limit(tapcfg_t *tapcfg, int level, int rate, int burst)
+{
+	return taplog_set_rate_limit(&tapcfg->taplog, level, rate, burst);
+}
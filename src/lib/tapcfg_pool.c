@@ -0,0 +1,249 @@
+/**
+ *  tapcfg - A cross-platform configuration utility for TAP driver
+ *  Copyright (C) 2008-2011  Juho Vähä-Herttua
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#if !defined(_WIN32) && !defined(_WIN64)
+#  include <time.h>
+#endif
+
+#include "tapcfg.h"
+#include "tapthread.h"
+
+struct tapcfg_pool_s {
+	char *ifname;
+	int mtu;
+
+	/* Ring of started devices waiting to be handed out */
+	tapcfg_t **devices;
+	int size;
+	int first;
+	int count;
+
+	int running;
+	int failed;
+	thread_handle_t thread;
+	mutex_handle_t mutex;
+	cond_handle_t refill;
+
+	unsigned long allocs;
+	unsigned long misses;
+	unsigned long failures;
+	unsigned long max_usec;
+	double total_usec;
+};
+
+static double
+tapcfg_pool_usec()
+{
+#if defined(_WIN32) || defined(_WIN64)
+	LARGE_INTEGER freq, now;
+
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (double) now.QuadPart * 1000000.0 / freq.QuadPart;
+#else
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000.0 + now.tv_nsec / 1000;
+#endif
+}
+
+static tapcfg_t *
+tapcfg_pool_create(tapcfg_pool_t *pool)
+{
+	tapcfg_t *tapcfg;
+
+	tapcfg = tapcfg_init();
+	if (!tapcfg) {
+		return NULL;
+	}
+
+	if (tapcfg_start(tapcfg, pool->ifname, 1) < 0) {
+		tapcfg_destroy(tapcfg);
+		return NULL;
+	}
+	if (pool->mtu > 0 && tapcfg_iface_set_mtu(tapcfg, pool->mtu) < 0) {
+		tapcfg_destroy(tapcfg);
+		return NULL;
+	}
+
+	return tapcfg;
+}
+
+static THREAD_RETVAL
+tapcfg_pool_thread(void *arg)
+{
+	tapcfg_pool_t *pool = arg;
+	tapcfg_t *tapcfg;
+
+	MUTEX_LOCK(pool->mutex);
+	while (pool->running) {
+		if (pool->count == pool->size || pool->failed) {
+			COND_WAIT(pool->refill, pool->mutex);
+			continue;
+		}
+
+		/* Creating the device is slow, don't block hand-outs */
+		MUTEX_UNLOCK(pool->mutex);
+		tapcfg = tapcfg_pool_create(pool);
+		MUTEX_LOCK(pool->mutex);
+
+		if (!tapcfg) {
+			/* Don't retry before the next hand-out */
+			pool->failures++;
+			pool->failed = 1;
+			continue;
+		}
+		pool->devices[(pool->first + pool->count) % pool->size] = tapcfg;
+		pool->count++;
+	}
+	MUTEX_UNLOCK(pool->mutex);
+
+	return 0;
+}
+
+tapcfg_pool_t *
+tapcfg_pool_init(const char *ifname, int mtu, int size)
+{
+	tapcfg_pool_t *pool;
+
+	assert(ifname);
+
+	if (size <= 0) {
+		return NULL;
+	}
+
+	pool = calloc(1, sizeof(tapcfg_pool_t));
+	if (!pool) {
+		return NULL;
+	}
+	pool->ifname = strdup(ifname);
+	pool->devices = calloc(size, sizeof(tapcfg_t *));
+	if (!pool->ifname || !pool->devices) {
+		free(pool->ifname);
+		free(pool->devices);
+		free(pool);
+		return NULL;
+	}
+	pool->mtu = mtu;
+	pool->size = size;
+
+	MUTEX_CREATE(pool->mutex);
+	COND_CREATE(pool->refill);
+
+	pool->running = 1;
+	THREAD_CREATE(pool->thread, tapcfg_pool_thread, pool);
+	if (!pool->thread) {
+		COND_DESTROY(pool->refill);
+		MUTEX_DESTROY(pool->mutex);
+		free(pool->ifname);
+		free(pool->devices);
+		free(pool);
+		return NULL;
+	}
+
+	return pool;
+}
+
+void
+tapcfg_pool_destroy(tapcfg_pool_t *pool)
+{
+	if (!pool) {
+		return;
+	}
+
+	MUTEX_LOCK(pool->mutex);
+	pool->running = 0;
+	COND_SIGNAL(pool->refill);
+	MUTEX_UNLOCK(pool->mutex);
+	THREAD_JOIN(pool->thread);
+
+	while (pool->count > 0) {
+		tapcfg_destroy(pool->devices[pool->first]);
+		pool->first = (pool->first + 1) % pool->size;
+		pool->count--;
+	}
+
+	COND_DESTROY(pool->refill);
+	MUTEX_DESTROY(pool->mutex);
+	free(pool->ifname);
+	free(pool->devices);
+	free(pool);
+}
+
+tapcfg_t *
+tapcfg_pool_get(tapcfg_pool_t *pool)
+{
+	tapcfg_t *tapcfg = NULL;
+	double start, usec;
+
+	assert(pool);
+
+	start = tapcfg_pool_usec();
+
+	MUTEX_LOCK(pool->mutex);
+	if (pool->count > 0) {
+		tapcfg = pool->devices[pool->first];
+		pool->devices[pool->first] = NULL;
+		pool->first = (pool->first + 1) % pool->size;
+		pool->count--;
+	} else {
+		pool->misses++;
+	}
+	pool->failed = 0;
+	COND_SIGNAL(pool->refill);
+	MUTEX_UNLOCK(pool->mutex);
+
+	if (!tapcfg) {
+		/* Pool ran dry, fall back to creating the device here */
+		tapcfg = tapcfg_pool_create(pool);
+		if (!tapcfg) {
+			return NULL;
+		}
+	}
+
+	usec = tapcfg_pool_usec() - start;
+
+	MUTEX_LOCK(pool->mutex);
+	pool->allocs++;
+	pool->total_usec += usec;
+	if (usec > pool->max_usec) {
+		pool->max_usec = usec;
+	}
+	MUTEX_UNLOCK(pool->mutex);
+
+	return tapcfg;
+}
+
+void
+tapcfg_pool_get_stats(tapcfg_pool_t *pool, tapcfg_pool_stats_t *stats)
+{
+	assert(pool);
+	assert(stats);
+
+	MUTEX_LOCK(pool->mutex);
+	stats->depth = pool->count;
+	stats->size = pool->size;
+	stats->allocs = pool->allocs;
+	stats->misses = pool->misses;
+	stats->failures = pool->failures;
+	stats->avg_usec = pool->allocs ? pool->total_usec / pool->allocs : 0;
+	stats->max_usec = pool->max_usec;
+	MUTEX_UNLOCK(pool->mutex);
+}
@@ -21,11 +21,14 @@
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
 
+#include <time.h>
 #include <sys/time.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netdb.h>
 
 #include <arpa/inet.h>
@@ -40,6 +43,16 @@
 #define MAX_IFNAME (IFNAMSIZ-1)
 #define HWADDRLEN 6
 
+/* Maximum number of frames handled with a single system call */
+#define TAPCFG_BATCH_MAX 64
+
+/* Empty busy poll spins in a row before the device is considered idle */
+#define TAPCFG_BUSY_POLL_IDLE 8
+
+#if defined(__linux__)
+#  include <sys/epoll.h>
+#endif
+
 struct tapcfg_s {
 	TAPCFG_COMMON;
 
@@ -48,13 +61,86 @@ struct tapcfg_s {
 	char ifname[MAX_IFNAME+1];
 	unsigned char hwaddr[HWADDRLEN];
 
-	char buffer[TAPCFG_BUFSIZE];
+	char *buffer;
+	int bufsize;
 	int buflen;
 
+	/* Buffer size needed after an MTU change, every handle grows its
+	 * own buffer to this on its next read */
+	volatile int bufwant;
+
+	int offload;
+	tapcfg_vnet_hdr_t vnet_hdr;
+
+	int nonblocking;
+
+	/* Busy poll budget in microseconds and its statistics */
+	int busy_poll;
+	int busy_idle;
+	unsigned long busy_hits;
+	unsigned long busy_misses;
+
+	/* Attributes cached by the link monitor, read without locking */
+	int monitored;
+	volatile int link_flags;
+	volatile int link_mtu;
+	volatile unsigned int link_ipv4;
+	volatile int link_ipv4_netbits;
+	tapcfg_link_callback_t link_callback;
+	void *link_data;
+
+	/* Engine used for the data path, see TAPCFG_ENGINE_* */
+	int engine;
+
+	/* Queues of a multiqueue device, the first one is the device */
+	int multiqueue;
+	tapcfg_t **queues;
+	int nqueues;
+	tapcfg_t *parent;
+	int queue_disabled;
+
+#ifdef HAVE_LINUX_IO_URING_H
+	/* Separate rings so that reading and writing threads don't race */
+	struct tapcfg_uring_s *rx_ring;
+	struct tapcfg_uring_s *tx_ring;
+	int rx_ring_failed;
+	int tx_ring_failed;
+	struct iovec rx_iov[TAPCFG_BATCH_MAX*3];
+	struct iovec tx_iov[TAPCFG_BATCH_MAX*2];
+
+	/* Reads kept posted by the io_uring engine */
+	struct tapcfg_uring_engine_s *uring_engine;
+#endif
+#if defined(__linux__)
+	struct tapcfg_packet_engine_s *packet_engine;
+
+	/* Configuration is done with netlink addressed by the index */
+	int nl_fd;
+	unsigned int nl_seq;
+	int ifindex;
+	unsigned int ipv4_addr;
+	unsigned char ipv4_netbits;
+	struct in6_addr ipv6_addr;
+	unsigned char ipv6_netbits;
+
+	/* Asynchronous configurations of the device in submission order,
+	 * only the first one is queued or sent to the kernel */
+	struct tapcfg_async_op_s *async_head;
+	struct tapcfg_async_op_s *async_tail;
+#endif
+
 	/* These are required for Solaris implementation */
 	int ip_fd, ip6_fd;
 };
 
+/* Interface configuration that has been validated and parsed */
+typedef struct tapcfg_config_s {
+	tapcfg_iface_config_t iface;
+	unsigned int addr;
+	unsigned int mask;
+	struct in6_addr addr6;
+} tapcfg_config_t;
+
 /* This will use the tapcfg_s struct so we need it here */
 #if defined(__linux__)
 #  include "tapcfg_unix_linux.h"
@@ -64,6 +150,27 @@ struct tapcfg_s {
 #  include "tapcfg_unix_bsd.h"
 #endif
 
+/* Frames are prefixed by the offload header when offloads are enabled */
+#define TAPCFG_VNET_HDRLEN(tapcfg) \
+	((tapcfg)->offload ? sizeof(tapcfg_vnet_hdr_t) : 0)
+
+static const tapcfg_vnet_hdr_t tapcfg_vnet_hdr_none;
+
+static long tapcfg_elapsed_usec(const struct timespec *start);
+static void tapcfg_capture_frame(tapcfg_t *tapcfg, int direction, const void *buf, int len);
+static void tapcfg_complete_read(tapcfg_t *tapcfg, tapcfg_frame_t *frame, int ret);
+#if defined(__linux__)
+static void tapcfg_async_cancel(tapcfg_t *tapcfg);
+#endif
+
+/* This will use the tapcfg_s struct as well */
+#ifdef HAVE_LINUX_IO_URING_H
+#  include "tapcfg_unix_uring.h"
+#endif
+#if defined(__linux__)
+#  include "tapcfg_unix_packet.h"
+#endif
+
 tapcfg_t *
 tapcfg_init()
 {
@@ -78,6 +185,9 @@ tapcfg_init()
 	tapcfg->tap_fd = -1;
 	tapcfg->ip_fd = -1;
 	tapcfg->ip6_fd = -1;
+#if defined(__linux__)
+	tapcfg->nl_fd = -1;
+#endif
 
 	return tapcfg;
 }
@@ -86,45 +196,216 @@ void
 tapcfg_destroy(tapcfg_t *tapcfg)
 {
 	if (tapcfg) {
+		/* Queue handles are owned by their device */
+		assert(!tapcfg->parent);
 		tapcfg_stop(tapcfg);
+		tapcapture_destroy(tapcfg->capture);
+		taplog_set_async(&tapcfg->taplog, 0);
 	}
 	free(tapcfg);
 }
 
-int
-tapcfg_start(tapcfg_t *tapcfg, const char *ifname, int fallback)
+static int
+tapcfg_resize_buffer(tapcfg_t *tapcfg, int size)
 {
-	int tap_fd;
-	int ctrl_fd;
-
-	assert(tapcfg);
+	char *buffer;
 
-	/* Check if we are already running and return success */
-	if (tapcfg->started) {
+	if (size < TAPCFG_BUFSIZE) {
+		size = TAPCFG_BUFSIZE;
+	}
+	if (size <= tapcfg->bufsize) {
+		/* The buffer is never shrunk, it might contain a frame */
 		return 0;
 	}
 
-	if (ifname == NULL) {
-		ifname = "";
-		fallback = 1;
+	buffer = realloc(tapcfg->buffer, size);
+	if (!buffer) {
+		taplog_log(&tapcfg->taplog, TAPLOG_ERR,
+		           "Error allocating buffer of %d bytes", size);
+		return -1;
+	}
+	tapcfg->buffer = buffer;
+	tapcfg->bufsize = size;
+
+	return 0;
+}
+
+/* Only called by the thread reading from the handle, so the buffer
+ * can't be replaced under a read of another thread */
+static void
+tapcfg_update_buffer(tapcfg_t *tapcfg)
+{
+	tapcfg_t *device = tapcfg->parent ? tapcfg->parent : tapcfg;
+	int bufwant = device->bufwant;
+
+	if (bufwant > tapcfg->bufsize) {
+		/* On failure bigger frames are dropped and counted */
+		tapcfg_resize_buffer(tapcfg, bufwant);
+	}
+}
+
+static int
+tapcfg_fd_nonblocking(tapcfg_t *tapcfg, int fd, int enabled)
+{
+	int flags;
+
+	/* The io_uring engine handles non-blocking reads by itself,
+	 * the reads it has posted must be allowed to wait for frames */
+	if (tapcfg->engine == TAPCFG_ENGINE_URING) {
+		enabled = 0;
+	}
+
+	flags = fcntl(fd, F_GETFL);
+	if (flags != -1) {
+		if (enabled) {
+			flags |= O_NONBLOCK;
+		} else {
+			flags &= ~O_NONBLOCK;
+		}
+		flags = fcntl(fd, F_SETFL, flags);
+	}
+	if (flags == -1) {
+		taplog_log(&tapcfg->taplog, TAPLOG_ERR,
+		           "Error setting non-blocking mode: %s",
+		           strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+tapcfg_mtu_ioctl(tapcfg_t *tapcfg)
+{
+	struct ifreq ifr;
+	int ret;
+
+	memset(&ifr, 0, sizeof(ifr));
+	strcpy(ifr.ifr_name, tapcfg->ifname);
+
+	ret = ioctl(tapcfg->ctrl_fd, SIOCGIFMTU, &ifr);
+	if (ret == -1) {
+		taplog_log(&tapcfg->taplog, TAPLOG_ERR,
+		           "Error getting the MTU of device: %s",
+		           strerror(errno));
+		return -1;
+	}
+
+#ifdef __sun__
+	return ifr.ifr_metric;
+#else
+	return ifr.ifr_mtu;
+#endif
+}
+
+#ifdef HAVE_LINUX_IO_URING_H
+static tapcfg_uring_t *
+tapcfg_batch_ring(tapcfg_t *tapcfg, tapcfg_uring_t **ringp, int *failed)
+{
+	tapcfg_uring_t *ring;
+
+	if (*ringp || *failed) {
+		return *ringp;
+	}
+
+	ring = malloc(sizeof(tapcfg_uring_t));
+	if (!ring || tapcfg_uring_init(ring, TAPCFG_BATCH_MAX) == -1) {
+		taplog_log(&tapcfg->taplog, TAPLOG_INFO,
+		           "Unable to set up io_uring, falling back to "
+		           "single frame system calls");
+		free(ring);
+		*failed = 1;
+		return NULL;
+	}
+	*ringp = ring;
+
+	return ring;
+}
+
+static void
+tapcfg_batch_ring_free(tapcfg_uring_t **ringp)
+{
+	if (*ringp) {
+		tapcfg_uring_destroy(*ringp);
+		free(*ringp);
+		*ringp = NULL;
 	}
+}
+
+static void
+tapcfg_batch_stop(tapcfg_t *tapcfg)
+{
+	tapcfg_batch_ring_free(&tapcfg->rx_ring);
+	tapcfg_batch_ring_free(&tapcfg->tx_ring);
+	tapcfg->rx_ring_failed = 0;
+	tapcfg->tx_ring_failed = 0;
+}
+#endif
 
-	tap_fd = tapcfg_start_dev(tapcfg, ifname, fallback);
+static int
+tapcfg_open(tapcfg_t *tapcfg, const char *ifname, int fallback, int attach)
+{
+	int tap_fd;
+	int ctrl_fd;
+	int mtu;
+
+	if (attach) {
+		tap_fd = tapcfg_attach_dev(tapcfg, ifname);
+	} else {
+		tap_fd = tapcfg_start_dev(tapcfg, ifname, fallback);
+	}
 	if (tap_fd < 0) {
 		goto err;
 	}
 
+	if (tapcfg->nonblocking &&
+	    tapcfg_fd_nonblocking(tapcfg, tap_fd, 1) == -1) {
+		goto err;
+	}
+
 	ctrl_fd = socket(AF_INET, SOCK_DGRAM, 0);
 	if (ctrl_fd == -1) {
 		taplog_log(&tapcfg->taplog, TAPLOG_ERR,
 		           "Error opening control socket for ioctls: %s",
 		           strerror(errno));
-		return -1;
+		goto err;
 	}
 
-	/* Mark the current fds and mark thread as running */
+	/* Mark the current fds */
 	tapcfg->tap_fd = tap_fd;
 	tapcfg->ctrl_fd = ctrl_fd;
+
+	/* Offloaded frames can be much bigger than the MTU, otherwise
+	 * make sure the frames of the current MTU fit into the buffer */
+	if (tapcfg->offload) {
+		mtu = TAPCFG_MAX_BUFSIZE - 22;
+	} else {
+		mtu = tapcfg_mtu_ioctl(tapcfg);
+	}
+	if (tapcfg_resize_buffer(tapcfg, mtu + 22) == -1) {
+		close(ctrl_fd);
+		tapcfg->ctrl_fd = -1;
+		goto err;
+	}
+
+#ifdef HAVE_LINUX_IO_URING_H
+	if (tapcfg->engine == TAPCFG_ENGINE_URING &&
+	    tapcfg_uring_engine_start(tapcfg) == -1) {
+		close(ctrl_fd);
+		tapcfg->ctrl_fd = -1;
+		goto err;
+	}
+#endif
+#if defined(__linux__)
+	if (tapcfg->engine == TAPCFG_ENGINE_PACKET &&
+	    tapcfg_packet_engine_start(tapcfg) == -1) {
+		close(ctrl_fd);
+		tapcfg->ctrl_fd = -1;
+		goto err;
+	}
+#endif
+
+	/* Mark thread as running */
 	tapcfg->started = 1;
 	tapcfg->status = TAPCFG_STATUS_ALL_DOWN;
 
@@ -132,275 +413,432 @@ tapcfg_start(tapcfg_t *tapcfg, const char *ifname, int fallback)
 
 err:
 	/* Clean up in case of an error */
-	tapcfg->ifname[0] = '\0';
-	if (tap_fd != -1)
+	if (tap_fd != -1) {
+		tapcfg_stop_dev(tapcfg);
 		close(tap_fd);
+	}
+	tapcfg->ifname[0] = '\0';
 	tapcfg->tap_fd = -1;
 
-	return -1;
-}
-
-void
-tapcfg_stop(tapcfg_t *tapcfg)
-{
-	assert(tapcfg);
-
-	if (tapcfg->started) {
-		tapcfg_stop_dev(tapcfg);
-		if (tapcfg->tap_fd != -1) {
-			close(tapcfg->tap_fd);
-			tapcfg->tap_fd = -1;
-		}
-		if (tapcfg->ctrl_fd != -1) {
-			close(tapcfg->ctrl_fd);
-			tapcfg->ctrl_fd = -1;
-		}
-		tapcfg->started = 0;
-		tapcfg->status = TAPCFG_STATUS_ALL_DOWN;
-	}
-}
+	/* The handle was never started, so tapcfg_stop won't free it */
+	free(tapcfg->buffer);
+	tapcfg->buffer = NULL;
+	tapcfg->bufsize = 0;
 
-int
-tapcfg_get_fd(tapcfg_t *tapcfg)
-{
-  return tapcfg->tap_fd;
+	return -1;
 }
 
 int
-tapcfg_wait_readable(tapcfg_t *tapcfg, int msec)
+tapcfg_start(tapcfg_t *tapcfg, const char *ifname, int fallback)
 {
-	fd_set rfds;
-	struct timeval tv;
-	int ret;
-
 	assert(tapcfg);
 
-	if (!tapcfg->started) {
+	/* Check if we are already running and return success */
+	if (tapcfg->started) {
 		return 0;
 	}
 
-	tv.tv_sec = (msec / 1000);
-	tv.tv_usec = (msec % 1000) * 1000;
-
-	FD_ZERO(&rfds);
-	FD_SET(tapcfg->tap_fd, &rfds);
-	ret = select(tapcfg->tap_fd+1, &rfds, NULL, NULL, &tv);
-	if (ret == -1) {
-		/* Error selecting, no data available */
-		return 0;
+	if (ifname == NULL) {
+		ifname = "";
+		fallback = 1;
 	}
-	ret = FD_ISSET(tapcfg->tap_fd, &rfds);
 
-	return ret;
+	return tapcfg_open(tapcfg, ifname, fallback, 0);
 }
 
 int
-tapcfg_read(tapcfg_t *tapcfg, void *buf, int count)
+tapcfg_attach(tapcfg_t *tapcfg, const char *ifname)
 {
-	int ret;
+	struct ifreq ifr;
 
 	assert(tapcfg);
 
-	if (!tapcfg->started) {
+	if (tapcfg->started) {
 		return -1;
 	}
 
-	if (!tapcfg->buflen) {
-		ret = read(tapcfg->tap_fd, tapcfg->buffer,
-			   sizeof(tapcfg->buffer));
-		if (ret <= 0) {
-			return ret;
-		}
-		tapcfg->buflen = ret;
-	}
-
-	if (count < tapcfg->buflen) {
+	/* Make sure we don't end up creating a new device */
+	if (!ifname || !if_nametoindex(ifname)) {
 		taplog_log(&tapcfg->taplog, TAPLOG_ERR,
-		           "Buffer not big enough for reading, "
-		           "need at least %d bytes",
-		           tapcfg->buflen);
+		           "Interface \"%s\" doesn't exist",
+		           ifname ? ifname : "");
 		return -1;
 	}
 
-	ret = tapcfg->buflen;
-	memcpy(buf, tapcfg->buffer, tapcfg->buflen);
-	tapcfg->buflen = 0;
+	if (tapcfg_open(tapcfg, ifname, 0, 1) == -1) {
+		return -1;
+	}
 
-	taplog_log(&tapcfg->taplog, TAPLOG_DEBUG, "Read ethernet frame:");
-	taplog_log_ethernet_info(&tapcfg->taplog, TAPLOG_DEBUG, buf, ret);
+	/* The configuration is kept as it is, only read back the status */
+	memset(&ifr, 0, sizeof(ifr));
+	strcpy(ifr.ifr_name, tapcfg->ifname);
+	if (ioctl(tapcfg->ctrl_fd, SIOCGIFFLAGS, &ifr) != -1 &&
+	    (ifr.ifr_flags & IFF_UP)) {
+		tapcfg->status = TAPCFG_STATUS_ALL_UP;
+	}
 
-	return ret;
+	return 0;
 }
 
-int
-tapcfg_wait_writable(tapcfg_t *tapcfg, int msec)
+static tapcfg_t *
+tapcfg_start_queue(tapcfg_t *tapcfg)
 {
-	fd_set wfds;
-	struct timeval tv;
-	int ret;
+	tapcfg_t *queue;
 
-	assert(tapcfg);
-
-	if (!tapcfg->started) {
-		return 0;
+	queue = tapcfg_init();
+	if (!queue) {
+		return NULL;
+	}
+	queue->taplog = tapcfg->taplog;
+	queue->taplog.async = 0;
+	taplog_set_async(&queue->taplog, tapcfg->taplog.async);
+	queue->offload = tapcfg->offload;
+	queue->nonblocking = tapcfg->nonblocking;
+	queue->engine = tapcfg->engine;
+	queue->multiqueue = 1;
+
+	queue->tap_fd = tapcfg_start_queue_dev(queue, tapcfg->ifname);
+	if (queue->tap_fd < 0) {
+		tapcfg_destroy(queue);
+		return NULL;
+	}
+	if ((queue->nonblocking &&
+	     tapcfg_fd_nonblocking(queue, queue->tap_fd, 1) == -1) ||
+	    tapcfg_resize_buffer(queue, (tapcfg->bufwant > tapcfg->bufsize) ?
+	                                tapcfg->bufwant : tapcfg->bufsize) == -1) {
+		close(queue->tap_fd);
+		tapcfg_destroy(queue);
+		return NULL;
 	}
 
-	tv.tv_sec = (msec / 1000);
-	tv.tv_usec = (msec % 1000) * 1000;
-
-	FD_ZERO(&wfds);
-	FD_SET(tapcfg->tap_fd, &wfds);
-	ret = select(tapcfg->tap_fd+1, NULL, &wfds, NULL, &tv);
-	if (ret == -1) {
-		/* Error selecting, no data available */
-		return 0;
+#ifdef HAVE_LINUX_IO_URING_H
+	if (queue->engine == TAPCFG_ENGINE_URING &&
+	    tapcfg_uring_engine_start(queue) == -1) {
+		close(queue->tap_fd);
+		tapcfg_destroy(queue);
+		return NULL;
+	}
+#endif
+#if defined(__linux__)
+	if (queue->engine == TAPCFG_ENGINE_PACKET &&
+	    tapcfg_packet_engine_start(queue) == -1) {
+		close(queue->tap_fd);
+		tapcfg_destroy(queue);
+		return NULL;
 	}
-	ret = FD_ISSET(tapcfg->tap_fd, &wfds);
+#endif
 
-	return ret;
+	/* Configuration is done through the device, no control socket */
+	queue->ctrl_fd = -1;
+	strcpy(queue->ifname, tapcfg->ifname);
+	memcpy(queue->hwaddr, tapcfg->hwaddr, HWADDRLEN);
+	queue->parent = tapcfg;
+	queue->started = 1;
+
+	return queue;
 }
 
 int
-tapcfg_write(tapcfg_t *tapcfg, void *buf, int count)
+tapcfg_start_multiqueue(tapcfg_t *tapcfg, const char *ifname, int nqueues)
 {
-	int ret;
+	int i;
 
 	assert(tapcfg);
 
-	if (!tapcfg->started) {
+	/* Check if we are already running and return success */
+	if (tapcfg->started) {
+		return 0;
+	}
+
+	if (nqueues < 1) {
 		return -1;
+	} else if (nqueues == 1) {
+		return tapcfg_start(tapcfg, ifname, 0);
 	}
 
-	ret = write(tapcfg->tap_fd, buf, count);
-	if (ret != count) {
-		taplog_log(&tapcfg->taplog, TAPLOG_ERR,
-		           "Error trying to write data to TAP device");
+	tapcfg->queues = calloc(nqueues, sizeof(tapcfg_t *));
+	if (!tapcfg->queues) {
 		return -1;
 	}
 
-	taplog_log(&tapcfg->taplog, TAPLOG_DEBUG, "Wrote ethernet frame:");
-	taplog_log_ethernet_info(&tapcfg->taplog, TAPLOG_DEBUG, buf, ret);
+	tapcfg->multiqueue = 1;
+	if (tapcfg_start(tapcfg, ifname, 0) < 0) {
+		goto err;
+	}
+	tapcfg->queues[0] = tapcfg;
+	tapcfg->nqueues = 1;
+
+	for (i=1; i<nqueues; i++) {
+		tapcfg->queues[i] = tapcfg_start_queue(tapcfg);
+		if (!tapcfg->queues[i]) {
+			tapcfg_stop(tapcfg);
+			goto err;
+		}
+		tapcfg->nqueues++;
+	}
 
-	return ret;
+	return 0;
+
+err:
+	free(tapcfg->queues);
+	tapcfg->queues = NULL;
+	tapcfg->nqueues = 0;
+	tapcfg->multiqueue = 0;
+
+	return -1;
 }
 
-char *
-tapcfg_get_ifname(tapcfg_t *tapcfg)
+int
+tapcfg_get_queue_count(tapcfg_t *tapcfg)
 {
 	assert(tapcfg);
 
 	if (!tapcfg->started) {
-		return NULL;
+		return 0;
 	}
 
-	return tapcfg->ifname;
+	return tapcfg->queues ? tapcfg->nqueues : 1;
 }
 
-const char *
-tapcfg_iface_get_hwaddr(tapcfg_t *tapcfg, int *length)
+tapcfg_t *
+tapcfg_get_queue(tapcfg_t *tapcfg, int index)
 {
 	assert(tapcfg);
 
-	if (!tapcfg->started) {
+	if (index < 0 || index >= tapcfg_get_queue_count(tapcfg)) {
 		return NULL;
 	}
 
-	if (length)
-		*length = sizeof(tapcfg->hwaddr);
-	return (const char *) tapcfg->hwaddr;
+	return tapcfg->queues ? tapcfg->queues[index] : tapcfg;
 }
 
 int
-tapcfg_iface_set_hwaddr(tapcfg_t *tapcfg, const char *hwaddr, int length)
+tapcfg_queue_set_enabled(tapcfg_t *queue, int enabled)
 {
-	int ret;
-
-	assert(tapcfg);
+	assert(queue);
 
-	if (!tapcfg->started || tapcfg->status) {
+	if (!queue->started || !queue->multiqueue) {
 		return -1;
+	} else if ((!enabled) == queue->queue_disabled) {
+		/* No need for change, this is ok */
+		return 0;
 	}
 
-	if (length != sizeof(tapcfg->hwaddr)) {
+	if (tapcfg_enable_queue_dev(queue, enabled) == -1) {
 		return -1;
 	}
-
-	ret = tapcfg_hwaddr_ioctl(tapcfg, hwaddr);
-	if (ret == -1)
-		return -1;
-
-	memcpy(tapcfg->hwaddr, hwaddr, HWADDRLEN);
+	queue->queue_disabled = !enabled;
 
 	return 0;
 }
 
 int
-tapcfg_iface_get_status(tapcfg_t *tapcfg)
+tapcfg_set_offload(tapcfg_t *tapcfg, int flags)
 {
 	assert(tapcfg);
 
-	return tapcfg->status;
+	/* Offloads are negotiated when the device is created */
+	if (tapcfg->started) {
+		return -1;
+	}
+
+#if defined(__linux__)
+	tapcfg->offload = flags & TAPCFG_OFFLOAD_ALL;
+	return 0;
+#else
+	return (flags ? -1 : 0);
+#endif
 }
 
 int
-tapcfg_iface_set_status(tapcfg_t *tapcfg, int flags)
+tapcfg_set_persistent(tapcfg_t *tapcfg, int persistent)
 {
-	struct ifreq ifr;
-
 	assert(tapcfg);
 
-	if (!tapcfg->started ||
-	    flags == tapcfg->status) {
-		/* No need for change, this is ok */
-		return 0;
+	if (!tapcfg->started) {
+		return -1;
 	}
 
-	if ((flags ^ tapcfg->status) & TAPCFG_STATUS_IPV6_ALL) {
-		tapcfg_iface_prepare_ipv6(tapcfg, flags);
+	return tapcfg_persist_dev(tapcfg, !!persistent);
+}
+
+int
+tapcfg_set_engine(tapcfg_t *tapcfg, int engine)
+{
+	assert(tapcfg);
+
+	/* The engine is set up when the device is started */
+	if (tapcfg->started) {
+		return -1;
 	}
 
-	memset(&ifr, 0, sizeof(ifr));
-	strcpy(ifr.ifr_name, tapcfg->ifname);
-	if (ioctl(tapcfg->ctrl_fd, SIOCGIFFLAGS, &ifr) == -1) {
+	switch (engine) {
+	case TAPCFG_ENGINE_DEFAULT:
+#ifdef HAVE_LINUX_IO_URING_H
+	case TAPCFG_ENGINE_URING:
+#endif
+#if defined(__linux__)
+	case TAPCFG_ENGINE_PACKET:
+#endif
+		tapcfg->engine = engine;
+		return 0;
+	default:
 		taplog_log(&tapcfg->taplog, TAPLOG_ERR,
-		           "Error calling SIOCGIFFLAGS for interface %s: %s",
-		           tapcfg->ifname,
-		           strerror(errno));
+		           "Engine %d is not supported on this system", engine);
 		return -1;
 	}
+}
 
-#ifdef __sun__
-	/* On Solaris enabling IPv6 doesn't require enabling IPv4,
-	 * also the IFF_RUNNING flag doesn't need to be set */
-	if (flags & TAPCFG_STATUS_IPV4_UP) {
-		ifr.ifr_flags |= IFF_UP;
-	} else {
-		ifr.ifr_flags &= ~IFF_UP;
+int
+tapcfg_set_nonblocking(tapcfg_t *tapcfg, int enabled)
+{
+	int i;
+
+	assert(tapcfg);
+
+	enabled = !!enabled;
+	if (tapcfg->started) {
+		if (tapcfg_fd_nonblocking(tapcfg, tapcfg->tap_fd, enabled) == -1) {
+			return -1;
+		}
+		for (i=1; i<tapcfg->nqueues; i++) {
+			if (tapcfg_set_nonblocking(tapcfg->queues[i], enabled) == -1) {
+				return -1;
+			}
+		}
 	}
-#else
-	if (flags) {
-		ifr.ifr_flags |= (IFF_UP | IFF_RUNNING);
-	} else {
-		ifr.ifr_flags &= ~(IFF_UP | IFF_RUNNING);
+	tapcfg->nonblocking = enabled;
+
+	return 0;
+}
+
+int
+tapcfg_set_busy_poll(tapcfg_t *tapcfg, int usec)
+{
+	assert(tapcfg);
+
+	if (usec < 0) {
+		return -1;
 	}
+	tapcfg->busy_poll = usec;
+	tapcfg->busy_idle = 0;
+
+	return 0;
+}
+
+void
+tapcfg_get_busy_poll_stats(tapcfg_t *tapcfg, unsigned long *hits, unsigned long *misses)
+{
+	assert(tapcfg);
+
+	if (hits)
+		*hits = tapcfg->busy_hits;
+	if (misses)
+		*misses = tapcfg->busy_misses;
+}
+
+void
+tapcfg_stop(tapcfg_t *tapcfg)
+{
+	assert(tapcfg);
+
+	if (tapcfg->started) {
+		if (tapcfg->queues) {
+			int i;
+
+			/* The first queue is the device itself */
+			for (i=1; i<tapcfg->nqueues; i++) {
+				tapcfg_stop(tapcfg->queues[i]);
+				tapcfg->queues[i]->parent = NULL;
+				tapcfg_destroy(tapcfg->queues[i]);
+			}
+			free(tapcfg->queues);
+			tapcfg->queues = NULL;
+			tapcfg->nqueues = 0;
+		}
+#ifdef HAVE_LINUX_IO_URING_H
+		tapcfg_uring_engine_stop(tapcfg);
+		tapcfg_batch_stop(tapcfg);
 #endif
+#if defined(__linux__)
+		tapcfg_packet_engine_stop(tapcfg);
+		tapcfg_async_cancel(tapcfg);
+#endif
+		if (!tapcfg->parent) {
+			tapcfg_stop_dev(tapcfg);
+		}
+		if (tapcfg->tap_fd != -1) {
+			close(tapcfg->tap_fd);
+			tapcfg->tap_fd = -1;
+		}
+		if (tapcfg->ctrl_fd != -1) {
+			close(tapcfg->ctrl_fd);
+			tapcfg->ctrl_fd = -1;
+		}
+		free(tapcfg->buffer);
+		tapcfg->buffer = NULL;
+		tapcfg->bufsize = 0;
+		tapcfg->bufwant = 0;
+		tapcfg->buflen = 0;
+		tapcfg->multiqueue = 0;
+		tapcfg->queue_disabled = 0;
+		tapcfg->started = 0;
+		tapcfg->status = TAPCFG_STATUS_ALL_DOWN;
+	}
+}
 
-	if (ioctl(tapcfg->ctrl_fd, SIOCSIFFLAGS, &ifr) == -1) {
-		taplog_log(&tapcfg->taplog, TAPLOG_ERR,
-		           "Error calling SIOCSIFFLAGS for interface %s: %s",
-		           tapcfg->ifname,
-		           strerror(errno));
-		return -1;
+int
+tapcfg_get_fd(tapcfg_t *tapcfg)
+{
+  return tapcfg->tap_fd;
+}
+
+static long
+tapcfg_elapsed_usec(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000L +
+	       (now.tv_nsec - start->tv_nsec) / 1000L;
+}
+
+/* Spin on the device for at most the busy poll budget or msec,
+ * returns non-zero if the device became readable while spinning */
+static int
+tapcfg_busy_poll_dev(tapcfg_t *tapcfg, int msec)
+{
+	struct timespec start;
+	struct pollfd pfd;
+	long budget;
+
+	budget = tapcfg->busy_poll;
+	if (msec >= 0 && msec * 1000L < budget) {
+		budget = msec * 1000L;
 	}
-	tapcfg->status = flags;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do {
+		pfd.fd = tapcfg->tap_fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN)) {
+			tapcfg->busy_hits++;
+			tapcfg->busy_idle = 0;
+			return 1;
+		}
+	} while (tapcfg_elapsed_usec(&start) < budget);
+
+	tapcfg->busy_misses++;
+	tapcfg->busy_idle++;
 
 	return 0;
 }
 
 int
-tapcfg_iface_get_mtu(tapcfg_t *tapcfg)
+tapcfg_wait_readable(tapcfg_t *tapcfg, int msec)
 {
-	struct ifreq ifr;
+	struct pollfd pfd;
 	int ret;
 
 	assert(tapcfg);
@@ -409,68 +847,193 @@ tapcfg_iface_get_mtu(tapcfg_t *tapcfg)
 		return 0;
 	}
 
-	memset(&ifr, 0, sizeof(ifr));
-	strcpy(ifr.ifr_name, tapcfg->ifname);
+	if (tapcfg->buflen) {
+		/* Frame kept from an earlier read */
+		return 1;
+	}
 
-	ret = ioctl(tapcfg->ctrl_fd, SIOCGIFMTU, &ifr);
+#ifdef HAVE_LINUX_IO_URING_H
+	if (tapcfg->uring_engine) {
+		return tapcfg_uring_engine_wait(tapcfg, msec);
+	}
+#endif
+#if defined(__linux__)
+	if (tapcfg->packet_engine) {
+		return tapcfg_packet_engine_wait(tapcfg, msec);
+	}
+#endif
+
+	/* Spin first unless the device has been idle for a while, in
+	 * that case we only block until traffic starts flowing again */
+	if (tapcfg->busy_poll && msec != 0 &&
+	    tapcfg->busy_idle < TAPCFG_BUSY_POLL_IDLE) {
+		if (tapcfg_busy_poll_dev(tapcfg, msec)) {
+			return 1;
+		}
+		if (msec > 0) {
+			msec -= tapcfg->busy_poll / 1000;
+			if (msec < 0)
+				msec = 0;
+		}
+	}
+
+	/* Unlike select, poll works with any fd number */
+	pfd.fd = tapcfg->tap_fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	ret = poll(&pfd, 1, msec);
 	if (ret == -1) {
-		taplog_log(&tapcfg->taplog, TAPLOG_ERR,
-		           "Error getting the MTU of device: %s",
-		           strerror(errno));
-		return -1;
+		/* Error polling, no data available */
+		return 0;
 	}
 
-#ifdef __sun__
-	return ifr.ifr_metric;
-#else
-	return ifr.ifr_mtu;
-#endif
+	ret = (pfd.revents & POLLIN) != 0;
+	if (ret) {
+		tapcfg->busy_idle = 0;
+	}
+
+	return ret;
 }
 
-int
-tapcfg_iface_set_mtu(tapcfg_t *tapcfg, int mtu)
+static int
+tapcfg_read_dev(tapcfg_t *tapcfg, tapcfg_vnet_hdr_t *hdr, void *buf, int count)
 {
-	struct ifreq ifr;
+	struct iovec iov[3];
+	int hdrlen, iovcnt = 0;
 	int ret;
 
 	assert(tapcfg);
 
 	if (!tapcfg->started) {
-		return 0;
-	}
-
-	/* 84 is minimum MTU from RFC 791, we limit the upper
-	 * MTU by our internal buffer size minus max header */
-	if (mtu < 68 || mtu > (TAPCFG_BUFSIZE - 22)) {
 		return -1;
 	}
 
-	memset(&ifr, 0, sizeof(ifr));
-	strcpy(ifr.ifr_name, tapcfg->ifname);
-#ifdef __sun__
-	ifr.ifr_metric = mtu;
-#else
-	ifr.ifr_mtu = mtu;
+#ifdef HAVE_LINUX_IO_URING_H
+	if (tapcfg->uring_engine) {
+		return tapcfg_uring_engine_read(tapcfg, hdr, buf, count);
+	}
+#endif
+#if defined(__linux__)
+	if (tapcfg->packet_engine) {
+		return tapcfg_packet_engine_read(tapcfg, hdr, buf, count);
+	}
 #endif
 
-	ret = ioctl(tapcfg->ctrl_fd, SIOCSIFMTU, &ifr);
-	if (ret == -1) {
-		taplog_log(&tapcfg->taplog, TAPLOG_ERR,
-		           "Error setting the MTU of device: %s",
-		           strerror(errno));
-		return -1;
+	tapcfg_update_buffer(tapcfg);
+	if (tapcfg->buflen) {
+		/* Frame left over from an earlier call with a small buffer */
+		if (count < tapcfg->buflen) {
+			taplog_log(&tapcfg->taplog, TAPLOG_ERR,
+			           "Buffer not big enough for reading, "
+			           "need at least %d bytes",
+			           tapcfg->buflen);
+			tapcfg->rx_counters.truncated++;
+			return -1;
+		}
+
+		ret = tapcfg->buflen;
+		memcpy(buf, tapcfg->buffer, tapcfg->buflen);
+		tapcfg->buflen = 0;
+	} else {
+		if (tapcfg->busy_poll && !tapcfg->nonblocking) {
+			/* Spin before blocking in the read */
+			tapcfg_wait_readable(tapcfg, -1);
+		}
+
+		/* Read straight into the caller buffer, the part that doesn't
+		 * fit is stored into our own buffer so the frame is not lost */
+		hdrlen = TAPCFG_VNET_HDRLEN(tapcfg);
+		if (hdrlen) {
+			iov[iovcnt].iov_base = &tapcfg->vnet_hdr;
+			iov[iovcnt].iov_len = hdrlen;
+			iovcnt++;
+		}
+		iov[iovcnt].iov_base = buf;
+		iov[iovcnt].iov_len = count;
+		iovcnt++;
+		iov[iovcnt].iov_base = tapcfg->buffer;
+		iov[iovcnt].iov_len = tapcfg->bufsize;
+		iovcnt++;
+		ret = readv(tapcfg->tap_fd, iov, iovcnt);
+		if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return TAPCFG_EAGAIN;
+		} else if (ret <= 0) {
+			return ret;
+		} else if (ret < hdrlen) {
+			taplog_log(&tapcfg->taplog, TAPLOG_ERR,
+			           "Frame read from TAP device missing offload header");
+			return -1;
+		}
+		ret -= hdrlen;
+
+		if (ret > count) {
+			if (ret > tapcfg->bufsize) {
+				taplog_log(&tapcfg->taplog, TAPLOG_ERR,
+				           "Frame of %d bytes doesn't fit into "
+				           "the internal buffer, dropping it", ret);
+				tapcfg->rx_counters.dropped++;
+				return -1;
+			}
+
+			/* Move the whole frame into our buffer for the next call */
+			memmove(tapcfg->buffer + count, tapcfg->buffer, ret - count);
+			memcpy(tapcfg->buffer, buf, count);
+			tapcfg->buflen = ret;
+
+			taplog_log(&tapcfg->taplog, TAPLOG_ERR,
+			           "Buffer not big enough for reading, "
+			           "need at least %d bytes",
+			           tapcfg->buflen);
+			tapcfg->rx_counters.truncated++;
+			return -1;
+		}
 	}
 
-	return mtu;
+	if (hdr) {
+		if (tapcfg->offload) {
+			memcpy(hdr, &tapcfg->vnet_hdr, sizeof(tapcfg_vnet_hdr_t));
+		} else {
+			memset(hdr, 0, sizeof(tapcfg_vnet_hdr_t));
+		}
+	}
+
+	taplog_log(&tapcfg->taplog, TAPLOG_DEBUG, "Read ethernet frame:");
+	taplog_log_ethernet_info(&tapcfg->taplog, TAPLOG_DEBUG, buf, ret);
+
+	return ret;
 }
 
 int
-tapcfg_iface_set_ipv4(tapcfg_t *tapcfg, const char *addrstr, unsigned char netbits)
+tapcfg_read_vnet(tapcfg_t *tapcfg, tapcfg_vnet_hdr_t *hdr, void *buf, int count)
 {
-	struct addrinfo hints, *res;
-	struct sockaddr_in *saddr;
-	unsigned int addr, mask;
-	int i;
+	struct timespec start;
+	int ret;
+
+	assert(tapcfg);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ret = tapcfg_read_dev(tapcfg, hdr, buf, count);
+	if (ret > 0) {
+		tapcfg->rx_counters.frames++;
+		tapcfg->rx_counters.bytes += ret;
+		tapcfg_capture_frame(tapcfg, TAPCAPTURE_OUTBOUND, buf, ret);
+	}
+	tapcfg_count_call(&tapcfg->rx_counters, ret, tapcfg_elapsed_usec(&start));
+
+	return ret;
+}
+
+int
+tapcfg_read(tapcfg_t *tapcfg, void *buf, int count)
+{
+	return tapcfg_read_vnet(tapcfg, NULL, buf, count);
+}
+
+int
+tapcfg_wait_writable(tapcfg_t *tapcfg, int msec)
+{
+	struct pollfd pfd;
+	int ret;
 
 	assert(tapcfg);
 
@@ -478,49 +1041,2017 @@ tapcfg_iface_set_ipv4(tapcfg_t *tapcfg, const char *addrstr, unsigned char netbi
 		return 0;
 	}
 
-	if (netbits == 0 || netbits > 32) {
+	pfd.fd = tapcfg->tap_fd;
+	pfd.events = POLLOUT;
+	pfd.revents = 0;
+	ret = poll(&pfd, 1, msec);
+	if (ret == -1) {
+		/* Error polling, not writable */
+		return 0;
+	}
+
+	return (pfd.revents & POLLOUT) != 0;
+}
+
+static int
+tapcfg_write_dev(tapcfg_t *tapcfg, const tapcfg_vnet_hdr_t *hdr, void *buf, int count)
+{
+	struct iovec iov[2];
+	int hdrlen;
+	int ret;
+
+	assert(tapcfg);
+
+	if (!tapcfg->started) {
 		return -1;
 	}
 
-	/* Check that the given IPv4 address is valid */
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_flags = AI_NUMERICHOST;
-	hints.ai_family = AF_INET;
-	if (getaddrinfo(addrstr, NULL, &hints, &res)) {
+	hdrlen = TAPCFG_VNET_HDRLEN(tapcfg);
+	if (hdrlen) {
+		iov[0].iov_base = (void *) (hdr ? hdr : &tapcfg_vnet_hdr_none);
+		iov[0].iov_len = hdrlen;
+		iov[1].iov_base = buf;
+		iov[1].iov_len = count;
+		ret = writev(tapcfg->tap_fd, iov, 2);
+	} else {
+		ret = write(tapcfg->tap_fd, buf, count);
+	}
+	if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		return TAPCFG_EAGAIN;
+	} else if (ret != count + hdrlen) {
 		taplog_log(&tapcfg->taplog, TAPLOG_ERR,
-		           "Error converting string '%s' to "
-		           "address, check the format", addrstr);
+		           "Error trying to write data to TAP device");
 		return -1;
 	}
-	saddr = (struct sockaddr_in *) res->ai_addr;
-	addr = saddr->sin_addr.s_addr;
-	freeaddrinfo(res);
-
-	/* Calculate the netmask from the network bit length */
-	for (i=netbits,mask=0; i; i--)
-		mask = (mask >> 1)|(1 << 31);
+	ret = count;
 
-	tapcfg_ifaddr_ioctl(tapcfg,
-	                    addr,
-	                    ntohl(mask));
+	taplog_log(&tapcfg->taplog, TAPLOG_DEBUG, "Wrote ethernet frame:");
+	taplog_log_ethernet_info(&tapcfg->taplog, TAPLOG_DEBUG, buf, ret);
 
-	return 0;
+	return ret;
 }
 
 int
-tapcfg_iface_set_ipv6(tapcfg_t *tapcfg, const char *addrstr, unsigned char netbits)
+tapcfg_write_vnet(tapcfg_t *tapcfg, const tapcfg_vnet_hdr_t *hdr, void *buf, int count)
 {
-	return -1;
+	struct timespec start;
+	int ret;
+
+	assert(tapcfg);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ret = tapcfg_write_dev(tapcfg, hdr, buf, count);
+	if (ret > 0) {
+		tapcfg->tx_counters.frames++;
+		tapcfg->tx_counters.bytes += ret;
+		tapcfg_capture_frame(tapcfg, TAPCAPTURE_INBOUND, buf, ret);
+	}
+	tapcfg_count_call(&tapcfg->tx_counters, ret, tapcfg_elapsed_usec(&start));
+
+	return ret;
 }
 
 int
-tapcfg_iface_set_dhcp_options(tapcfg_t *tapcfg, unsigned char *buffer, int buflen)
+tapcfg_write(tapcfg_t *tapcfg, void *buf, int count)
 {
-	return -1;
+	return tapcfg_write_vnet(tapcfg, NULL, buf, count);
 }
 
-int
-tapcfg_iface_set_dhcpv6_options(tapcfg_t *tapcfg, unsigned char *buffer, int buflen)
+char *
+tapcfg_get_ifname(tapcfg_t *tapcfg)
 {
-	return -1;
+	assert(tapcfg);
+
+	if (!tapcfg->started) {
+		return NULL;
+	}
+
+	return tapcfg->ifname;
+}
+
+const char *
+tapcfg_iface_get_hwaddr(tapcfg_t *tapcfg, int *length)
+{
+	assert(tapcfg);
+
+	if (!tapcfg->started) {
+		return NULL;
+	}
+
+	if (length)
+		*length = sizeof(tapcfg->hwaddr);
+	return (const char *) tapcfg->hwaddr;
+}
+
+static int
+tapcfg_prepare_mtu(tapcfg_t *tapcfg, int mtu)
+{
+	tapcfg_t *device = tapcfg->parent ? tapcfg->parent : tapcfg;
+
+	/* 84 is minimum MTU from RFC 791, we limit the upper
+	 * MTU by our largest buffer size minus max header */
+	if (mtu < 68 || mtu > (TAPCFG_MAX_BUFSIZE - 22)) {
+		return -1;
+	}
+
+#ifdef HAVE_LINUX_IO_URING_H
+	if (tapcfg->uring_engine && mtu + 22 > tapcfg->uring_engine->slotsize) {
+		taplog_log(&tapcfg->taplog, TAPLOG_ERR,
+		           "MTU can't be raised above %d while the io_uring "
+		           "engine is running", tapcfg->uring_engine->slotsize - 22);
+		return -1;
+	}
+#endif
+
+	/* The buffers may be in use by the reading threads, they are
+	 * grown by those threads before their next read starts */
+	if (mtu + 22 > device->bufwant) {
+		device->bufwant = mtu + 22;
+	}
+
+	return 0;
+}
+
+static int
+tapcfg_parse_ipv4(tapcfg_t *tapcfg, const char *addrstr, unsigned char netbits,
+                  unsigned int *addr, unsigned int *mask)
+{
+	struct addrinfo hints, *res;
+	struct sockaddr_in *saddr;
+	int i;
+
+	if (!addrstr || netbits == 0 || netbits > 32) {
+		return -1;
+	}
+
+	/* Check that the given IPv4 address is valid */
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_flags = AI_NUMERICHOST;
+	hints.ai_family = AF_INET;
+	if (getaddrinfo(addrstr, NULL, &hints, &res)) {
+		taplog_log(&tapcfg->taplog, TAPLOG_ERR,
+		           "Error converting string '%s' to "
+		           "address, check the format", addrstr);
+		return -1;
+	}
+	saddr = (struct sockaddr_in *) res->ai_addr;
+	*addr = saddr->sin_addr.s_addr;
+	freeaddrinfo(res);
+
+	/* Calculate the netmask from the network bit length */
+	for (i=netbits,*mask=0; i; i--)
+		*mask = (*mask >> 1)|(1 << 31);
+	*mask = htonl(*mask);
+
+	return 0;
+}
+
+static int
+tapcfg_parse_ipv6(tapcfg_t *tapcfg, const char *addrstr, unsigned char netbits,
+                  struct in6_addr *addr)
+{
+	struct addrinfo hints, *res;
+	struct sockaddr_in6 *saddr;
+
+	if (!addrstr || netbits == 0 || netbits > 128) {
+		return -1;
+	}
+
+	/* Check that the given IPv6 address is valid */
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_flags = AI_NUMERICHOST;
+	hints.ai_family = AF_INET6;
+	if (getaddrinfo(addrstr, NULL, &hints, &res)) {
+		taplog_log(&tapcfg->taplog, TAPLOG_ERR,
+		           "Error converting string '%s' to "
+		           "address, check the format", addrstr);
+		return -1;
+	}
+	saddr = (struct sockaddr_in6 *) res->ai_addr;
+	memcpy(addr, &saddr->sin6_addr, sizeof(struct in6_addr));
+	freeaddrinfo(res);
+
+	return 0;
+}
+
+#if !defined(__linux__)
+static int
+tapcfg_configure_dev(tapcfg_t *tapcfg, const tapcfg_config_t *parsed)
+{
+	const tapcfg_iface_config_t *config = &parsed->iface;
+	struct ifreq ifr;
+
+	/* Without a batching interface each setting is a separate call */
+	if ((config->fields & TAPCFG_CONFIG_HWADDR) &&
+	    tapcfg_hwaddr_ioctl(tapcfg, config->hwaddr) == -1) {
+		return -1;
+	}
+
+	if (config->fields & TAPCFG_CONFIG_MTU) {
+		memset(&ifr, 0, sizeof(ifr));
+		strcpy(ifr.ifr_name, tapcfg->ifname);
+#ifdef __sun__
+		ifr.ifr_metric = config->mtu;
+#else
+		ifr.ifr_mtu = config->mtu;
+#endif
+		if (ioctl(tapcfg->ctrl_fd, SIOCSIFMTU, &ifr) == -1) {
+			taplog_log(&tapcfg->taplog, TAPLOG_ERR,
+			           "Error setting the MTU of device: %s",
+			           strerror(errno));
+			return -1;
+		}
+	}
+
+	if ((config->fields & TAPCFG_CONFIG_IPV4) &&
+	    tapcfg_ifaddr_ioctl(tapcfg, parsed->addr, parsed->mask) == -1) {
+		return -1;
+	}
+
+	if ((config->fields & TAPCFG_CONFIG_IPV6) &&
+	    tapcfg_ifaddr6_ioctl(tapcfg, &parsed->addr6, config->ipv6_netbits) == -1) {
+		return -1;
+	}
+
+	if (config->fields & TAPCFG_CONFIG_STATUS) {
+		memset(&ifr, 0, sizeof(ifr));
+		strcpy(ifr.ifr_name, tapcfg->ifname);
+		if (ioctl(tapcfg->ctrl_fd, SIOCGIFFLAGS, &ifr) == -1) {
+			taplog_log(&tapcfg->taplog, TAPLOG_ERR,
+			           "Error calling SIOCGIFFLAGS for interface %s: %s",
+			           tapcfg->ifname,
+			           strerror(errno));
+			return -1;
+		}
+
+#ifdef __sun__
+		/* On Solaris enabling IPv6 doesn't require enabling IPv4,
+		 * also the IFF_RUNNING flag doesn't need to be set */
+		if (config->status & TAPCFG_STATUS_IPV4_UP) {
+			ifr.ifr_flags |= IFF_UP;
+		} else {
+			ifr.ifr_flags &= ~IFF_UP;
+		}
+#else
+		if (config->status) {
+			ifr.ifr_flags |= (IFF_UP | IFF_RUNNING);
+		} else {
+			ifr.ifr_flags &= ~(IFF_UP | IFF_RUNNING);
+		}
+#endif
+
+		if (ioctl(tapcfg->ctrl_fd, SIOCSIFFLAGS, &ifr) == -1) {
+			taplog_log(&tapcfg->taplog, TAPLOG_ERR,
+			           "Error calling SIOCSIFFLAGS for interface %s: %s",
+			           tapcfg->ifname,
+			           strerror(errno));
+			return -1;
+		}
+	}
+
+	return 0;
+}
+#endif
+
+static int
+tapcfg_configure_prepare(tapcfg_t *tapcfg, const tapcfg_iface_config_t *config,
+                         tapcfg_config_t *parsed)
+{
+	int fields = config->fields;
+
+	memset(parsed, 0, sizeof(tapcfg_config_t));
+	memcpy(&parsed->iface, config, sizeof(tapcfg_iface_config_t));
+
+	/* Validate everything before any of the changes is applied */
+	if ((fields & TAPCFG_CONFIG_HWADDR) && tapcfg->status) {
+		return -1;
+	}
+	if ((fields & TAPCFG_CONFIG_MTU) &&
+	    tapcfg_prepare_mtu(tapcfg, config->mtu) == -1) {
+		return -1;
+	}
+	if ((fields & TAPCFG_CONFIG_IPV4) &&
+	    tapcfg_parse_ipv4(tapcfg, config->ipv4, config->ipv4_netbits,
+	                      &parsed->addr, &parsed->mask) == -1) {
+		return -1;
+	}
+	if ((fields & TAPCFG_CONFIG_IPV6) &&
+	    tapcfg_parse_ipv6(tapcfg, config->ipv6, config->ipv6_netbits,
+	                      &parsed->addr6) == -1) {
+		return -1;
+	}
+
+	/* The strings belong to the caller */
+	parsed->iface.ipv4 = NULL;
+	parsed->iface.ipv6 = NULL;
+
+	if ((fields & TAPCFG_CONFIG_STATUS) &&
+	    ((config->status ^ tapcfg->status) & TAPCFG_STATUS_IPV6_ALL)) {
+		tapcfg_iface_prepare_ipv6(tapcfg, config->status);
+	}
+
+	return 0;
+}
+
+static void
+tapcfg_configure_finish(tapcfg_t *tapcfg, const tapcfg_config_t *parsed)
+{
+	const tapcfg_iface_config_t *config = &parsed->iface;
+	int fields = config->fields;
+
+	if (fields & TAPCFG_CONFIG_HWADDR) {
+		memcpy(tapcfg->hwaddr, config->hwaddr, HWADDRLEN);
+	}
+	if (fields & TAPCFG_CONFIG_STATUS) {
+		tapcfg->status = config->status;
+	}
+
+	/* Don't wait for the monitor to see our own changes */
+	if (tapcfg->monitored) {
+		if (fields & TAPCFG_CONFIG_MTU)
+			tapcfg->link_mtu = config->mtu;
+		if (fields & TAPCFG_CONFIG_IPV4) {
+			tapcfg->link_ipv4 = parsed->addr;
+			tapcfg->link_ipv4_netbits = config->ipv4_netbits;
+		}
+		if (fields & TAPCFG_CONFIG_STATUS) {
+			if (config->status)
+				tapcfg->link_flags |= IFF_UP;
+			else
+				tapcfg->link_flags &= ~IFF_UP;
+		}
+	}
+}
+
+int
+tapcfg_iface_configure(tapcfg_t *tapcfg, const tapcfg_iface_config_t *config)
+{
+	tapcfg_config_t parsed;
+
+	assert(tapcfg);
+	assert(config);
+
+	if (!tapcfg->started) {
+		return -1;
+	}
+
+	if (tapcfg_configure_prepare(tapcfg, config, &parsed) == -1 ||
+	    tapcfg_configure_dev(tapcfg, &parsed) == -1) {
+		return -1;
+	}
+	tapcfg_configure_finish(tapcfg, &parsed);
+
+	return 0;
+}
+
+int
+tapcfg_set_link_monitor(tapcfg_t *tapcfg, int enabled,
+                        tapcfg_link_callback_t callback, void *data)
+{
+	assert(tapcfg);
+
+	if (!tapcfg->started || tapcfg->parent) {
+		return -1;
+	}
+
+	/* Set before enabling so that no change is missed */
+	if (enabled) {
+		tapcfg->link_callback = callback;
+		tapcfg->link_data = data;
+	}
+	if (tapcfg_monitor_dev(tapcfg, enabled) == -1) {
+		return -1;
+	}
+	if (!enabled) {
+		tapcfg->link_callback = NULL;
+		tapcfg->link_data = NULL;
+	}
+
+	return 0;
+}
+
+int
+tapcfg_iface_set_hwaddr(tapcfg_t *tapcfg, const char *hwaddr, int length)
+{
+	tapcfg_iface_config_t config;
+
+	assert(tapcfg);
+
+	if (!tapcfg->started || tapcfg->status) {
+		return -1;
+	}
+
+	if (length != sizeof(tapcfg->hwaddr)) {
+		return -1;
+	}
+
+	memset(&config, 0, sizeof(config));
+	config.fields = TAPCFG_CONFIG_HWADDR;
+	memcpy(config.hwaddr, hwaddr, HWADDRLEN);
+
+	return tapcfg_iface_configure(tapcfg, &config);
+}
+
+int
+tapcfg_iface_get_status(tapcfg_t *tapcfg)
+{
+	assert(tapcfg);
+
+	/* Notice if the link was changed behind our back */
+	if (tapcfg->monitored) {
+		if (!(tapcfg->link_flags & IFF_UP))
+			return TAPCFG_STATUS_ALL_DOWN;
+		return tapcfg->status ? tapcfg->status : TAPCFG_STATUS_ALL_UP;
+	}
+
+	return tapcfg->status;
+}
+
+int
+tapcfg_iface_set_status(tapcfg_t *tapcfg, int flags)
+{
+	tapcfg_iface_config_t config;
+
+	assert(tapcfg);
+
+	if (!tapcfg->started ||
+	    flags == tapcfg_iface_get_status(tapcfg)) {
+		/* No need for change, this is ok */
+		return 0;
+	}
+
+	memset(&config, 0, sizeof(config));
+	config.fields = TAPCFG_CONFIG_STATUS;
+	config.status = flags;
+
+	return tapcfg_iface_configure(tapcfg, &config);
+}
+
+int
+tapcfg_iface_get_mtu(tapcfg_t *tapcfg)
+{
+	assert(tapcfg);
+
+	if (!tapcfg->started) {
+		return 0;
+	}
+
+	if (tapcfg->monitored) {
+		return tapcfg->link_mtu;
+	}
+
+	return tapcfg_mtu_ioctl(tapcfg);
+}
+
+int
+tapcfg_iface_set_mtu(tapcfg_t *tapcfg, int mtu)
+{
+	tapcfg_iface_config_t config;
+
+	assert(tapcfg);
+
+	if (!tapcfg->started) {
+		return 0;
+	}
+
+	memset(&config, 0, sizeof(config));
+	config.fields = TAPCFG_CONFIG_MTU;
+	config.mtu = mtu;
+
+	if (tapcfg_iface_configure(tapcfg, &config) == -1) {
+		return -1;
+	}
+
+	return mtu;
+}
+
+int
+tapcfg_iface_get_ipv4(tapcfg_t *tapcfg, char *addrstr, int addrlen, unsigned char *netbits)
+{
+	struct ifreq ifr;
+	struct sockaddr_in *saddr;
+	unsigned int mask;
+	int bits;
+
+	assert(tapcfg);
+	assert(addrstr);
+
+	if (!tapcfg->started) {
+		return -1;
+	}
+
+	if (tapcfg->monitored) {
+		unsigned int addr = tapcfg->link_ipv4;
+
+		bits = tapcfg->link_ipv4_netbits;
+		if (!bits || !inet_ntop(AF_INET, &addr, addrstr, addrlen)) {
+			return -1;
+		}
+		if (netbits)
+			*netbits = bits;
+		return 0;
+	}
+
+	memset(&ifr, 0, sizeof(ifr));
+	strcpy(ifr.ifr_name, tapcfg->ifname);
+	if (ioctl(tapcfg->ctrl_fd, SIOCGIFADDR, &ifr) == -1) {
+		/* Most likely there is no address configured */
+		taplog_log(&tapcfg->taplog, TAPLOG_DEBUG,
+		           "Error getting the IPv4 address of device: %s",
+		           strerror(errno));
+		return -1;
+	}
+	saddr = (struct sockaddr_in *) &ifr.ifr_addr;
+	if (!inet_ntop(AF_INET, &saddr->sin_addr, addrstr, addrlen)) {
+		return -1;
+	}
+
+	if (netbits) {
+		if (ioctl(tapcfg->ctrl_fd, SIOCGIFNETMASK, &ifr) == -1) {
+			taplog_log(&tapcfg->taplog, TAPLOG_ERR,
+			           "Error getting the netmask of device: %s",
+			           strerror(errno));
+			return -1;
+		}
+		saddr = (struct sockaddr_in *) &ifr.ifr_addr;
+
+		/* Calculate the network bit length from the netmask */
+		mask = ntohl(saddr->sin_addr.s_addr);
+		for (bits=0; mask & 0x80000000; mask <<= 1)
+			bits++;
+		*netbits = bits;
+	}
+
+	return 0;
+}
+
+int
+tapcfg_iface_set_ipv4(tapcfg_t *tapcfg, const char *addrstr, unsigned char netbits)
+{
+	tapcfg_iface_config_t config;
+
+	assert(tapcfg);
+
+	if (!tapcfg->started) {
+		return 0;
+	}
+
+	memset(&config, 0, sizeof(config));
+	config.fields = TAPCFG_CONFIG_IPV4;
+	config.ipv4 = addrstr;
+	config.ipv4_netbits = netbits;
+
+	return tapcfg_iface_configure(tapcfg, &config);
+}
+
+int
+tapcfg_iface_set_ipv6(tapcfg_t *tapcfg, const char *addrstr, unsigned char netbits)
+{
+	tapcfg_iface_config_t config;
+
+	assert(tapcfg);
+
+	if (!tapcfg->started) {
+		return 0;
+	}
+
+	memset(&config, 0, sizeof(config));
+	config.fields = TAPCFG_CONFIG_IPV6;
+	config.ipv6 = addrstr;
+	config.ipv6_netbits = netbits;
+
+	return tapcfg_iface_configure(tapcfg, &config);
+}
+
+int
+tapcfg_iface_set_dhcp_options(tapcfg_t *tapcfg, unsigned char *buffer, int buflen)
+{
+	return -1;
+}
+
+int
+tapcfg_iface_set_dhcpv6_options(tapcfg_t *tapcfg, unsigned char *buffer, int buflen)
+{
+	return -1;
+}
+
+static void
+tapcfg_capture_frame(tapcfg_t *tapcfg, int direction, const void *buf, int len)
+{
+	tapcapture_t *capture;
+
+	/* Queues are captured into the file of their device */
+	capture = tapcfg->capture;
+	if (!capture && tapcfg->parent) {
+		capture = tapcfg->parent->capture;
+	}
+	if (capture) {
+		tapcapture_frame(capture, direction, buf, len);
+	}
+}
+
+static void
+tapcfg_complete_read(tapcfg_t *tapcfg, tapcfg_frame_t *frame, int ret)
+{
+	if (!tapcfg->offload) {
+		memset(&frame->hdr, 0, sizeof(tapcfg_vnet_hdr_t));
+	}
+
+	frame->len = ret;
+	if (ret > frame->size) {
+		taplog_log(&tapcfg->taplog, TAPLOG_ERR,
+		           "Buffer not big enough for reading, "
+		           "dropping frame of %d bytes", ret);
+		frame->status = -1;
+		tapcfg->rx_counters.truncated++;
+		tapcfg->rx_counters.errors++;
+		return;
+	}
+	frame->status = 0;
+	tapcfg->rx_counters.frames++;
+	tapcfg->rx_counters.bytes += ret;
+	tapcfg_capture_frame(tapcfg, TAPCAPTURE_OUTBOUND, frame->buf, ret);
+
+	taplog_log(&tapcfg->taplog, TAPLOG_DEBUG, "Read ethernet frame:");
+	taplog_log_ethernet_info(&tapcfg->taplog, TAPLOG_DEBUG, frame->buf, ret);
+}
+
+static void
+tapcfg_complete_write(tapcfg_t *tapcfg, tapcfg_frame_t *frame, int ret)
+{
+	if (ret == -EAGAIN) {
+		frame->status = TAPCFG_EAGAIN;
+		return;
+	} else if (ret != frame->len + TAPCFG_VNET_HDRLEN(tapcfg)) {
+		taplog_log(&tapcfg->taplog, TAPLOG_ERR,
+		           "Error trying to write data to TAP device");
+		frame->status = -1;
+		tapcfg->tx_counters.errors++;
+		return;
+	}
+	frame->status = 0;
+	tapcfg->tx_counters.frames++;
+	tapcfg->tx_counters.bytes += frame->len;
+	tapcfg_capture_frame(tapcfg, TAPCAPTURE_INBOUND, frame->buf, frame->len);
+
+	taplog_log(&tapcfg->taplog, TAPLOG_DEBUG, "Wrote ethernet frame:");
+	taplog_log_ethernet_info(&tapcfg->taplog, TAPLOG_DEBUG, frame->buf, frame->len);
+}
+
+/* Fill the iovecs for reading a frame, returns the iovec count */
+static int
+tapcfg_frame_read_iov(tapcfg_t *tapcfg, tapcfg_frame_t *frame, struct iovec *iov)
+{
+	int iovcnt = 0;
+
+	if (tapcfg->offload) {
+		iov[iovcnt].iov_base = &frame->hdr;
+		iov[iovcnt].iov_len = sizeof(tapcfg_vnet_hdr_t);
+		iovcnt++;
+	}
+
+	/* Anything not fitting the caller buffer ends up in our own
+	 * buffer, that way we can detect frames that are too big */
+	iov[iovcnt].iov_base = frame->buf;
+	iov[iovcnt].iov_len = frame->size;
+	iovcnt++;
+	iov[iovcnt].iov_base = tapcfg->buffer;
+	iov[iovcnt].iov_len = tapcfg->bufsize;
+	iovcnt++;
+
+	return iovcnt;
+}
+
+/* Fill the iovecs for writing a frame, returns the iovec count */
+static int
+tapcfg_frame_write_iov(tapcfg_t *tapcfg, tapcfg_frame_t *frame, struct iovec *iov)
+{
+	int iovcnt = 0;
+
+	if (tapcfg->offload) {
+		iov[iovcnt].iov_base = &frame->hdr;
+		iov[iovcnt].iov_len = sizeof(tapcfg_vnet_hdr_t);
+		iovcnt++;
+	}
+	iov[iovcnt].iov_base = frame->buf;
+	iov[iovcnt].iov_len = frame->len;
+	iovcnt++;
+
+	return iovcnt;
+}
+
+static int
+tapcfg_read_frames(tapcfg_t *tapcfg, tapcfg_frame_t *frames, int nframes, int block)
+{
+	struct iovec iov[3];
+	int hdrlen = TAPCFG_VNET_HDRLEN(tapcfg);
+	int i, iovcnt, ret;
+
+	for (i=0; i<nframes; i++) {
+		/* In non-blocking mode the read itself tells when to stop */
+		if (!tapcfg->nonblocking && (i > 0 || !block) &&
+		    !tapcfg_wait_readable(tapcfg, 0)) {
+			break;
+		}
+
+		iovcnt = tapcfg_frame_read_iov(tapcfg, &frames[i], iov);
+		ret = readv(tapcfg->tap_fd, iov, iovcnt);
+		if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return i ? i : TAPCFG_EAGAIN;
+		} else if (ret < hdrlen || ret <= 0) {
+			return i ? i : -1;
+		}
+		tapcfg_complete_read(tapcfg, &frames[i], ret - hdrlen);
+	}
+
+	return i;
+}
+
+static int
+tapcfg_write_frames(tapcfg_t *tapcfg, tapcfg_frame_t *frames, int nframes)
+{
+	struct iovec iov[2];
+	int i, iovcnt, ret, count = 0;
+
+	for (i=0; i<nframes; i++) {
+		iovcnt = tapcfg_frame_write_iov(tapcfg, &frames[i], iov);
+		ret = writev(tapcfg->tap_fd, iov, iovcnt);
+		if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			ret = -EAGAIN;
+		}
+		tapcfg_complete_write(tapcfg, &frames[i], ret);
+		if (!frames[i].status)
+			count++;
+	}
+
+	return count;
+}
+
+#ifdef HAVE_LINUX_IO_URING_H
+#ifndef RWF_NOWAIT
+#  define RWF_NOWAIT 0x00000008
+#endif
+
+/* Move a frame read by a later read into an earlier frame that got
+ * nothing, the frame arrived while the batch was being read */
+static void
+tapcfg_move_frame(tapcfg_t *tapcfg, tapcfg_frame_t *to, tapcfg_frame_t *from, int len)
+{
+	memcpy(&to->hdr, &from->hdr, sizeof(tapcfg_vnet_hdr_t));
+	if (len > from->size) {
+		/* Rest of it is gone already, count it as truncated */
+		tapcfg_complete_read(tapcfg, from, len);
+		to->len = len;
+		to->status = from->status;
+		return;
+	}
+	if (len <= to->size) {
+		memcpy(to->buf, from->buf, len);
+	}
+	tapcfg_complete_read(tapcfg, to, len);
+}
+
+/* Give up on the ring after an error, the reads are all non-blocking
+ * so nothing is left running that could still touch the frames */
+static void
+tapcfg_batch_ring_fail(tapcfg_t *tapcfg, tapcfg_uring_t **ringp, int *failed)
+{
+	taplog_log(&tapcfg->taplog, TAPLOG_ERR,
+	           "Error submitting to io_uring, falling back to "
+	           "single frame system calls: %s", strerror(errno));
+	tapcfg_batch_ring_free(ringp);
+	*failed = 1;
+}
+
+static int
+tapcfg_read_frames_uring(tapcfg_t *tapcfg, tapcfg_uring_t *ring,
+                         tapcfg_frame_t *frames, int nframes, int block)
+{
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	int results[TAPCFG_BATCH_MAX];
+	int hdrlen = TAPCFG_VNET_HDRLEN(tapcfg);
+	int i, done, count, submitted = 0, unsupported = 0;
+
+	/* Only waiting for the first frame may block, the reads themselves
+	 * never do. Linked reads would stop at the first one returning less
+	 * than its buffers, which a TAP read always does, so the reads are
+	 * independent and executed in order when they are submitted. */
+	if (block && !tapcfg_wait_readable(tapcfg, -1)) {
+		return -1;
+	}
+
+	for (i=0; i<nframes; i++) {
+		struct iovec *iov = &tapcfg->rx_iov[3*i];
+
+		sqe = tapcfg_uring_get_sqe(ring);
+		if (!sqe) {
+			break;
+		}
+		sqe->opcode = IORING_OP_READV;
+		sqe->fd = tapcfg->tap_fd;
+		sqe->addr = (unsigned long) iov;
+		sqe->len = tapcfg_frame_read_iov(tapcfg, &frames[i], iov);
+		sqe->user_data = i;
+		sqe->rw_flags = RWF_NOWAIT;
+		results[i] = -ECANCELED;
+	}
+	if (!i) {
+		return tapcfg_read_frames(tapcfg, frames, 1, 0);
+	}
+	nframes = i;
+
+	for (done=0; done<nframes; ) {
+		cqe = tapcfg_uring_peek_cqe(ring);
+		if (!cqe) {
+			if (tapcfg_uring_submit(ring, nframes-done) == -1) {
+				tapcfg_batch_ring_fail(tapcfg, &tapcfg->rx_ring,
+				                       &tapcfg->rx_ring_failed);
+				if (!submitted) {
+					return tapcfg_read_frames(tapcfg, frames, nframes, 0);
+				}
+				break;
+			}
+			submitted = 1;
+			continue;
+		}
+		results[cqe->user_data] = cqe->res;
+		tapcfg_uring_cqe_seen(ring);
+		done++;
+	}
+
+	/* Frames are returned in order, a read after one that found
+	 * nothing may still have got a frame that arrived meanwhile */
+	for (i=0, count=0; i<nframes; i++) {
+		if (results[i] == -EOPNOTSUPP) {
+			unsupported = 1;
+		}
+		if (results[i] <= 0 || results[i] < hdrlen) {
+			continue;
+		}
+		if (i == count) {
+			tapcfg_complete_read(tapcfg, &frames[i], results[i] - hdrlen);
+		} else {
+			tapcfg_move_frame(tapcfg, &frames[count], &frames[i],
+			                  results[i] - hdrlen);
+		}
+		count++;
+	}
+	if (unsupported) {
+		/* Kernel doesn't support non-blocking reads, stop using it */
+		taplog_log(&tapcfg->taplog, TAPLOG_INFO,
+		           "Non-blocking reads not supported by io_uring");
+		tapcfg_batch_ring_free(&tapcfg->rx_ring);
+		tapcfg->rx_ring_failed = 1;
+		if (!count) {
+			return tapcfg_read_frames(tapcfg, frames, nframes, block);
+		}
+	}
+	if (!count && nframes && results[0] == -EAGAIN) {
+		if (block) {
+			/* Someone else got the frame first, wait again */
+			return tapcfg_read_frames_uring(tapcfg, ring, frames,
+			                                nframes, block);
+		}
+		return tapcfg->nonblocking ? TAPCFG_EAGAIN : 0;
+	} else if (!count && block) {
+		return -1;
+	}
+
+	return count;
+}
+
+static int
+tapcfg_write_frames_uring(tapcfg_t *tapcfg, tapcfg_uring_t *ring,
+                          tapcfg_frame_t *frames, int nframes)
+{
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	int i, queued, done, submitted = 0, count = 0;
+
+	/* Writes to the TAP device never block, so the kernel completes
+	 * them inline in the order they were queued without linking */
+	for (i=0; i<nframes; i++) {
+		struct iovec *iov = &tapcfg->tx_iov[2*i];
+
+		sqe = tapcfg_uring_get_sqe(ring);
+		if (!sqe) {
+			break;
+		}
+		sqe->opcode = IORING_OP_WRITEV;
+		sqe->fd = tapcfg->tap_fd;
+		sqe->addr = (unsigned long) iov;
+		sqe->len = tapcfg_frame_write_iov(tapcfg, &frames[i], iov);
+		sqe->user_data = i;
+		frames[i].status = TAPCFG_EAGAIN;
+	}
+	queued = i;
+
+	for (done=0; done<queued; ) {
+		cqe = tapcfg_uring_peek_cqe(ring);
+		if (!cqe) {
+			if (tapcfg_uring_submit(ring, queued-done) == -1) {
+				tapcfg_batch_ring_fail(tapcfg, &tapcfg->tx_ring,
+				                       &tapcfg->tx_ring_failed);
+				if (!submitted) {
+					return tapcfg_write_frames(tapcfg, frames, nframes);
+				}
+
+				/* Frames without a completion are reported as
+				 * not written, the caller may try them again */
+				break;
+			}
+			submitted = 1;
+			continue;
+		}
+		i = cqe->user_data;
+		tapcfg_complete_write(tapcfg, &frames[i], cqe->res);
+		tapcfg_uring_cqe_seen(ring);
+		done++;
+
+		if (!frames[i].status)
+			count++;
+	}
+	if (done == queued && queued < nframes) {
+		/* Ring was full, the rest are written one by one */
+		count += tapcfg_write_frames(tapcfg, frames+queued, nframes-queued);
+	}
+
+	return count;
+}
+#endif
+
+static int
+tapcfg_read_batch_dev(tapcfg_t *tapcfg, tapcfg_frame_t *frames, int nframes)
+{
+	int count = 0;
+	int n, ret;
+
+	assert(tapcfg);
+	assert(frames || !nframes);
+
+	if (!tapcfg->started) {
+		return -1;
+	}
+
+#ifdef HAVE_LINUX_IO_URING_H
+	if (tapcfg->uring_engine) {
+		return tapcfg_uring_engine_read_batch(tapcfg, frames, nframes);
+	}
+#endif
+#if defined(__linux__)
+	if (tapcfg->packet_engine) {
+		return tapcfg_packet_engine_read_batch(tapcfg, frames, nframes);
+	}
+#endif
+
+	tapcfg_update_buffer(tapcfg);
+
+	/* Return the frame left over from tapcfg_read first */
+	if (tapcfg->buflen && nframes > 0) {
+		if (frames[0].size >= tapcfg->buflen) {
+			memcpy(frames[0].buf, tapcfg->buffer, tapcfg->buflen);
+		}
+		memcpy(&frames[0].hdr, &tapcfg->vnet_hdr, sizeof(tapcfg_vnet_hdr_t));
+		tapcfg_complete_read(tapcfg, &frames[0], tapcfg->buflen);
+		tapcfg->buflen = 0;
+		count++;
+	} else if (tapcfg->busy_poll && !tapcfg->nonblocking) {
+		/* Spin before blocking for the first frame */
+		tapcfg_wait_readable(tapcfg, -1);
+	}
+
+	/* Only block for the first frame and never in non-blocking mode */
+	while (count < nframes) {
+		n = nframes - count;
+		if (n > TAPCFG_BATCH_MAX)
+			n = TAPCFG_BATCH_MAX;
+
+#ifdef HAVE_LINUX_IO_URING_H
+		if (tapcfg_batch_ring(tapcfg, &tapcfg->rx_ring,
+		                      &tapcfg->rx_ring_failed)) {
+			ret = tapcfg_read_frames_uring(tapcfg, tapcfg->rx_ring,
+			                               frames+count, n,
+			                               !count && !tapcfg->nonblocking);
+		} else
+#endif
+		ret = tapcfg_read_frames(tapcfg, frames+count, n,
+		                         !count && !tapcfg->nonblocking);
+		if (ret < 0) {
+			return count ? count : ret;
+		}
+
+		count += ret;
+		if (ret < n) {
+			/* No more frames available right now */
+			break;
+		}
+	}
+
+	return count;
+}
+
+int
+tapcfg_read_batch(tapcfg_t *tapcfg, tapcfg_frame_t *frames, int nframes)
+{
+	struct timespec start;
+	int ret;
+
+	assert(tapcfg);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ret = tapcfg_read_batch_dev(tapcfg, frames, nframes);
+	tapcfg_count_call(&tapcfg->rx_counters, ret, tapcfg_elapsed_usec(&start));
+
+	return ret;
+}
+
+static int
+tapcfg_write_batch_dev(tapcfg_t *tapcfg, tapcfg_frame_t *frames, int nframes)
+{
+	int count = 0;
+	int i, n, ret;
+
+	assert(tapcfg);
+	assert(frames || !nframes);
+
+	if (!tapcfg->started) {
+		return -1;
+	}
+
+	for (i=0; i<nframes; i+=n) {
+		n = nframes - i;
+		if (n > TAPCFG_BATCH_MAX)
+			n = TAPCFG_BATCH_MAX;
+
+#ifdef HAVE_LINUX_IO_URING_H
+		if (tapcfg_batch_ring(tapcfg, &tapcfg->tx_ring,
+		                      &tapcfg->tx_ring_failed)) {
+			ret = tapcfg_write_frames_uring(tapcfg, tapcfg->tx_ring,
+			                                frames+i, n);
+		} else
+#endif
+		ret = tapcfg_write_frames(tapcfg, frames+i, n);
+		if (ret < 0) {
+			return count ? count : -1;
+		}
+		count += ret;
+	}
+
+	return count;
+}
+
+int
+tapcfg_write_batch(tapcfg_t *tapcfg, tapcfg_frame_t *frames, int nframes)
+{
+	struct timespec start;
+	int ret;
+
+	assert(tapcfg);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ret = tapcfg_write_batch_dev(tapcfg, frames, nframes);
+	tapcfg_count_call(&tapcfg->tx_counters, ret, tapcfg_elapsed_usec(&start));
+
+	return ret;
+}
+
+int
+tapcfg_get_stats(tapcfg_t *tapcfg, tapcfg_stats_t *stats)
+{
+	int i;
+
+	assert(tapcfg);
+	assert(stats);
+
+	memset(stats, 0, sizeof(tapcfg_stats_t));
+	tapcfg_add_counters(stats, &tapcfg->rx_counters, &tapcfg->tx_counters);
+	for (i=1; i<tapcfg->nqueues; i++) {
+		tapcfg_add_counters(stats, &tapcfg->queues[i]->rx_counters,
+		                    &tapcfg->queues[i]->tx_counters);
+	}
+
+	if (!tapcfg->started) {
+		return 0;
+	}
+
+	return tapcfg_stats_dev(tapcfg, stats);
+}
+
+/* Registration of a single device in a poller, allocated separately
+ * so that epoll can keep pointing to it when the table grows */
+struct tapcfg_poller_entry_s {
+	tapcfg_t *tapcfg;
+	int fd;
+	int events;
+	void *data;
+
+	/* Position in the entry table and the next entry in the bucket */
+	int idx;
+	struct tapcfg_poller_entry_s *hnext;
+};
+typedef struct tapcfg_poller_entry_s tapcfg_poller_entry_t;
+
+struct tapcfg_poller_s {
+	/* The epoll instance, -1 on systems using poll */
+	int epoll_fd;
+
+	tapcfg_poller_entry_t **entries;
+	int nentries;
+	int maxentries;
+
+	/* Entries hashed by the device, as many buckets as there is room
+	 * for entries so that finding a device takes constant time */
+	tapcfg_poller_entry_t **buckets;
+
+	/* Buffers for the events returned by the system */
+	void *sysevents;
+	int maxsysevents;
+};
+
+tapcfg_poller_t *
+tapcfg_poller_init()
+{
+	tapcfg_poller_t *poller;
+
+	poller = calloc(1, sizeof(tapcfg_poller_t));
+	if (!poller) {
+		return NULL;
+	}
+
+#if defined(__linux__)
+	poller->epoll_fd = epoll_create(64);
+	if (poller->epoll_fd == -1) {
+		free(poller);
+		return NULL;
+	}
+	fcntl(poller->epoll_fd, F_SETFD, FD_CLOEXEC);
+#else
+	poller->epoll_fd = -1;
+#endif
+
+	return poller;
+}
+
+void
+tapcfg_poller_destroy(tapcfg_poller_t *poller)
+{
+	int i;
+
+	if (poller) {
+		if (poller->epoll_fd != -1) {
+			close(poller->epoll_fd);
+		}
+		for (i=0; i<poller->nentries; i++) {
+			free(poller->entries[i]);
+		}
+		free(poller->entries);
+		free(poller->buckets);
+		free(poller->sysevents);
+	}
+	free(poller);
+}
+
+/* The table size is always a power of two */
+static unsigned int
+tapcfg_poller_hash(tapcfg_t *tapcfg, int size)
+{
+	unsigned long value = (unsigned long) tapcfg;
+	int bits = 0;
+
+	/* Size is a power of two, take the bucket from the well mixed
+	 * high bits of the 32-bit product instead of the low ones */
+	while ((1 << bits) < size) {
+		bits++;
+	}
+	value = ((value >> 4) * 2654435761UL) & 0xffffffffUL;
+
+	return bits ? (int) (value >> (32 - bits)) : 0;
+}
+
+static tapcfg_poller_entry_t *
+tapcfg_poller_find(tapcfg_poller_t *poller, tapcfg_t *tapcfg)
+{
+	tapcfg_poller_entry_t *entry;
+
+	if (!poller->maxentries) {
+		return NULL;
+	}
+
+	entry = poller->buckets[tapcfg_poller_hash(tapcfg, poller->maxentries)];
+	while (entry && entry->tapcfg != tapcfg) {
+		entry = entry->hnext;
+	}
+
+	return entry;
+}
+
+static int
+tapcfg_poller_grow(tapcfg_poller_t *poller)
+{
+	tapcfg_poller_entry_t **entries, **buckets;
+	unsigned int hash;
+	int i, maxentries;
+
+	maxentries = poller->maxentries ? poller->maxentries * 2 : 16;
+	buckets = calloc(maxentries, sizeof(tapcfg_poller_entry_t *));
+	if (!buckets) {
+		return -1;
+	}
+	entries = realloc(poller->entries,
+	                  maxentries * sizeof(tapcfg_poller_entry_t *));
+	if (!entries) {
+		free(buckets);
+		return -1;
+	}
+
+	for (i=0; i<poller->nentries; i++) {
+		hash = tapcfg_poller_hash(entries[i]->tapcfg, maxentries);
+		entries[i]->hnext = buckets[hash];
+		buckets[hash] = entries[i];
+	}
+	free(poller->buckets);
+
+	poller->entries = entries;
+	poller->buckets = buckets;
+	poller->maxentries = maxentries;
+
+	return 0;
+}
+
+#if defined(__linux__)
+static int
+tapcfg_poller_ctl(tapcfg_poller_t *poller, int op, tapcfg_poller_entry_t *entry)
+{
+	struct epoll_event event;
+
+	memset(&event, 0, sizeof(event));
+	if (entry->events & TAPCFG_POLL_READABLE)
+		event.events |= EPOLLIN;
+	if (entry->events & TAPCFG_POLL_WRITABLE)
+		event.events |= EPOLLOUT;
+	if (entry->events & TAPCFG_POLL_EDGE)
+		event.events |= EPOLLET;
+	event.data.ptr = entry;
+
+	return epoll_ctl(poller->epoll_fd, op, entry->fd, &event);
+}
+#endif
+
+int
+tapcfg_poller_add(tapcfg_poller_t *poller, tapcfg_t *tapcfg, int events, void *data)
+{
+	tapcfg_poller_entry_t *entry;
+	unsigned int hash;
+
+	assert(poller);
+	assert(tapcfg);
+
+	if (!tapcfg->started || tapcfg_poller_find(poller, tapcfg)) {
+		return -1;
+	}
+
+	if (poller->nentries == poller->maxentries &&
+	    tapcfg_poller_grow(poller) == -1) {
+		return -1;
+	}
+
+	entry = malloc(sizeof(tapcfg_poller_entry_t));
+	if (!entry) {
+		return -1;
+	}
+	entry->tapcfg = tapcfg;
+	entry->fd = tapcfg->tap_fd;
+#ifdef HAVE_LINUX_IO_URING_H
+	if (tapcfg->uring_engine) {
+		/* Completed reads show up on the ring instead */
+		entry->fd = tapcfg->uring_engine->ring.fd;
+	}
+#endif
+#if defined(__linux__)
+	if (tapcfg->packet_engine) {
+		entry->fd = tapcfg->packet_engine->fd;
+	}
+#endif
+	entry->events = events;
+	entry->data = data;
+
+#if defined(__linux__)
+	if (tapcfg_poller_ctl(poller, EPOLL_CTL_ADD, entry) == -1) {
+		taplog_log(&tapcfg->taplog, TAPLOG_ERR,
+		           "Error adding device to poller: %s",
+		           strerror(errno));
+		free(entry);
+		return -1;
+	}
+#endif
+	hash = tapcfg_poller_hash(tapcfg, poller->maxentries);
+	entry->hnext = poller->buckets[hash];
+	poller->buckets[hash] = entry;
+	entry->idx = poller->nentries;
+	poller->entries[poller->nentries++] = entry;
+
+	return 0;
+}
+
+int
+tapcfg_poller_modify(tapcfg_poller_t *poller, tapcfg_t *tapcfg, int events, void *data)
+{
+	tapcfg_poller_entry_t *entry;
+
+	assert(poller);
+	assert(tapcfg);
+
+	entry = tapcfg_poller_find(poller, tapcfg);
+	if (!entry) {
+		return -1;
+	}
+
+	entry->events = events;
+	entry->data = data;
+
+#if defined(__linux__)
+	if (tapcfg_poller_ctl(poller, EPOLL_CTL_MOD, entry) == -1) {
+		taplog_log(&tapcfg->taplog, TAPLOG_ERR,
+		           "Error modifying device in poller: %s",
+		           strerror(errno));
+		return -1;
+	}
+#endif
+
+	return 0;
+}
+
+int
+tapcfg_poller_remove(tapcfg_poller_t *poller, tapcfg_t *tapcfg)
+{
+	tapcfg_poller_entry_t *entry, **prev;
+
+	assert(poller);
+	assert(tapcfg);
+
+	entry = tapcfg_poller_find(poller, tapcfg);
+	if (!entry) {
+		return -1;
+	}
+
+#if defined(__linux__)
+	/* Fails harmlessly if the fd has already been closed */
+	tapcfg_poller_ctl(poller, EPOLL_CTL_DEL, entry);
+#endif
+
+	prev = &poller->buckets[tapcfg_poller_hash(tapcfg, poller->maxentries)];
+	while (*prev != entry) {
+		prev = &(*prev)->hnext;
+	}
+	*prev = entry->hnext;
+
+	/* The order of the entries doesn't matter */
+	poller->entries[entry->idx] = poller->entries[--poller->nentries];
+	poller->entries[entry->idx]->idx = entry->idx;
+	free(entry);
+
+	return 0;
+}
+
+static int
+tapcfg_poller_reserve(tapcfg_poller_t *poller, int count, int size)
+{
+	void *sysevents;
+
+	if (count <= poller->maxsysevents) {
+		return 0;
+	}
+
+	sysevents = realloc(poller->sysevents, count * size);
+	if (!sysevents) {
+		return -1;
+	}
+	poller->sysevents = sysevents;
+	poller->maxsysevents = count;
+
+	return 0;
+}
+
+int
+tapcfg_poller_wait(tapcfg_poller_t *poller, tapcfg_poll_event_t *events, int maxevents, int msec)
+{
+	tapcfg_poller_entry_t *entry;
+	int i, ret;
+
+	assert(poller);
+	assert(events || maxevents <= 0);
+
+	if (maxevents <= 0) {
+		return -1;
+	}
+
+#if defined(__linux__)
+	{
+		struct epoll_event *sysevents;
+
+		if (tapcfg_poller_reserve(poller, maxevents,
+		                          sizeof(struct epoll_event)) == -1) {
+			return -1;
+		}
+		sysevents = poller->sysevents;
+
+		ret = epoll_wait(poller->epoll_fd, sysevents, maxevents, msec);
+		if (ret == -1) {
+			return (errno == EINTR) ? 0 : -1;
+		}
+
+		for (i=0; i<ret; i++) {
+			entry = sysevents[i].data.ptr;
+			events[i].tapcfg = entry->tapcfg;
+			events[i].data = entry->data;
+			events[i].events = 0;
+			if (sysevents[i].events & EPOLLIN)
+				events[i].events |= TAPCFG_POLL_READABLE;
+			if (sysevents[i].events & EPOLLOUT)
+				events[i].events |= TAPCFG_POLL_WRITABLE;
+			if (sysevents[i].events & (EPOLLERR | EPOLLHUP))
+				events[i].events |= TAPCFG_POLL_ERROR;
+		}
+
+		return ret;
+	}
+#else
+	{
+		struct pollfd *pfds;
+		int count;
+
+		if (tapcfg_poller_reserve(poller, poller->nentries,
+		                          sizeof(struct pollfd)) == -1) {
+			return -1;
+		}
+		pfds = poller->sysevents;
+
+		for (i=0; i<poller->nentries; i++) {
+			entry = poller->entries[i];
+			pfds[i].fd = entry->fd;
+			pfds[i].events = 0;
+			pfds[i].revents = 0;
+			if (entry->events & TAPCFG_POLL_READABLE)
+				pfds[i].events |= POLLIN;
+			if (entry->events & TAPCFG_POLL_WRITABLE)
+				pfds[i].events |= POLLOUT;
+		}
+
+		ret = poll(pfds, poller->nentries, msec);
+		if (ret == -1) {
+			return (errno == EINTR) ? 0 : -1;
+		}
+
+		count = 0;
+		for (i=0; i<poller->nentries && count<maxevents; i++) {
+			if (!pfds[i].revents)
+				continue;
+
+			entry = poller->entries[i];
+			events[count].tapcfg = entry->tapcfg;
+			events[count].data = entry->data;
+			events[count].events = 0;
+			if (pfds[i].revents & POLLIN)
+				events[count].events |= TAPCFG_POLL_READABLE;
+			if (pfds[i].revents & POLLOUT)
+				events[count].events |= TAPCFG_POLL_WRITABLE;
+			if (pfds[i].revents & (POLLERR | POLLHUP | POLLNVAL))
+				events[count].events |= TAPCFG_POLL_ERROR;
+			count++;
+		}
+
+		return count;
+	}
+#endif
+}
+
+#if defined(__linux__)
+/* Requests in flight are limited so that the acknowledgements
+ * always fit into the receive buffer of the netlink socket */
+#define TAPCFG_ASYNC_INFLIGHT 128
+#define TAPCFG_ASYNC_SENDSIZE 32768
+
+typedef struct tapcfg_async_op_s tapcfg_async_op_t;
+struct tapcfg_async_op_s {
+	tapcfg_t *tapcfg;
+	tapcfg_config_t config;
+	tapcfg_async_callback_t callback;
+	void *data;
+
+	/* Phase 2 brings the link up after phase 1 succeeded */
+	int phase;
+	int result;
+	unsigned int seq;
+	int count;
+	int acked;
+	const char *desc[TAPCFG_NETLINK_MAXMSG];
+
+	tapcfg_async_t *async;
+	tapcfg_async_op_t *next;
+
+	/* Next configuration of the same device */
+	tapcfg_async_op_t *dnext;
+};
+
+/* Simple singly linked FIFO of operations */
+typedef struct tapcfg_async_list_s {
+	tapcfg_async_op_t *head;
+	tapcfg_async_op_t *tail;
+} tapcfg_async_list_t;
+#endif
+
+struct tapcfg_async_s {
+#if defined(__linux__)
+	int nl_fd;
+	unsigned int seq;
+	int inflight;
+
+	tapcfg_async_list_t queued;
+	tapcfg_async_list_t sent;
+	tapcfg_async_list_t done;
+
+	unsigned int sendbuf[TAPCFG_ASYNC_SENDSIZE/sizeof(unsigned int)];
+#endif
+	int pending;
+};
+
+#if defined(__linux__)
+static void
+tapcfg_async_push(tapcfg_async_list_t *list, tapcfg_async_op_t *op)
+{
+	op->next = NULL;
+	if (list->tail) {
+		list->tail->next = op;
+	} else {
+		list->head = op;
+	}
+	list->tail = op;
+}
+
+static tapcfg_async_op_t *
+tapcfg_async_pop(tapcfg_async_list_t *list)
+{
+	tapcfg_async_op_t *op = list->head;
+
+	if (op) {
+		list->head = op->next;
+		if (!list->head)
+			list->tail = NULL;
+	}
+
+	return op;
+}
+
+/* Returns 0 if the operation was not in the list */
+static int
+tapcfg_async_remove(tapcfg_async_list_t *list, tapcfg_async_op_t *op)
+{
+	tapcfg_async_op_t *cur, *prev = NULL;
+
+	for (cur = list->head; cur && cur != op; cur = cur->next) {
+		prev = cur;
+	}
+	if (!cur) {
+		return 0;
+	}
+
+	if (prev) {
+		prev->next = op->next;
+	} else {
+		list->head = op->next;
+	}
+	if (list->tail == op) {
+		list->tail = prev;
+	}
+
+	return 1;
+}
+
+/* The queued and sent operations are the first ones of their devices,
+ * the later operations of those devices are freed with them */
+static void
+tapcfg_async_free_list(tapcfg_async_list_t *list, int devices)
+{
+	tapcfg_async_op_t *op, *dnext;
+
+	while ((op = tapcfg_async_pop(list)) != NULL) {
+		if (devices) {
+			op->tapcfg->async_head = NULL;
+			op->tapcfg->async_tail = NULL;
+		}
+		do {
+			dnext = devices ? op->dnext : NULL;
+			free(op);
+			op = dnext;
+		} while (op);
+	}
+}
+
+/* The operation is the first one of its device and done, the next one
+ * can be built now that the addresses it replaces are up to date */
+static void
+tapcfg_async_finish(tapcfg_async_t *async, tapcfg_async_op_t *op)
+{
+	tapcfg_t *tapcfg = op->tapcfg;
+
+	if (!op->result) {
+		tapcfg_configure_finish(tapcfg, &op->config);
+	}
+
+	tapcfg->async_head = op->dnext;
+	if (tapcfg->async_head) {
+		tapcfg_async_push(&async->queued, tapcfg->async_head);
+	} else {
+		tapcfg->async_tail = NULL;
+	}
+
+	/* Devices complete in order, so callbacks do as well */
+	tapcfg_async_push(&async->done, op);
+}
+
+static void
+tapcfg_async_advance(tapcfg_async_t *async, tapcfg_async_op_t *op)
+{
+	if (!op->result && op->phase == 1) {
+		tapcfg_netlink_configured(op->tapcfg, &op->config);
+		op->phase = 2;
+
+		/* Still the first operation of the device, so nothing else of
+		 * the device can overtake the second phase */
+		tapcfg_async_push(&async->queued, op);
+		return;
+	}
+
+	tapcfg_async_finish(async, op);
+}
+
+/* Acknowledgements of the sent requests can't be received anymore */
+static void
+tapcfg_async_fail_sent(tapcfg_async_t *async, int err)
+{
+	tapcfg_async_op_t *op;
+
+	while ((op = tapcfg_async_pop(&async->sent)) != NULL) {
+		taplog_log(&op->tapcfg->taplog, TAPLOG_ERR,
+		           "Error receiving netlink acknowledgement: %s",
+		           strerror(err));
+		async->inflight -= op->count - op->acked;
+		op->result = -1;
+		tapcfg_async_finish(async, op);
+	}
+}
+
+static void
+tapcfg_async_flush(tapcfg_async_t *async)
+{
+	tapcfg_netlink_batch_t batch;
+	tapcfg_async_list_t round;
+	tapcfg_async_op_t *op;
+	int len = 0;
+
+	round.head = round.tail = NULL;
+	while ((op = async->queued.head) != NULL) {
+		tapcfg_netlink_begin(&batch, async->seq);
+		tapcfg_netlink_build(op->tapcfg, &batch, &op->config, op->phase);
+		if (!batch.count) {
+			/* Nothing to send in this phase */
+			tapcfg_async_pop(&async->queued);
+			tapcfg_async_advance(async, op);
+			continue;
+		}
+		if (async->inflight + batch.count > TAPCFG_ASYNC_INFLIGHT ||
+		    len + batch.len > sizeof(async->sendbuf)) {
+			break;
+		}
+
+		memcpy((char *) async->sendbuf + len, batch.buf, batch.len);
+		len += batch.len;
+
+		op->seq = batch.seq;
+		op->count = batch.count;
+		op->acked = 0;
+		memcpy(op->desc, batch.desc, sizeof(op->desc));
+		async->seq += batch.count;
+		async->inflight += batch.count;
+
+		tapcfg_async_pop(&async->queued);
+		tapcfg_async_push(&round, op);
+	}
+	if (!len) {
+		return;
+	}
+
+	/* All the collected requests go to the kernel at once */
+	if (send(async->nl_fd, async->sendbuf, len, 0) == -1) {
+		while ((op = tapcfg_async_pop(&round)) != NULL) {
+			taplog_log(&op->tapcfg->taplog, TAPLOG_ERR,
+			           "Error sending netlink request: %s",
+			           strerror(errno));
+			async->inflight -= op->count;
+			op->result = -1;
+			tapcfg_async_finish(async, op);
+		}
+		return;
+	}
+	while ((op = tapcfg_async_pop(&round)) != NULL) {
+		tapcfg_async_push(&async->sent, op);
+	}
+}
+
+static void
+tapcfg_async_ack(tapcfg_async_t *async, struct nlmsghdr *nlh)
+{
+	tapcfg_async_op_t *op, *prev = NULL;
+	struct nlmsgerr *nlerr;
+	unsigned int idx = 0;
+
+	/* Acknowledgements arrive in order, usually for the first one */
+	for (op = async->sent.head; op; prev = op, op = op->next) {
+		idx = nlh->nlmsg_seq - op->seq;
+		if (idx < op->count)
+			break;
+	}
+	if (!op) {
+		return;
+	}
+
+	nlerr = NLMSG_DATA(nlh);
+	if (nlerr->error && op->desc[idx] && !op->result) {
+		taplog_log(&op->tapcfg->taplog, TAPLOG_ERR,
+		           "Error %s of interface %s: %s",
+		           op->desc[idx], op->tapcfg->ifname,
+		           strerror(-nlerr->error));
+		op->result = -1;
+	}
+	async->inflight--;
+	if (++op->acked < op->count) {
+		return;
+	}
+
+	if (prev) {
+		prev->next = op->next;
+	} else {
+		async->sent.head = op->next;
+	}
+	if (async->sent.tail == op) {
+		async->sent.tail = prev;
+	}
+	tapcfg_async_advance(async, op);
+}
+
+/* The device is stopped, its operations are completed as failed
+ * without touching the device anymore */
+static void
+tapcfg_async_cancel(tapcfg_t *tapcfg)
+{
+	tapcfg_async_op_t *op = tapcfg->async_head;
+	tapcfg_async_t *async;
+
+	if (!op) {
+		return;
+	}
+	async = op->async;
+
+	if (!tapcfg_async_remove(&async->queued, op) &&
+	    tapcfg_async_remove(&async->sent, op)) {
+		/* Late acknowledgements don't match any operation */
+		async->inflight -= op->count - op->acked;
+	}
+	for (; op; op = op->dnext) {
+		op->result = -1;
+		tapcfg_async_push(&async->done, op);
+	}
+	tapcfg->async_head = NULL;
+	tapcfg->async_tail = NULL;
+}
+
+static int
+tapcfg_async_complete(tapcfg_async_t *async)
+{
+	tapcfg_async_op_t *op;
+	int count = 0;
+
+	while ((op = tapcfg_async_pop(&async->done)) != NULL) {
+		async->pending--;
+		count++;
+		if (op->callback) {
+			op->callback(op->tapcfg, op->result, op->data);
+		}
+		free(op);
+	}
+
+	return count;
+}
+
+/* Call the callback of an operation that completed right away, along
+ * with the earlier ones of the same device to keep them in order, the
+ * rest are left for tapcfg_async_process */
+static void
+tapcfg_async_complete_device(tapcfg_async_t *async, tapcfg_t *tapcfg,
+                             tapcfg_async_op_t *last)
+{
+	tapcfg_async_list_t list;
+	tapcfg_async_op_t *op, *next;
+
+	for (op = async->done.head; op && op != last; op = op->next);
+	if (!op) {
+		return;
+	}
+
+	list.head = list.tail = NULL;
+	for (op = async->done.head; op; op = next) {
+		next = op->next;
+		if (op->tapcfg == tapcfg) {
+			tapcfg_async_remove(&async->done, op);
+			tapcfg_async_push(&list, op);
+		}
+		if (op == last) {
+			break;
+		}
+	}
+
+	while ((op = tapcfg_async_pop(&list)) != NULL) {
+		async->pending--;
+		if (op->callback) {
+			op->callback(op->tapcfg, op->result, op->data);
+		}
+		free(op);
+	}
+}
+#endif
+
+tapcfg_async_t *
+tapcfg_async_init()
+{
+	tapcfg_async_t *async;
+
+	async = calloc(1, sizeof(tapcfg_async_t));
+	if (!async) {
+		return NULL;
+	}
+
+#if defined(__linux__)
+	async->nl_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK, NETLINK_ROUTE);
+	if (async->nl_fd == -1) {
+		free(async);
+		return NULL;
+	}
+	{
+		int size = 1024 * 1024;
+
+		/* More room for acknowledgements, fine if it fails */
+		setsockopt(async->nl_fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	}
+#endif
+
+	return async;
+}
+
+void
+tapcfg_async_destroy(tapcfg_async_t *async)
+{
+	if (!async) {
+		return;
+	}
+
+#if defined(__linux__)
+	/* Callbacks of the unfinished operations are never called */
+	tapcfg_async_free_list(&async->queued, 1);
+	tapcfg_async_free_list(&async->sent, 1);
+	tapcfg_async_free_list(&async->done, 0);
+	close(async->nl_fd);
+#endif
+	free(async);
+}
+
+int
+tapcfg_async_get_fd(tapcfg_async_t *async)
+{
+	assert(async);
+
+#if defined(__linux__)
+	return async->nl_fd;
+#else
+	return -1;
+#endif
+}
+
+int
+tapcfg_async_pending(tapcfg_async_t *async)
+{
+	assert(async);
+
+	return async->pending;
+}
+
+int
+tapcfg_async_process(tapcfg_async_t *async)
+{
+#if defined(__linux__)
+	unsigned int buf[TAPCFG_NETLINK_RECVSIZE/sizeof(unsigned int)];
+	struct nlmsghdr *nlh;
+	int len;
+
+	assert(async);
+
+	while (async->sent.head) {
+		len = recv(async->nl_fd, buf, sizeof(buf), 0);
+		if (len == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+
+			/* On ENOBUFS acknowledgements were lost and the
+			 * operations waiting for them would never finish */
+			tapcfg_async_fail_sent(async, errno);
+			break;
+		}
+
+		nlh = (struct nlmsghdr *) buf;
+		for (; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+			if (nlh->nlmsg_type == NLMSG_ERROR) {
+				tapcfg_async_ack(async, nlh);
+			}
+		}
+	}
+
+	/* Acknowledged requests made room for the queued ones */
+	tapcfg_async_flush(async);
+
+	return tapcfg_async_complete(async);
+#else
+	assert(async);
+
+	return 0;
+#endif
+}
+
+int
+tapcfg_iface_configure_async(tapcfg_async_t *async, tapcfg_t *tapcfg,
+                             const tapcfg_iface_config_t *config,
+                             tapcfg_async_callback_t callback, void *data)
+{
+#if defined(__linux__)
+	tapcfg_async_op_t *op;
+
+	assert(async);
+	assert(tapcfg);
+	assert(config);
+
+	if (!tapcfg->started) {
+		return -1;
+	}
+
+	/* Ordering is kept within a single context */
+	if (tapcfg->async_head && tapcfg->async_head->async != async) {
+		taplog_log(&tapcfg->taplog, TAPLOG_ERR,
+		           "Device has configurations pending in another context");
+		return -1;
+	}
+
+	op = calloc(1, sizeof(tapcfg_async_op_t));
+	if (!op) {
+		return -1;
+	}
+	if (tapcfg_configure_prepare(tapcfg, config, &op->config) == -1) {
+		free(op);
+		return -1;
+	}
+	op->tapcfg = tapcfg;
+	op->callback = callback;
+	op->data = data;
+	op->phase = 1;
+	op->async = async;
+
+	/* Built only after the earlier ones of the device are finished */
+	if (tapcfg->async_tail) {
+		tapcfg->async_tail->dnext = op;
+	} else {
+		tapcfg->async_head = op;
+		tapcfg_async_push(&async->queued, op);
+	}
+	tapcfg->async_tail = op;
+	async->pending++;
+
+	tapcfg_async_flush(async);
+	tapcfg_async_complete_device(async, tapcfg, op);
+
+	return 0;
+#else
+	int ret;
+
+	assert(async);
+	assert(tapcfg);
+	assert(config);
+
+	/* Nothing to pipeline, the configuration is applied right away */
+	ret = tapcfg_iface_configure(tapcfg, config);
+	if (callback) {
+		callback(tapcfg, ret, data);
+	}
+
+	return 0;
+#endif
 }
@@ -110,6 +110,59 @@ tapcfg_start_dev(tapcfg_t *tapcfg, const char *ifname, int fallback)
 	return tap_fd;
 }
 
+static int
+tapcfg_start_queue_dev(tapcfg_t *tapcfg, const char *ifname)
+{
+	taplog_log(&tapcfg->taplog, TAPLOG_ERR,
+	           "Multiple queues are not supported on this system");
+	return -1;
+}
+
+static int
+tapcfg_enable_queue_dev(tapcfg_t *tapcfg, int enabled)
+{
+	return -1;
+}
+
+static int
+tapcfg_attach_dev(tapcfg_t *tapcfg, const char *ifname)
+{
+	/* Opening the device node attaches to the existing interface */
+	return tapcfg_start_dev(tapcfg, ifname, 0);
+}
+
+static int
+tapcfg_persist_dev(tapcfg_t *tapcfg, int persistent)
+{
+	/* Interfaces stay until destroyed with ifconfig */
+	if (!persistent) {
+		taplog_log(&tapcfg->taplog, TAPLOG_ERR,
+		           "Devices are always persistent on this system");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+tapcfg_monitor_dev(tapcfg_t *tapcfg, int enabled)
+{
+	if (enabled) {
+		taplog_log(&tapcfg->taplog, TAPLOG_ERR,
+		           "Link monitoring is not supported on this platform");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+tapcfg_stats_dev(tapcfg_t *tapcfg, tapcfg_stats_t *stats)
+{
+	/* Kernel drop counters are not available on this platform */
+	return 0;
+}
+
 static void
 tapcfg_stop_dev(tapcfg_t *tapcfg)
 {
@@ -305,3 +358,13 @@ tapcfg_ifaddr_ioctl(tapcfg_t *tapcfg,
 
 	return 0;
 }
+
+static int
+tapcfg_ifaddr6_ioctl(tapcfg_t *tapcfg,
+                     const struct in6_addr *addr,
+                     unsigned char netbits)
+{
+	taplog_log(&tapcfg->taplog, TAPLOG_ERR,
+	           "Setting the IPv6 address is not supported on this platform");
+	return -1;
+}
@@ -16,12 +16,43 @@
 #include <linux/if_tun.h>
 #include <net/if_arp.h>
 
+#include "tapcfg_unix_netlink.h"
+#include "tapcfg_unix_monitor.h"
+
+static int
+tapcfg_offload_dev(tapcfg_t *tapcfg, int tap_fd)
+{
+	unsigned int offload = 0;
+
+	if (tapcfg->offload & TAPCFG_OFFLOAD_CSUM)
+		offload |= TUN_F_CSUM;
+	if (tapcfg->offload & TAPCFG_OFFLOAD_TSO4)
+		offload |= TUN_F_TSO4;
+	if (tapcfg->offload & TAPCFG_OFFLOAD_TSO6)
+		offload |= TUN_F_TSO6;
+	if (tapcfg->offload & TAPCFG_OFFLOAD_TSO_ECN)
+		offload |= TUN_F_TSO_ECN;
+
+	/* Segmentation offloads are not possible without checksums */
+	if (offload)
+		offload |= TUN_F_CSUM;
+
+	if (ioctl(tap_fd, TUNSETOFFLOAD, offload) == -1) {
+		taplog_log(&tapcfg->taplog, TAPLOG_ERR,
+		           "Error setting the offload flags: %s",
+		           strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
 static int
 tapcfg_start_dev(tapcfg_t *tapcfg, const char *ifname, int fallback)
 {
 	int tap_fd = -1;
 	struct ifreq ifr;
-	int s, ret;
+	int flags, ret;
 
 	/* Create a new tap device */
 	tap_fd = open("/dev/net/tun", O_RDWR);
@@ -35,8 +66,14 @@ tapcfg_start_dev(tapcfg_t *tapcfg, const char *ifname, int fallback)
 		return -1;
 	}
 
+	flags = IFF_TAP | IFF_NO_PI;
+	if (tapcfg->offload)
+		flags |= IFF_VNET_HDR;
+	if (tapcfg->multiqueue)
+		flags |= IFF_MULTI_QUEUE;
+
 	memset(&ifr, 0, sizeof(ifr));
-	ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+	ifr.ifr_flags = flags;
 	if (ifname && strlen(ifname) < IFNAMSIZ) {
 		strncpy(ifr.ifr_name, ifname, IFNAMSIZ-1);
 	}
@@ -48,7 +85,7 @@ tapcfg_start_dev(tapcfg_t *tapcfg, const char *ifname, int fallback)
 		           ifname);
 		/* Try again without device name */
 		memset(&ifr, 0, sizeof(ifr));
-		ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+		ifr.ifr_flags = flags;
 		ret = ioctl(tap_fd, TUNSETIFF, &ifr);
 	}
 	if (ret == -1) {
@@ -59,39 +96,147 @@ tapcfg_start_dev(tapcfg_t *tapcfg, const char *ifname, int fallback)
 		return -1;
 	}
 
+	if (tapcfg->offload && tapcfg_offload_dev(tapcfg, tap_fd) == -1) {
+		close(tap_fd);
+		return -1;
+	}
+
 	/* Set the device name to be the one we got from OS */
 	taplog_log(&tapcfg->taplog, TAPLOG_DEBUG, "Device name %s", ifr.ifr_name);
 	strncpy(tapcfg->ifname, ifr.ifr_name, sizeof(tapcfg->ifname));
 
-	/* Create a temporary socket for SIOCGIFHWADDR */
-	s = socket(AF_INET, SOCK_DGRAM, 0);
-	if (!s) {
+	/* Interface index and hardware address come in the same reply */
+	if (tapcfg_netlink_open(tapcfg) == -1) {
+		close(tap_fd);
+		return -1;
+	}
+	if (tapcfg_netlink_get_link(tapcfg) == -1) {
+		tapcfg_netlink_close(tapcfg);
 		close(tap_fd);
 		return -1;
 	}
 
-	/* Get the hardware address of the TAP interface */
-	memset(&ifr, 0, sizeof(ifr));
-	strcpy(ifr.ifr_name, tapcfg->ifname);
-	ret = ioctl(s, SIOCGIFHWADDR, &ifr);
-	if (ret == -1) {
+	return tap_fd;
+}
+
+static int
+tapcfg_start_queue_dev(tapcfg_t *tapcfg, const char *ifname)
+{
+	int tap_fd = -1;
+	struct ifreq ifr;
+
+	tap_fd = open("/dev/net/tun", O_RDWR);
+	if (tap_fd == -1) {
 		taplog_log(&tapcfg->taplog, TAPLOG_ERR,
-		           "Error getting the hardware address: %s",
+		           "Error opening device /dev/net/tun: %s",
 		           strerror(errno));
+		return -1;
+	}
+
+	/* Attach a new queue to the existing device */
+	memset(&ifr, 0, sizeof(ifr));
+	ifr.ifr_flags = IFF_TAP | IFF_NO_PI | IFF_MULTI_QUEUE;
+	if (tapcfg->offload)
+		ifr.ifr_flags |= IFF_VNET_HDR;
+	strcpy(ifr.ifr_name, ifname);
+	if (ioctl(tap_fd, TUNSETIFF, &ifr) == -1) {
+		taplog_log(&tapcfg->taplog, TAPLOG_ERR,
+		           "Error attaching a queue to interface \"%s\": %s",
+		           ifname, strerror(errno));
+		close(tap_fd);
+		return -1;
+	}
+
+	if (tapcfg->offload && tapcfg_offload_dev(tapcfg, tap_fd) == -1) {
 		close(tap_fd);
-		close(s);
 		return -1;
 	}
-	memcpy(tapcfg->hwaddr, ifr.ifr_hwaddr.sa_data, HWADDRLEN);
-	close(s);
 
 	return tap_fd;
 }
 
+static int
+tapcfg_enable_queue_dev(tapcfg_t *tapcfg, int enabled)
+{
+	struct ifreq ifr;
+
+	memset(&ifr, 0, sizeof(ifr));
+	ifr.ifr_flags = enabled ? IFF_ATTACH_QUEUE : IFF_DETACH_QUEUE;
+	if (ioctl(tapcfg->tap_fd, TUNSETQUEUE, &ifr) == -1) {
+		taplog_log(&tapcfg->taplog, TAPLOG_ERR,
+		           "Error %s queue of interface %s: %s",
+		           enabled ? "enabling" : "disabling",
+		           tapcfg->ifname, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+tapcfg_attach_dev(tapcfg_t *tapcfg, const char *ifname)
+{
+	/* Setting the interface of an existing device attaches to it */
+	return tapcfg_start_dev(tapcfg, ifname, 0);
+}
+
+static int
+tapcfg_persist_dev(tapcfg_t *tapcfg, int persistent)
+{
+	if (ioctl(tapcfg->tap_fd, TUNSETPERSIST, persistent) == -1) {
+		taplog_log(&tapcfg->taplog, TAPLOG_ERR,
+		           "Error setting interface %s persistent: %s",
+		           tapcfg->ifname, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+tapcfg_read_counter(tapcfg_t *tapcfg, const char *name, unsigned long long *value)
+{
+	char path[IFNAMSIZ + 64];
+	char buf[32];
+	int fd, len;
+
+	snprintf(path, sizeof(path), "/sys/class/net/%s/statistics/%s",
+	         tapcfg->ifname, name);
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		taplog_log(&tapcfg->taplog, TAPLOG_ERR,
+		           "Error opening %s: %s", path, strerror(errno));
+		return -1;
+	}
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0) {
+		taplog_log(&tapcfg->taplog, TAPLOG_ERR,
+		           "Error reading %s", path);
+		return -1;
+	}
+	buf[len] = '\0';
+	*value = strtoull(buf, NULL, 10);
+
+	return 0;
+}
+
+static int
+tapcfg_stats_dev(tapcfg_t *tapcfg, tapcfg_stats_t *stats)
+{
+	if (tapcfg_read_counter(tapcfg, "rx_dropped", &stats->kernel_rx_dropped) == -1 ||
+	    tapcfg_read_counter(tapcfg, "tx_dropped", &stats->kernel_tx_dropped) == -1) {
+		return -1;
+	}
+
+	return 0;
+}
+
 static void
 tapcfg_stop_dev(tapcfg_t *tapcfg)
 {
-	/* Nothing needed to cleanup here */
+	tapcfg_monitor_dev(tapcfg, 0);
+	tapcfg_netlink_close(tapcfg);
 }
 
 static void
@@ -101,63 +246,91 @@ tapcfg_iface_prepare_ipv6(tapcfg_t *tapcfg, int flags)
 }
 
 static int
-tapcfg_hwaddr_ioctl(tapcfg_t *tapcfg,
-                    const char *hwaddr)
+tapcfg_netlink_build(tapcfg_t *tapcfg, tapcfg_netlink_batch_t *batch,
+                     const tapcfg_config_t *config, int phase)
 {
-	struct ifreq ifr;
-	int ret;
+	const tapcfg_iface_config_t *iface = &config->iface;
+	int fields = iface->fields;
+	int down;
 
-	memset(&ifr, 0, sizeof(struct ifreq));
-	strcpy(ifr.ifr_name, tapcfg->ifname);
-	ifr.ifr_hwaddr.sa_family = ARPHRD_ETHER;
-	memcpy(ifr.ifr_hwaddr.sa_data, hwaddr, HWADDRLEN);
+	/* The link is brought up in a separate second phase, only after
+	 * everything else succeeded, so it never comes up half configured */
+	if (phase == 2) {
+		if ((fields & TAPCFG_CONFIG_STATUS) && iface->status) {
+			tapcfg_netlink_link(tapcfg, batch, NULL, 0, IFF_UP, IFF_UP,
+			                    "bringing up the link");
+		}
+		return batch->count;
+	}
 
-	ret = ioctl(tapcfg->ctrl_fd, SIOCSIFHWADDR, &ifr);
-	if (ret == -1) {
-		taplog_log(&tapcfg->taplog, TAPLOG_ERR,
-			   "Error trying to set new hardware address: %s",
-			   strerror(errno));
+	down = (fields & TAPCFG_CONFIG_STATUS) && !iface->status;
+	if (fields & (TAPCFG_CONFIG_HWADDR | TAPCFG_CONFIG_MTU) || down) {
+		tapcfg_netlink_link(tapcfg, batch,
+		                    (fields & TAPCFG_CONFIG_HWADDR) ?
+		                    (const unsigned char *) iface->hwaddr : NULL,
+		                    (fields & TAPCFG_CONFIG_MTU) ? iface->mtu : 0,
+		                    down ? IFF_UP : 0, 0,
+		                    "setting the link parameters");
 	}
 
-	return ret;
+	/* Setting an address replaces the one set earlier like the
+	 * ioctl interface does, the old one might be removed already */
+	if (fields & TAPCFG_CONFIG_IPV4) {
+		if (tapcfg->ipv4_netbits &&
+		    (tapcfg->ipv4_addr != config->addr ||
+		     tapcfg->ipv4_netbits != iface->ipv4_netbits)) {
+			tapcfg_netlink_addr(tapcfg, batch, RTM_DELADDR, AF_INET,
+			                    &tapcfg->ipv4_addr, tapcfg->ipv4_netbits,
+			                    NULL);
+		}
+		tapcfg_netlink_addr(tapcfg, batch, RTM_NEWADDR, AF_INET,
+		                    &config->addr, iface->ipv4_netbits,
+		                    "setting the IPv4 address");
+	}
+	if (fields & TAPCFG_CONFIG_IPV6) {
+		if (tapcfg->ipv6_netbits &&
+		    (memcmp(&tapcfg->ipv6_addr, &config->addr6, sizeof(config->addr6)) ||
+		     tapcfg->ipv6_netbits != iface->ipv6_netbits)) {
+			tapcfg_netlink_addr(tapcfg, batch, RTM_DELADDR, AF_INET6,
+			                    &tapcfg->ipv6_addr, tapcfg->ipv6_netbits,
+			                    NULL);
+		}
+		tapcfg_netlink_addr(tapcfg, batch, RTM_NEWADDR, AF_INET6,
+		                    &config->addr6, iface->ipv6_netbits,
+		                    "setting the IPv6 address");
+	}
+
+	return batch->count;
 }
 
-static int
-tapcfg_ifaddr_ioctl(tapcfg_t *tapcfg,
-                    unsigned int addr,
-                    unsigned int mask)
+static void
+tapcfg_netlink_configured(tapcfg_t *tapcfg, const tapcfg_config_t *config)
 {
-	struct ifreq ifr;
-	struct sockaddr_in *sin;
-	struct in_addr *in_addr;
-
-	memset(&ifr,  0, sizeof(struct ifreq));
-	strcpy(ifr.ifr_name, tapcfg->ifname);
+	if (config->iface.fields & TAPCFG_CONFIG_IPV4) {
+		tapcfg->ipv4_addr = config->addr;
+		tapcfg->ipv4_netbits = config->iface.ipv4_netbits;
+	}
+	if (config->iface.fields & TAPCFG_CONFIG_IPV6) {
+		memcpy(&tapcfg->ipv6_addr, &config->addr6, sizeof(config->addr6));
+		tapcfg->ipv6_netbits = config->iface.ipv6_netbits;
+	}
+}
 
-	ifr.ifr_addr.sa_family = AF_INET;
-	sin = (struct sockaddr_in *) &ifr.ifr_addr;
-	in_addr = &sin->sin_addr;
-	in_addr->s_addr = addr;
+static int
+tapcfg_configure_dev(tapcfg_t *tapcfg, const tapcfg_config_t *config)
+{
+	tapcfg_netlink_batch_t batch;
 
-	if (ioctl(tapcfg->ctrl_fd, SIOCSIFADDR, &ifr) == -1) {
-		taplog_log(&tapcfg->taplog, TAPLOG_ERR,
-		           "Error trying to configure IPv4 address: %s",
-		           strerror(errno));
+	tapcfg_netlink_begin(&batch, tapcfg->nl_seq);
+	tapcfg_netlink_build(tapcfg, &batch, config, 1);
+	if (tapcfg_netlink_commit(tapcfg, &batch) == -1) {
 		return -1;
 	}
+	tapcfg_netlink_configured(tapcfg, config);
 
-	memset(&ifr,  0, sizeof(struct ifreq));
-	strcpy(ifr.ifr_name, tapcfg->ifname);
-
-	ifr.ifr_addr.sa_family = AF_INET;
-	sin = (struct sockaddr_in *) &ifr.ifr_netmask;
-	in_addr = &sin->sin_addr;
-	in_addr->s_addr = mask;
-
-	if (ioctl(tapcfg->ctrl_fd, SIOCSIFNETMASK, &ifr) == -1) {
-		taplog_log(&tapcfg->taplog, TAPLOG_ERR,
-		           "Error trying to configure IPv4 netmask: %s",
-		           strerror(errno));
+	tapcfg_netlink_begin(&batch, tapcfg->nl_seq);
+	tapcfg_netlink_build(tapcfg, &batch, config, 2);
+	if (tapcfg_netlink_commit(tapcfg, &batch) == -1) {
 		return -1;
 	}
 
@@ -0,0 +1,480 @@
+/**
+ *  tapcfg - A cross-platform configuration utility for TAP driver
+ *  Copyright (C) 2008-2011  Juho Vähä-Herttua
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include <sys/eventfd.h>
+
+#include "tapthread.h"
+
+/* A single subscriber thread serves all the monitored devices, it is
+ * started with the first device and stopped with the last one */
+typedef struct tapcfg_monitor_s {
+	int nl_fd;
+	int event_fd;
+	thread_handle_t thread;
+
+	/* Not subscribed to events, used for reading everything again
+	 * after the kernel had to drop some of the events */
+	int dump_fd;
+	unsigned int dump_seq;
+
+	tapcfg_t **devices;
+	int ndevices;
+	int size;
+} tapcfg_monitor_t;
+
+static pthread_mutex_t tapcfg_monitor_mutex = PTHREAD_MUTEX_INITIALIZER;
+static tapcfg_monitor_t *tapcfg_monitor;
+
+/* State of a device collected from the dumps when resynchronizing */
+typedef struct tapcfg_monitor_sync_s {
+	int changed;
+	int seen;
+	int found;
+	unsigned int addr;
+	int netbits;
+} tapcfg_monitor_sync_t;
+
+typedef struct tapcfg_monitor_dump_s {
+	tapcfg_monitor_t *monitor;
+	tapcfg_monitor_sync_t *sync;
+} tapcfg_monitor_dump_t;
+
+static int
+tapcfg_netlink_parse_addr(tapcfg_t *tapcfg, struct nlmsghdr *nlh)
+{
+	struct ifaddrmsg *ifa;
+	struct in6_addr local;
+	unsigned int addr;
+
+	ifa = NLMSG_DATA(nlh);
+	if (tapcfg_netlink_addr_local(nlh, &local) != AF_INET) {
+		return 0;
+	}
+	memcpy(&addr, &local, sizeof(addr));
+
+	if (nlh->nlmsg_type == RTM_NEWADDR) {
+		if (tapcfg->link_ipv4 == addr &&
+		    tapcfg->link_ipv4_netbits == ifa->ifa_prefixlen) {
+			return 0;
+		}
+		tapcfg->link_ipv4 = addr;
+		tapcfg->link_ipv4_netbits = ifa->ifa_prefixlen;
+	} else {
+		if (tapcfg->link_ipv4 != addr || !tapcfg->link_ipv4_netbits) {
+			return 0;
+		}
+		tapcfg->link_ipv4_netbits = 0;
+	}
+
+	return TAPCFG_LINK_IPV4;
+}
+
+static int
+tapcfg_monitor_refresh(tapcfg_t *tapcfg)
+{
+	struct ifreq ifr;
+	struct sockaddr_in *saddr;
+	unsigned int mask;
+	int bits;
+
+	/* Link attributes come from the same lookup used at start */
+	if (tapcfg_netlink_get_link(tapcfg) == -1) {
+		return -1;
+	}
+
+	tapcfg->link_ipv4_netbits = 0;
+	memset(&ifr, 0, sizeof(ifr));
+	strcpy(ifr.ifr_name, tapcfg->ifname);
+	if (ioctl(tapcfg->ctrl_fd, SIOCGIFADDR, &ifr) == -1) {
+		/* No address configured yet */
+		return 0;
+	}
+	saddr = (struct sockaddr_in *) &ifr.ifr_addr;
+	tapcfg->link_ipv4 = saddr->sin_addr.s_addr;
+
+	if (ioctl(tapcfg->ctrl_fd, SIOCGIFNETMASK, &ifr) == -1) {
+		return 0;
+	}
+	saddr = (struct sockaddr_in *) &ifr.ifr_addr;
+	mask = ntohl(saddr->sin_addr.s_addr);
+	for (bits=0; mask & 0x80000000; mask <<= 1)
+		bits++;
+	tapcfg->link_ipv4_netbits = bits;
+
+	return 0;
+}
+
+/* Returns the position of the device the message is about or -1 */
+static int
+tapcfg_monitor_find(tapcfg_monitor_t *monitor, struct nlmsghdr *nlh)
+{
+	int ifindex, i;
+
+	if (nlh->nlmsg_type == RTM_NEWLINK || nlh->nlmsg_type == RTM_DELLINK) {
+		ifindex = ((struct ifinfomsg *) NLMSG_DATA(nlh))->ifi_index;
+	} else if (nlh->nlmsg_type == RTM_NEWADDR || nlh->nlmsg_type == RTM_DELADDR) {
+		ifindex = ((struct ifaddrmsg *) NLMSG_DATA(nlh))->ifa_index;
+	} else {
+		return -1;
+	}
+
+	for (i=0; i<monitor->ndevices; i++) {
+		if (monitor->devices[i]->ifindex == ifindex) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+static void
+tapcfg_monitor_dispatch(tapcfg_monitor_t *monitor, struct nlmsghdr *nlh)
+{
+	tapcfg_t *tapcfg;
+	int changed, i;
+
+	i = tapcfg_monitor_find(monitor, nlh);
+	if (i < 0) {
+		return;
+	}
+	tapcfg = monitor->devices[i];
+
+	switch (nlh->nlmsg_type) {
+	case RTM_NEWLINK:
+		changed = tapcfg_netlink_parse_link(tapcfg, nlh);
+		break;
+	case RTM_DELLINK:
+		changed = (tapcfg->link_flags & IFF_UP) ? TAPCFG_LINK_STATUS : 0;
+		tapcfg->link_flags = 0;
+		break;
+	default:
+		changed = tapcfg_netlink_parse_addr(tapcfg, nlh);
+		break;
+	}
+
+	if (changed && tapcfg->link_callback) {
+		tapcfg->link_callback(tapcfg, changed, tapcfg->link_data);
+	}
+}
+
+static void
+tapcfg_monitor_parse_dump(void *arg, struct nlmsghdr *nlh)
+{
+	tapcfg_monitor_dump_t *dump = arg;
+	tapcfg_monitor_sync_t *sync;
+	struct ifaddrmsg *ifa;
+	struct in6_addr local;
+	int i;
+
+	i = tapcfg_monitor_find(dump->monitor, nlh);
+	if (i < 0) {
+		return;
+	}
+	sync = &dump->sync[i];
+
+	if (nlh->nlmsg_type == RTM_NEWLINK) {
+		/* The message has all the attributes, like an event would */
+		sync->changed |= tapcfg_netlink_parse_link(dump->monitor->devices[i], nlh);
+		sync->seen = 1;
+	} else if (nlh->nlmsg_type == RTM_NEWADDR && !sync->found &&
+	           tapcfg_netlink_addr_local(nlh, &local) == AF_INET) {
+		ifa = NLMSG_DATA(nlh);
+		memcpy(&sync->addr, &local, sizeof(sync->addr));
+		sync->netbits = ifa->ifa_prefixlen;
+		sync->found = 1;
+	}
+}
+
+/* Has to be called with the monitor mutex locked. Events were lost,
+ * so the cached attributes of all the devices are read again and the
+ * callbacks are told about everything that changed meanwhile. */
+static void
+tapcfg_monitor_resync(tapcfg_monitor_t *monitor)
+{
+	tapcfg_monitor_dump_t dump;
+	tapcfg_monitor_sync_t *sync;
+	struct ifinfomsg ifi;
+	struct ifaddrmsg ifa;
+	tapcfg_t *tapcfg;
+	int i;
+
+	if (!monitor->ndevices) {
+		return;
+	}
+	dump.monitor = monitor;
+	dump.sync = calloc(monitor->ndevices, sizeof(tapcfg_monitor_sync_t));
+	if (!dump.sync) {
+		return;
+	}
+
+	memset(&ifi, 0, sizeof(ifi));
+	ifi.ifi_family = AF_UNSPEC;
+	memset(&ifa, 0, sizeof(ifa));
+	ifa.ifa_family = AF_INET;
+	if (tapcfg_netlink_dump(monitor->dump_fd, monitor->dump_seq++, RTM_GETLINK,
+	                        &ifi, sizeof(ifi), tapcfg_monitor_parse_dump,
+	                        &dump) == -1 ||
+	    tapcfg_netlink_dump(monitor->dump_fd, monitor->dump_seq++, RTM_GETADDR,
+	                        &ifa, sizeof(ifa), tapcfg_monitor_parse_dump,
+	                        &dump) == -1) {
+		taplog_log(&monitor->devices[0]->taplog, TAPLOG_ERR,
+		           "Error reading the link attributes after lost events: %s",
+		           strerror(errno));
+		free(dump.sync);
+		return;
+	}
+
+	for (i=0; i<monitor->ndevices; i++) {
+		tapcfg = monitor->devices[i];
+		sync = &dump.sync[i];
+
+		/* Not in the dump, so the link was deleted */
+		if (!sync->seen && (tapcfg->link_flags & IFF_UP)) {
+			sync->changed |= TAPCFG_LINK_STATUS;
+		}
+		if (!sync->seen) {
+			tapcfg->link_flags = 0;
+		}
+
+		if (sync->found &&
+		    (tapcfg->link_ipv4 != sync->addr ||
+		     tapcfg->link_ipv4_netbits != sync->netbits)) {
+			tapcfg->link_ipv4 = sync->addr;
+			tapcfg->link_ipv4_netbits = sync->netbits;
+			sync->changed |= TAPCFG_LINK_IPV4;
+		} else if (!sync->found && tapcfg->link_ipv4_netbits) {
+			tapcfg->link_ipv4_netbits = 0;
+			sync->changed |= TAPCFG_LINK_IPV4;
+		}
+
+		if (sync->changed && tapcfg->link_callback) {
+			tapcfg->link_callback(tapcfg, sync->changed, tapcfg->link_data);
+		}
+	}
+	free(dump.sync);
+}
+
+static THREAD_RETVAL
+tapcfg_monitor_thread(void *arg)
+{
+	tapcfg_monitor_t *monitor = arg;
+	unsigned int buf[TAPCFG_NETLINK_RECVSIZE/sizeof(unsigned int)];
+	struct pollfd pfd[2];
+	struct nlmsghdr *nlh;
+	int len;
+
+	pfd[0].fd = monitor->nl_fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = monitor->event_fd;
+	pfd[1].events = POLLIN;
+
+	while (1) {
+		if (poll(pfd, 2, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (pfd[1].revents) {
+			/* Last device was removed */
+			break;
+		}
+
+		len = recv(monitor->nl_fd, buf, sizeof(buf), 0);
+		if (len == -1 && errno == ENOBUFS) {
+			/* The events that didn't fit into the socket buffer
+			 * are lost, the current state has to be read */
+			MUTEX_LOCK(tapcfg_monitor_mutex);
+			tapcfg_monitor_resync(monitor);
+			MUTEX_UNLOCK(tapcfg_monitor_mutex);
+			continue;
+		} else if (len == -1) {
+			continue;
+		}
+
+		MUTEX_LOCK(tapcfg_monitor_mutex);
+		nlh = (struct nlmsghdr *) buf;
+		for (; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+			tapcfg_monitor_dispatch(monitor, nlh);
+		}
+		MUTEX_UNLOCK(tapcfg_monitor_mutex);
+	}
+
+	return 0;
+}
+
+static void
+tapcfg_monitor_free(tapcfg_monitor_t *monitor)
+{
+	if (monitor->nl_fd != -1)
+		close(monitor->nl_fd);
+	if (monitor->event_fd != -1)
+		close(monitor->event_fd);
+	if (monitor->dump_fd != -1)
+		close(monitor->dump_fd);
+	free(monitor->devices);
+	free(monitor);
+}
+
+static tapcfg_monitor_t *
+tapcfg_monitor_start(tapcfg_t *tapcfg)
+{
+	tapcfg_monitor_t *monitor;
+	struct sockaddr_nl snl;
+
+	monitor = calloc(1, sizeof(tapcfg_monitor_t));
+	if (!monitor) {
+		return NULL;
+	}
+	monitor->event_fd = -1;
+	monitor->dump_fd = -1;
+
+	monitor->nl_fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+	monitor->dump_fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+	if (monitor->nl_fd == -1 || monitor->dump_fd == -1) {
+		taplog_log(&tapcfg->taplog, TAPLOG_ERR,
+		           "Error opening netlink socket: %s",
+		           strerror(errno));
+		tapcfg_monitor_free(monitor);
+		return NULL;
+	}
+
+	memset(&snl, 0, sizeof(snl));
+	snl.nl_family = AF_NETLINK;
+	snl.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR;
+	if (bind(monitor->nl_fd, (struct sockaddr *) &snl, sizeof(snl)) == -1) {
+		taplog_log(&tapcfg->taplog, TAPLOG_ERR,
+		           "Error subscribing to link events: %s",
+		           strerror(errno));
+		tapcfg_monitor_free(monitor);
+		return NULL;
+	}
+
+	monitor->event_fd = eventfd(0, 0);
+	if (monitor->event_fd == -1) {
+		taplog_log(&tapcfg->taplog, TAPLOG_ERR,
+		           "Error creating eventfd: %s",
+		           strerror(errno));
+		tapcfg_monitor_free(monitor);
+		return NULL;
+	}
+
+	THREAD_CREATE(monitor->thread, tapcfg_monitor_thread, monitor);
+	if (!monitor->thread) {
+		taplog_log(&tapcfg->taplog, TAPLOG_ERR,
+		           "Error starting the link monitor thread");
+		tapcfg_monitor_free(monitor);
+		return NULL;
+	}
+
+	return monitor;
+}
+
+static void
+tapcfg_monitor_stop(tapcfg_monitor_t *monitor)
+{
+	unsigned long long value = 1;
+
+	/* The counter is written only once, so it can't overflow and the
+	 * write only fails when interrupted */
+	while (write(monitor->event_fd, &value, sizeof(value)) == -1 &&
+	       errno == EINTR);
+	THREAD_JOIN(monitor->thread);
+	tapcfg_monitor_free(monitor);
+}
+
+static int
+tapcfg_monitor_dev(tapcfg_t *tapcfg, int enabled)
+{
+	tapcfg_monitor_t *monitor = NULL;
+	tapcfg_t **devices;
+	int i;
+
+	MUTEX_LOCK(tapcfg_monitor_mutex);
+	if (!enabled == !tapcfg->monitored) {
+		MUTEX_UNLOCK(tapcfg_monitor_mutex);
+		return 0;
+	}
+
+	if (enabled) {
+		if (!tapcfg_monitor) {
+			tapcfg_monitor = tapcfg_monitor_start(tapcfg);
+			if (!tapcfg_monitor) {
+				MUTEX_UNLOCK(tapcfg_monitor_mutex);
+				return -1;
+			}
+		}
+		monitor = tapcfg_monitor;
+
+		if (monitor->ndevices == monitor->size) {
+			devices = realloc(monitor->devices,
+			                  (monitor->size + 16) * sizeof(tapcfg_t *));
+			if (!devices) {
+				goto err;
+			}
+			monitor->devices = devices;
+			monitor->size += 16;
+		}
+
+		/* Events of this device wait for the lock, so they are
+		 * applied on top of the current state read here */
+		if (tapcfg_monitor_refresh(tapcfg) == -1) {
+			goto err;
+		}
+		monitor->devices[monitor->ndevices++] = tapcfg;
+		tapcfg->monitored = 1;
+		MUTEX_UNLOCK(tapcfg_monitor_mutex);
+
+		return 0;
+	}
+
+	monitor = tapcfg_monitor;
+	for (i=0; i<monitor->ndevices; i++) {
+		if (monitor->devices[i] == tapcfg) {
+			monitor->devices[i] = monitor->devices[--monitor->ndevices];
+			break;
+		}
+	}
+	tapcfg->monitored = 0;
+
+	if (monitor->ndevices) {
+		monitor = NULL;
+	} else {
+		tapcfg_monitor = NULL;
+	}
+	MUTEX_UNLOCK(tapcfg_monitor_mutex);
+
+	/* The thread takes the lock, so it's joined without holding it */
+	if (monitor) {
+		tapcfg_monitor_stop(monitor);
+	}
+
+	return 0;
+
+err:
+	/* Don't leave the thread running without devices */
+	monitor = tapcfg_monitor;
+	if (monitor->ndevices) {
+		monitor = NULL;
+	} else {
+		tapcfg_monitor = NULL;
+	}
+	MUTEX_UNLOCK(tapcfg_monitor_mutex);
+
+	if (monitor) {
+		tapcfg_monitor_stop(monitor);
+	}
+
+	return -1;
+}
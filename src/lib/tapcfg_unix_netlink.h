@@ -0,0 +1,446 @@
+/**
+ *  tapcfg - A cross-platform configuration utility for TAP driver
+ *  Copyright (C) 2008-2011  Juho Vähä-Herttua
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+/* Enough for a link message and the address changes of one commit */
+#define TAPCFG_NETLINK_BUFSIZE 1024
+#define TAPCFG_NETLINK_MAXMSG  8
+
+/* Link replies carry all the statistics and need more room */
+#define TAPCFG_NETLINK_RECVSIZE 8192
+
+/* The kernel fills dump replies up to the size we have read with */
+#define TAPCFG_NETLINK_DUMPSIZE 32768
+
+#ifndef SOL_NETLINK
+#  define SOL_NETLINK 270
+#endif
+#ifndef NETLINK_GET_STRICT_CHK
+#  define NETLINK_GET_STRICT_CHK 12
+#endif
+
+/* Requests collected here are sent to the kernel with a single
+ * system call and all of them are addressed by interface index */
+typedef struct tapcfg_netlink_batch_s {
+	unsigned int buf[TAPCFG_NETLINK_BUFSIZE/sizeof(unsigned int)];
+	int len;
+	unsigned int seq;
+	int count;
+	const char *desc[TAPCFG_NETLINK_MAXMSG];
+} tapcfg_netlink_batch_t;
+
+/* Called for every message of a dump */
+typedef void (*tapcfg_netlink_parse_t)(void *arg, struct nlmsghdr *nlh);
+
+static int
+tapcfg_netlink_open(tapcfg_t *tapcfg)
+{
+	int enabled = 1;
+
+	tapcfg->nl_fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+	if (tapcfg->nl_fd == -1) {
+		taplog_log(&tapcfg->taplog, TAPLOG_ERR,
+		           "Error opening netlink socket: %s",
+		           strerror(errno));
+		return -1;
+	}
+
+	/* Lets the kernel filter address dumps by the interface index,
+	 * older kernels ignore the filter and we check it ourselves */
+	setsockopt(tapcfg->nl_fd, SOL_NETLINK, NETLINK_GET_STRICT_CHK,
+	           &enabled, sizeof(enabled));
+
+	return 0;
+}
+
+static void
+tapcfg_netlink_close(tapcfg_t *tapcfg)
+{
+	if (tapcfg->nl_fd != -1) {
+		close(tapcfg->nl_fd);
+		tapcfg->nl_fd = -1;
+	}
+}
+
+static void
+tapcfg_netlink_begin(tapcfg_netlink_batch_t *batch, unsigned int seq)
+{
+	batch->len = 0;
+	batch->seq = seq;
+	batch->count = 0;
+}
+
+static struct nlmsghdr *
+tapcfg_netlink_msg(tapcfg_netlink_batch_t *batch, int type, int flags,
+                   const void *data, int datalen, const char *desc)
+{
+	struct nlmsghdr *nlh;
+
+	assert(batch->count < TAPCFG_NETLINK_MAXMSG);
+	assert(batch->len + NLMSG_SPACE(datalen) <= sizeof(batch->buf));
+
+	nlh = (struct nlmsghdr *) ((char *) batch->buf + batch->len);
+	nlh->nlmsg_len = NLMSG_LENGTH(datalen);
+	nlh->nlmsg_type = type;
+	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+	nlh->nlmsg_seq = batch->seq + batch->count;
+	nlh->nlmsg_pid = 0;
+	memcpy(NLMSG_DATA(nlh), data, datalen);
+
+	batch->desc[batch->count++] = desc;
+	batch->len += NLMSG_ALIGN(nlh->nlmsg_len);
+
+	return nlh;
+}
+
+static void
+tapcfg_netlink_attr(tapcfg_netlink_batch_t *batch, struct nlmsghdr *nlh,
+                    int type, const void *data, int datalen)
+{
+	struct rtattr *rta;
+
+	/* Attributes can only be appended to the latest message */
+	assert((char *) nlh + NLMSG_ALIGN(nlh->nlmsg_len) ==
+	       (char *) batch->buf + batch->len);
+	assert(batch->len + RTA_SPACE(datalen) <= sizeof(batch->buf));
+
+	rta = (struct rtattr *) ((char *) nlh + NLMSG_ALIGN(nlh->nlmsg_len));
+	rta->rta_type = type;
+	rta->rta_len = RTA_LENGTH(datalen);
+	memcpy(RTA_DATA(rta), data, datalen);
+
+	nlh->nlmsg_len = NLMSG_ALIGN(nlh->nlmsg_len) + RTA_SPACE(datalen);
+	batch->len += RTA_SPACE(datalen);
+}
+
+static void
+tapcfg_netlink_link(tapcfg_t *tapcfg, tapcfg_netlink_batch_t *batch,
+                    const unsigned char *hwaddr, int mtu,
+                    int change, int flags, const char *desc)
+{
+	struct ifinfomsg ifi;
+	struct nlmsghdr *nlh;
+
+	memset(&ifi, 0, sizeof(ifi));
+	ifi.ifi_family = AF_UNSPEC;
+	ifi.ifi_index = tapcfg->ifindex;
+	ifi.ifi_flags = flags;
+	ifi.ifi_change = change;
+
+	nlh = tapcfg_netlink_msg(batch, RTM_NEWLINK, 0, &ifi, sizeof(ifi), desc);
+	if (hwaddr) {
+		tapcfg_netlink_attr(batch, nlh, IFLA_ADDRESS, hwaddr, HWADDRLEN);
+	}
+	if (mtu > 0) {
+		unsigned int value = mtu;
+
+		tapcfg_netlink_attr(batch, nlh, IFLA_MTU, &value, sizeof(value));
+	}
+}
+
+static void
+tapcfg_netlink_addr(tapcfg_t *tapcfg, tapcfg_netlink_batch_t *batch,
+                    int type, int family, const void *addr,
+                    unsigned char netbits, const char *desc)
+{
+	struct ifaddrmsg ifa;
+	struct nlmsghdr *nlh;
+	int addrlen;
+
+	addrlen = (family == AF_INET) ? 4 : 16;
+
+	memset(&ifa, 0, sizeof(ifa));
+	ifa.ifa_family = family;
+	ifa.ifa_prefixlen = netbits;
+	ifa.ifa_scope = RT_SCOPE_UNIVERSE;
+	ifa.ifa_index = tapcfg->ifindex;
+
+	nlh = tapcfg_netlink_msg(batch, type,
+	                         (type == RTM_NEWADDR) ? NLM_F_CREATE | NLM_F_REPLACE : 0,
+	                         &ifa, sizeof(ifa), desc);
+	tapcfg_netlink_attr(batch, nlh, IFA_LOCAL, addr, addrlen);
+	tapcfg_netlink_attr(batch, nlh, IFA_ADDRESS, addr, addrlen);
+	if (family == AF_INET && type == RTM_NEWADDR && netbits < 31) {
+		unsigned int brd;
+
+		/* The ioctl interface sets the broadcast address implicitly */
+		memcpy(&brd, addr, sizeof(brd));
+		brd |= htonl(0xffffffff >> netbits);
+		tapcfg_netlink_attr(batch, nlh, IFA_BROADCAST, &brd, sizeof(brd));
+	}
+}
+
+static int
+tapcfg_netlink_parse_link(tapcfg_t *tapcfg, struct nlmsghdr *nlh)
+{
+	struct ifinfomsg *ifi;
+	struct rtattr *rta;
+	int changed = 0;
+	int len, mtu;
+
+	if (nlh->nlmsg_type != RTM_NEWLINK) {
+		return 0;
+	}
+
+	ifi = NLMSG_DATA(nlh);
+	tapcfg->ifindex = ifi->ifi_index;
+	if ((ifi->ifi_flags ^ tapcfg->link_flags) & IFF_UP) {
+		changed |= TAPCFG_LINK_STATUS;
+	}
+	tapcfg->link_flags = ifi->ifi_flags;
+
+	len = IFLA_PAYLOAD(nlh);
+	for (rta = IFLA_RTA(ifi); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		if (rta->rta_type == IFLA_ADDRESS &&
+		    RTA_PAYLOAD(rta) == HWADDRLEN) {
+			if (memcmp(tapcfg->hwaddr, RTA_DATA(rta), HWADDRLEN)) {
+				memcpy(tapcfg->hwaddr, RTA_DATA(rta), HWADDRLEN);
+				changed |= TAPCFG_LINK_HWADDR;
+			}
+		} else if (rta->rta_type == IFLA_MTU &&
+		           RTA_PAYLOAD(rta) == sizeof(mtu)) {
+			memcpy(&mtu, RTA_DATA(rta), sizeof(mtu));
+			if (mtu != tapcfg->link_mtu) {
+				tapcfg->link_mtu = mtu;
+				changed |= TAPCFG_LINK_MTU;
+			}
+		}
+	}
+
+	return changed;
+}
+
+static int
+tapcfg_netlink_commit(tapcfg_t *tapcfg, tapcfg_netlink_batch_t *batch)
+{
+	unsigned int reply[TAPCFG_NETLINK_RECVSIZE/sizeof(unsigned int)];
+	struct nlmsghdr *nlh;
+	struct nlmsgerr *nlerr;
+	unsigned int idx;
+	int pending, len;
+	int ret = 0;
+
+	if (!batch->count) {
+		return 0;
+	}
+	tapcfg->nl_seq += batch->count;
+
+	if (send(tapcfg->nl_fd, batch->buf, batch->len, 0) == -1) {
+		taplog_log(&tapcfg->taplog, TAPLOG_ERR,
+		           "Error sending netlink request: %s",
+		           strerror(errno));
+		return -1;
+	}
+
+	/* Every request is acknowledged, replies come before the ack */
+	pending = batch->count;
+	while (pending > 0) {
+		len = recv(tapcfg->nl_fd, reply, sizeof(reply), 0);
+		if (len == -1) {
+			if (errno == EINTR)
+				continue;
+			taplog_log(&tapcfg->taplog, TAPLOG_ERR,
+			           "Error receiving netlink reply: %s",
+			           strerror(errno));
+			return -1;
+		}
+
+		nlh = (struct nlmsghdr *) reply;
+		for (; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+			idx = nlh->nlmsg_seq - batch->seq;
+			if (idx >= batch->count) {
+				/* Left over from an earlier failed commit */
+				continue;
+			}
+			if (nlh->nlmsg_type != NLMSG_ERROR) {
+				tapcfg_netlink_parse_link(tapcfg, nlh);
+				continue;
+			}
+
+			/* Requests without description are allowed to fail */
+			nlerr = NLMSG_DATA(nlh);
+			if (nlerr->error && batch->desc[idx] && !ret) {
+				taplog_log(&tapcfg->taplog, TAPLOG_ERR,
+				           "Error %s of interface %s: %s",
+				           batch->desc[idx], tapcfg->ifname,
+				           strerror(-nlerr->error));
+				ret = -1;
+			}
+			pending--;
+		}
+	}
+
+	return ret;
+}
+
+/* Requests a dump and passes every reply to the parser until the
+ * dump is done, the socket must not be subscribed to any events */
+static int
+tapcfg_netlink_dump(int fd, unsigned int seq, int type, const void *data,
+                    int datalen, tapcfg_netlink_parse_t parse, void *arg)
+{
+	unsigned int reply[TAPCFG_NETLINK_DUMPSIZE/sizeof(unsigned int)];
+	tapcfg_netlink_batch_t batch;
+	struct nlmsghdr *nlh;
+	int len;
+
+	tapcfg_netlink_begin(&batch, seq);
+	nlh = tapcfg_netlink_msg(&batch, type, NLM_F_DUMP, data, datalen, NULL);
+
+	/* Dumps end with NLMSG_DONE instead of an acknowledgement */
+	nlh->nlmsg_flags &= ~NLM_F_ACK;
+	if (send(fd, batch.buf, batch.len, 0) == -1) {
+		return -1;
+	}
+
+	while (1) {
+		len = recv(fd, reply, sizeof(reply), 0);
+		if (len == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		nlh = (struct nlmsghdr *) reply;
+		for (; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+			if (nlh->nlmsg_seq != seq) {
+				/* Left over from an earlier failed request */
+				continue;
+			}
+			if (nlh->nlmsg_type == NLMSG_DONE) {
+				return 0;
+			} else if (nlh->nlmsg_type == NLMSG_ERROR) {
+				errno = -((struct nlmsgerr *) NLMSG_DATA(nlh))->error;
+				return -1;
+			}
+			parse(arg, nlh);
+		}
+	}
+}
+
+/* Returns the address family of the message if the local address of
+ * the interface was found, IPv6 link local addresses are skipped */
+static int
+tapcfg_netlink_addr_local(struct nlmsghdr *nlh, void *addr)
+{
+	struct ifaddrmsg *ifa;
+	struct rtattr *rta;
+	int len, type, addrlen;
+
+	ifa = NLMSG_DATA(nlh);
+	if (ifa->ifa_family == AF_INET) {
+		/* On point to point links IFA_ADDRESS is the remote end */
+		type = IFA_LOCAL;
+		addrlen = 4;
+	} else if (ifa->ifa_family == AF_INET6 &&
+	           ifa->ifa_scope == RT_SCOPE_UNIVERSE) {
+		type = IFA_ADDRESS;
+		addrlen = 16;
+	} else {
+		return 0;
+	}
+
+	len = IFA_PAYLOAD(nlh);
+	for (rta = IFA_RTA(ifa); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		if (rta->rta_type == type && RTA_PAYLOAD(rta) == addrlen) {
+			memcpy(addr, RTA_DATA(rta), addrlen);
+			return ifa->ifa_family;
+		}
+	}
+
+	return 0;
+}
+
+static void
+tapcfg_netlink_parse_local(void *arg, struct nlmsghdr *nlh)
+{
+	tapcfg_t *tapcfg = arg;
+	struct ifaddrmsg *ifa;
+	struct in6_addr addr;
+
+	ifa = NLMSG_DATA(nlh);
+	if (nlh->nlmsg_type != RTM_NEWADDR || ifa->ifa_index != tapcfg->ifindex) {
+		return;
+	}
+
+	/* The first address of each family is the one replaced */
+	switch (tapcfg_netlink_addr_local(nlh, &addr)) {
+	case AF_INET:
+		if (!tapcfg->ipv4_netbits) {
+			memcpy(&tapcfg->ipv4_addr, &addr, sizeof(tapcfg->ipv4_addr));
+			tapcfg->ipv4_netbits = ifa->ifa_prefixlen;
+		}
+		break;
+	case AF_INET6:
+		if (!tapcfg->ipv6_netbits) {
+			memcpy(&tapcfg->ipv6_addr, &addr, sizeof(addr));
+			tapcfg->ipv6_netbits = ifa->ifa_prefixlen;
+		}
+		break;
+	}
+}
+
+/* Reads the addresses the device already has, so that setting a new
+ * one replaces them also on devices we have attached to */
+static int
+tapcfg_netlink_get_addr(tapcfg_t *tapcfg)
+{
+	struct ifaddrmsg ifa;
+
+	memset(&ifa, 0, sizeof(ifa));
+	ifa.ifa_family = AF_UNSPEC;
+	ifa.ifa_index = tapcfg->ifindex;
+
+	tapcfg->ipv4_netbits = 0;
+	tapcfg->ipv6_netbits = 0;
+	if (tapcfg_netlink_dump(tapcfg->nl_fd, tapcfg->nl_seq++, RTM_GETADDR,
+	                        &ifa, sizeof(ifa), tapcfg_netlink_parse_local,
+	                        tapcfg) == -1) {
+		taplog_log(&tapcfg->taplog, TAPLOG_ERR,
+		           "Error reading the addresses of interface %s: %s",
+		           tapcfg->ifname, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+tapcfg_netlink_get_link(tapcfg_t *tapcfg)
+{
+	tapcfg_netlink_batch_t batch;
+	struct ifinfomsg ifi;
+	struct nlmsghdr *nlh;
+
+	memset(&ifi, 0, sizeof(ifi));
+	ifi.ifi_family = AF_UNSPEC;
+
+	/* Lookup by name returns the index and the hardware address */
+	tapcfg_netlink_begin(&batch, tapcfg->nl_seq);
+	nlh = tapcfg_netlink_msg(&batch, RTM_GETLINK, 0, &ifi, sizeof(ifi),
+	                         "looking up the index");
+	tapcfg_netlink_attr(&batch, nlh, IFLA_IFNAME, tapcfg->ifname,
+	                    strlen(tapcfg->ifname) + 1);
+	if (tapcfg_netlink_commit(tapcfg, &batch) == -1) {
+		return -1;
+	}
+	if (!tapcfg->ifindex) {
+		return -1;
+	}
+
+	return tapcfg_netlink_get_addr(tapcfg);
+}
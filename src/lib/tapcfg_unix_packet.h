@@ -0,0 +1,367 @@
+/**
+ *  tapcfg - A cross-platform configuration utility for TAP driver
+ *  Copyright (C) 2008-2011  Juho Vähä-Herttua
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/* The packet engine receives the frames from a TPACKET_V3 ring of an
+ * AF_PACKET socket bound to the interface. The kernel hands the frames
+ * over in blocks of shared memory, so while traffic keeps flowing they
+ * can be consumed without any system calls. The tap fd drops all frames
+ * sent to it and is only used for writing. */
+
+#include <sys/mman.h>
+#include <net/ethernet.h>
+#include <linux/if_packet.h>
+#include <linux/filter.h>
+
+#define TAPCFG_PACKET_BLOCK_SIZE (1 << 20)
+#define TAPCFG_PACKET_BLOCK_NR   8
+#define TAPCFG_PACKET_FRAME_SIZE 2048
+
+/* Milliseconds before a partially filled block is handed over */
+#define TAPCFG_PACKET_TIMEOUT    1
+
+struct tapcfg_packet_engine_s {
+	int fd;
+	char *map;
+	size_t maplen;
+
+	/* Block being consumed and the next frame in it, frame is
+	 * NULL when the block is not yet handed over to us */
+	int block;
+	struct tpacket3_hdr *frame;
+	int remaining;
+};
+typedef struct tapcfg_packet_engine_s tapcfg_packet_engine_t;
+
+/* Frames leaving the interface are the ones the tap device would return,
+ * the frames we write to the device come in and should be ignored */
+static struct sock_filter tapcfg_packet_outgoing[] = {
+	{ BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_PKTTYPE },
+	{ BPF_JMP | BPF_JEQ | BPF_K, 0, 1, PACKET_OUTGOING },
+	{ BPF_RET | BPF_K, 0, 0, 0xffffffff },
+	{ BPF_RET | BPF_K, 0, 0, 0 }
+};
+
+static struct sock_filter tapcfg_packet_drop[] = {
+	{ BPF_RET | BPF_K, 0, 0, 0 }
+};
+
+static void
+tapcfg_packet_engine_free(tapcfg_packet_engine_t *engine)
+{
+	if (engine->map)
+		munmap(engine->map, engine->maplen);
+	if (engine->fd != -1)
+		close(engine->fd);
+	free(engine);
+}
+
+static void
+tapcfg_packet_engine_stop(tapcfg_t *tapcfg)
+{
+	if (!tapcfg->packet_engine) {
+		return;
+	}
+
+	/* A persistent device would keep dropping the frames after we
+	 * are gone, so the filter is always detached */
+	ioctl(tapcfg->tap_fd, TUNDETACHFILTER, 0);
+
+	tapcfg_packet_engine_free(tapcfg->packet_engine);
+	tapcfg->packet_engine = NULL;
+}
+
+static int
+tapcfg_packet_engine_start(tapcfg_t *tapcfg)
+{
+	tapcfg_packet_engine_t *engine;
+	struct tpacket_req3 req;
+	struct sockaddr_ll addr;
+	struct sock_fprog prog;
+	int version = TPACKET_V3;
+
+	/* The frames in the ring don't carry the offload information and
+	 * all the queues of a device would share a single ring */
+	if (tapcfg->offload || tapcfg->multiqueue) {
+		taplog_log(&tapcfg->taplog, TAPLOG_ERR,
+		           "The packet engine doesn't support offloads "
+		           "or multiple queues");
+		return -1;
+	}
+
+	engine = calloc(1, sizeof(tapcfg_packet_engine_t));
+	if (!engine) {
+		return -1;
+	}
+
+	/* No protocol until bound, or we would get frames of all interfaces */
+	engine->fd = socket(AF_PACKET, SOCK_RAW, 0);
+	if (engine->fd == -1) {
+		taplog_log(&tapcfg->taplog, TAPLOG_ERR,
+		           "Error opening packet socket: %s",
+		           strerror(errno));
+		goto err;
+	}
+
+	prog.len = sizeof(tapcfg_packet_outgoing) / sizeof(struct sock_filter);
+	prog.filter = tapcfg_packet_outgoing;
+	if (setsockopt(engine->fd, SOL_PACKET, PACKET_VERSION,
+	               &version, sizeof(version)) == -1 ||
+	    setsockopt(engine->fd, SOL_SOCKET, SO_ATTACH_FILTER,
+	               &prog, sizeof(prog)) == -1) {
+		taplog_log(&tapcfg->taplog, TAPLOG_ERR,
+		           "Error setting up packet socket: %s",
+		           strerror(errno));
+		goto err;
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = TAPCFG_PACKET_BLOCK_SIZE;
+	req.tp_block_nr = TAPCFG_PACKET_BLOCK_NR;
+	req.tp_frame_size = TAPCFG_PACKET_FRAME_SIZE;
+	req.tp_frame_nr = TAPCFG_PACKET_BLOCK_SIZE / TAPCFG_PACKET_FRAME_SIZE *
+	                  TAPCFG_PACKET_BLOCK_NR;
+	req.tp_retire_blk_tov = TAPCFG_PACKET_TIMEOUT;
+	if (setsockopt(engine->fd, SOL_PACKET, PACKET_RX_RING,
+	               &req, sizeof(req)) == -1) {
+		taplog_log(&tapcfg->taplog, TAPLOG_ERR,
+		           "Error setting up packet ring: %s",
+		           strerror(errno));
+		goto err;
+	}
+
+	engine->maplen = (size_t) TAPCFG_PACKET_BLOCK_SIZE * TAPCFG_PACKET_BLOCK_NR;
+	engine->map = mmap(NULL, engine->maplen, PROT_READ | PROT_WRITE,
+	                   MAP_SHARED | MAP_POPULATE, engine->fd, 0);
+	if (engine->map == MAP_FAILED) {
+		engine->map = NULL;
+		taplog_log(&tapcfg->taplog, TAPLOG_ERR,
+		           "Error mapping packet ring: %s",
+		           strerror(errno));
+		goto err;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sll_family = AF_PACKET;
+	addr.sll_protocol = htons(ETH_P_ALL);
+	addr.sll_ifindex = if_nametoindex(tapcfg->ifname);
+	if (bind(engine->fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+		taplog_log(&tapcfg->taplog, TAPLOG_ERR,
+		           "Error binding packet socket to %s: %s",
+		           tapcfg->ifname, strerror(errno));
+		goto err;
+	}
+
+	/* Frames would otherwise pile up in the tap queue as well */
+	prog.len = sizeof(tapcfg_packet_drop) / sizeof(struct sock_filter);
+	prog.filter = tapcfg_packet_drop;
+	if (ioctl(tapcfg->tap_fd, TUNATTACHFILTER, &prog) == -1) {
+		taplog_log(&tapcfg->taplog, TAPLOG_ERR,
+		           "Error attaching filter to device: %s",
+		           strerror(errno));
+		goto err;
+	}
+
+	tapcfg->packet_engine = engine;
+
+	return 0;
+
+err:
+	tapcfg_packet_engine_free(engine);
+
+	return -1;
+}
+
+static struct tpacket_block_desc *
+tapcfg_packet_engine_block(tapcfg_packet_engine_t *engine)
+{
+	return (struct tpacket_block_desc *)
+		(engine->map + engine->block * TAPCFG_PACKET_BLOCK_SIZE);
+}
+
+/* Get the next frame from the ring, waiting for at most msec if there
+ * is none, negative msec waits forever. Returns NULL if nothing is ready */
+static struct tpacket3_hdr *
+tapcfg_packet_engine_next(tapcfg_t *tapcfg, int msec)
+{
+	tapcfg_packet_engine_t *engine = tapcfg->packet_engine;
+	struct tpacket_block_desc *bd;
+	struct pollfd pfd;
+	int err;
+	socklen_t errlen;
+
+	for (;;) {
+		if (engine->remaining) {
+			return engine->frame;
+		}
+
+		bd = tapcfg_packet_engine_block(engine);
+		if (engine->frame) {
+			/* All frames consumed, give the block back to the kernel */
+			__atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL,
+			                 __ATOMIC_RELEASE);
+			engine->block = (engine->block + 1) % TAPCFG_PACKET_BLOCK_NR;
+			engine->frame = NULL;
+			continue;
+		}
+
+		if (__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) &
+		    TP_STATUS_USER) {
+			engine->frame = (struct tpacket3_hdr *)
+				((char *) bd + bd->hdr.bh1.offset_to_first_pkt);
+			engine->remaining = bd->hdr.bh1.num_pkts;
+			continue;
+		}
+
+		if (!msec) {
+			return NULL;
+		}
+
+		pfd.fd = engine->fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, msec) <= 0) {
+			return NULL;
+		}
+		if (pfd.revents & POLLERR) {
+			/* Binding to a device that is down reports ENETDOWN
+			 * even though frames arrive once it is brought up */
+			errlen = sizeof(err);
+			getsockopt(engine->fd, SOL_SOCKET, SO_ERROR, &err, &errlen);
+		}
+
+		/* Wait only once unless waiting forever */
+		if (msec > 0) {
+			msec = 0;
+		}
+	}
+}
+
+static void
+tapcfg_packet_engine_consume(tapcfg_t *tapcfg)
+{
+	tapcfg_packet_engine_t *engine = tapcfg->packet_engine;
+
+	engine->remaining--;
+	engine->frame = (struct tpacket3_hdr *)
+		((char *) engine->frame + engine->frame->tp_next_offset);
+}
+
+/* Wait for a frame to be available, using the busy poll budget first */
+static int
+tapcfg_packet_engine_wait(tapcfg_t *tapcfg, int msec)
+{
+	struct timespec start;
+
+	if (tapcfg->busy_poll && msec != 0 &&
+	    tapcfg->busy_idle < TAPCFG_BUSY_POLL_IDLE) {
+		/* Spinning only reads the shared memory, no system calls */
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		do {
+			if (tapcfg_packet_engine_next(tapcfg, 0)) {
+				tapcfg->busy_hits++;
+				tapcfg->busy_idle = 0;
+				return 1;
+			}
+		} while (tapcfg_elapsed_usec(&start) < tapcfg->busy_poll &&
+		         (msec < 0 || tapcfg_elapsed_usec(&start) < msec * 1000L));
+		tapcfg->busy_misses++;
+		tapcfg->busy_idle++;
+
+		if (msec > 0) {
+			msec -= tapcfg->busy_poll / 1000;
+			if (msec < 0)
+				msec = 0;
+		}
+	}
+
+	if (!tapcfg_packet_engine_next(tapcfg, msec)) {
+		return 0;
+	}
+	tapcfg->busy_idle = 0;
+
+	return 1;
+}
+
+static int
+tapcfg_packet_engine_read(tapcfg_t *tapcfg, tapcfg_vnet_hdr_t *hdr, void *buf, int count)
+{
+	struct tpacket3_hdr *frame;
+	int ret;
+
+	if (tapcfg->busy_poll && !tapcfg->nonblocking) {
+		/* Spin before blocking in the read */
+		tapcfg_packet_engine_wait(tapcfg, -1);
+	}
+
+	frame = tapcfg_packet_engine_next(tapcfg, tapcfg->nonblocking ? 0 : -1);
+	if (!frame) {
+		return tapcfg->nonblocking ? TAPCFG_EAGAIN : -1;
+	}
+
+	ret = frame->tp_snaplen;
+	if (ret > count) {
+		/* Leave the frame in the ring for the next call */
+		taplog_log(&tapcfg->taplog, TAPLOG_ERR,
+		           "Buffer not big enough for reading, "
+		           "need at least %d bytes", ret);
+		tapcfg->rx_counters.truncated++;
+		return -1;
+	}
+
+	memcpy(buf, (char *) frame + frame->tp_mac, ret);
+	if (hdr) {
+		memset(hdr, 0, sizeof(tapcfg_vnet_hdr_t));
+	}
+	tapcfg_packet_engine_consume(tapcfg);
+
+	taplog_log(&tapcfg->taplog, TAPLOG_DEBUG, "Read ethernet frame:");
+	taplog_log_ethernet_info(&tapcfg->taplog, TAPLOG_DEBUG, buf, ret);
+
+	return ret;
+}
+
+static int
+tapcfg_packet_engine_read_batch(tapcfg_t *tapcfg, tapcfg_frame_t *frames, int nframes)
+{
+	struct tpacket3_hdr *frame;
+	int i, ret;
+
+	if (tapcfg->busy_poll && !tapcfg->nonblocking) {
+		/* Spin before blocking for the first frame */
+		tapcfg_packet_engine_wait(tapcfg, -1);
+	}
+
+	for (i=0; i<nframes; i++) {
+		/* Only the first frame is waited for */
+		frame = tapcfg_packet_engine_next(tapcfg,
+		                                  (i || tapcfg->nonblocking) ? 0 : -1);
+		if (!frame) {
+			break;
+		}
+
+		ret = frame->tp_snaplen;
+		if (ret <= frames[i].size) {
+			memcpy(frames[i].buf, (char *) frame + frame->tp_mac, ret);
+		}
+		tapcfg_packet_engine_consume(tapcfg);
+		tapcfg_complete_read(tapcfg, &frames[i], ret);
+	}
+
+	if (i == 0) {
+		return tapcfg->nonblocking ? TAPCFG_EAGAIN : -1;
+	}
+
+	return i;
+}
@@ -304,6 +304,60 @@ tapcfg_start_dev(tapcfg_t *tapcfg, const char *ifname, int fallback)
 	return tap_fd;
 }
 
+static int
+tapcfg_start_queue_dev(tapcfg_t *tapcfg, const char *ifname)
+{
+	taplog_log(&tapcfg->taplog, TAPLOG_ERR,
+	           "Multiple queues are not supported on this system");
+	return -1;
+}
+
+static int
+tapcfg_enable_queue_dev(tapcfg_t *tapcfg, int enabled)
+{
+	return -1;
+}
+
+static int
+tapcfg_attach_dev(tapcfg_t *tapcfg, const char *ifname)
+{
+	taplog_log(&tapcfg->taplog, TAPLOG_ERR,
+	           "Attaching to existing devices is not supported on this system");
+	return -1;
+}
+
+static int
+tapcfg_persist_dev(tapcfg_t *tapcfg, int persistent)
+{
+	/* The interface is unplumbed when the device is stopped */
+	if (persistent) {
+		taplog_log(&tapcfg->taplog, TAPLOG_ERR,
+		           "Persistent devices are not supported on this system");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+tapcfg_monitor_dev(tapcfg_t *tapcfg, int enabled)
+{
+	if (enabled) {
+		taplog_log(&tapcfg->taplog, TAPLOG_ERR,
+		           "Link monitoring is not supported on this platform");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+tapcfg_stats_dev(tapcfg_t *tapcfg, tapcfg_stats_t *stats)
+{
+	/* Kernel drop counters are not available on this platform */
+	return 0;
+}
+
 static void
 tapcfg_stop_dev(tapcfg_t *tapcfg)
 {
@@ -456,3 +510,13 @@ tapcfg_ifaddr_ioctl(tapcfg_t *tapcfg,
 
 	return 0;
 }
+
+static int
+tapcfg_ifaddr6_ioctl(tapcfg_t *tapcfg,
+                     const struct in6_addr *addr,
+                     unsigned char netbits)
+{
+	taplog_log(&tapcfg->taplog, TAPLOG_ERR,
+	           "Setting the IPv6 address is not supported on this platform");
+	return -1;
+}
@@ -0,0 +1,542 @@
+/**
+ *  tapcfg - A cross-platform configuration utility for TAP driver
+ *  Copyright (C) 2008-2011  Juho Vähä-Herttua
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/* Minimal io_uring support using the raw system calls, we don't want
+ * to depend on liburing just for the few operations we need here */
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+struct tapcfg_uring_s {
+	int fd;
+	unsigned entries;
+	unsigned features;
+
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned sq_local_tail;
+
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ptr;
+	size_t sq_size;
+	void *cq_ptr;
+	size_t cq_size;
+	size_t sqes_size;
+};
+typedef struct tapcfg_uring_s tapcfg_uring_t;
+
+static int
+tapcfg_uring_init(tapcfg_uring_t *ring, unsigned entries)
+{
+	struct io_uring_params p;
+
+	memset(ring, 0, sizeof(tapcfg_uring_t));
+	memset(&p, 0, sizeof(p));
+
+	ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (ring->fd < 0) {
+		ring->fd = -1;
+		return -1;
+	}
+
+	ring->entries = p.sq_entries;
+	ring->features = p.features;
+	ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+	                    MAP_SHARED | MAP_POPULATE, ring->fd,
+	                    IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == MAP_FAILED) {
+		ring->sq_ptr = NULL;
+		goto err;
+	}
+	ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+	                    MAP_SHARED | MAP_POPULATE, ring->fd,
+	                    IORING_OFF_CQ_RING);
+	if (ring->cq_ptr == MAP_FAILED) {
+		ring->cq_ptr = NULL;
+		goto err;
+	}
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+	                  MAP_SHARED | MAP_POPULATE, ring->fd,
+	                  IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		goto err;
+	}
+
+	ring->sq_head = (unsigned *) ((char *) ring->sq_ptr + p.sq_off.head);
+	ring->sq_tail = (unsigned *) ((char *) ring->sq_ptr + p.sq_off.tail);
+	ring->sq_mask = (unsigned *) ((char *) ring->sq_ptr + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned *) ((char *) ring->sq_ptr + p.sq_off.array);
+	ring->sq_local_tail = *ring->sq_tail;
+
+	ring->cq_head = (unsigned *) ((char *) ring->cq_ptr + p.cq_off.head);
+	ring->cq_tail = (unsigned *) ((char *) ring->cq_ptr + p.cq_off.tail);
+	ring->cq_mask = (unsigned *) ((char *) ring->cq_ptr + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) ((char *) ring->cq_ptr + p.cq_off.cqes);
+
+	return 0;
+
+err:
+	if (ring->sq_ptr)
+		munmap(ring->sq_ptr, ring->sq_size);
+	if (ring->cq_ptr)
+		munmap(ring->cq_ptr, ring->cq_size);
+	close(ring->fd);
+	ring->fd = -1;
+
+	return -1;
+}
+
+static void
+tapcfg_uring_destroy(tapcfg_uring_t *ring)
+{
+	if (ring->fd == -1)
+		return;
+
+	munmap(ring->sqes, ring->sqes_size);
+	munmap(ring->cq_ptr, ring->cq_size);
+	munmap(ring->sq_ptr, ring->sq_size);
+	close(ring->fd);
+	ring->fd = -1;
+}
+
+/* Get a cleared submission queue entry, NULL if the queue is full */
+static struct io_uring_sqe *
+tapcfg_uring_get_sqe(tapcfg_uring_t *ring)
+{
+	unsigned head, idx;
+	struct io_uring_sqe *sqe;
+
+	head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if (ring->sq_local_tail - head >= ring->entries)
+		return NULL;
+
+	idx = ring->sq_local_tail & *ring->sq_mask;
+	sqe = &ring->sqes[idx];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	ring->sq_array[idx] = idx;
+	ring->sq_local_tail++;
+
+	return sqe;
+}
+
+/* Submit all queued entries and wait for wait_nr completions */
+static int
+tapcfg_uring_submit(tapcfg_uring_t *ring, unsigned wait_nr)
+{
+	unsigned submit;
+	int ret;
+
+	/* The kernel may stop consuming before the end, whatever it left
+	 * in the queue has to be submitted again on the next call */
+	__atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+	submit = ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+	do {
+		ret = syscall(__NR_io_uring_enter, ring->fd, submit, wait_nr,
+		              wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while (ret == -1 && errno == EINTR);
+
+	return ret;
+}
+
+/* Get the next completion queue entry, NULL if there is none */
+static struct io_uring_cqe *
+tapcfg_uring_peek_cqe(tapcfg_uring_t *ring)
+{
+	unsigned head, tail;
+
+	head = *ring->cq_head;
+	tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	if (head == tail)
+		return NULL;
+
+	return &ring->cqes[head & *ring->cq_mask];
+}
+
+static void
+tapcfg_uring_cqe_seen(tapcfg_uring_t *ring)
+{
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/* The io_uring engine keeps a read posted into each of its slots all the
+ * time, so frames are received without any system calls per frame. The
+ * completed reads are returned to the caller in the completion order and
+ * the slots are posted again in batches the next time we need to wait. */
+
+#define TAPCFG_URING_SLOTS 64
+#define TAPCFG_URING_CANCEL ((__u64) -1)
+
+struct tapcfg_uring_engine_s {
+	tapcfg_uring_t ring;
+
+	char *buffers;
+	int slotsize;
+	int fixed;
+	struct iovec iov[TAPCFG_URING_SLOTS];
+	char inflight[TAPCFG_URING_SLOTS];
+	int unsubmitted;
+};
+typedef struct tapcfg_uring_engine_s tapcfg_uring_engine_t;
+
+static int
+tapcfg_uring_engine_post(tapcfg_t *tapcfg, int slot)
+{
+	tapcfg_uring_engine_t *engine = tapcfg->uring_engine;
+	struct io_uring_sqe *sqe;
+
+	sqe = tapcfg_uring_get_sqe(&engine->ring);
+	if (!sqe)
+		return -1;
+
+	sqe->fd = tapcfg->tap_fd;
+	if (engine->fixed) {
+		sqe->opcode = IORING_OP_READ_FIXED;
+		sqe->addr = (unsigned long) engine->iov[slot].iov_base;
+		sqe->len = engine->iov[slot].iov_len;
+		sqe->buf_index = slot;
+	} else {
+		sqe->opcode = IORING_OP_READV;
+		sqe->addr = (unsigned long) &engine->iov[slot];
+		sqe->len = 1;
+	}
+	sqe->user_data = slot;
+	engine->inflight[slot] = 1;
+	engine->unsubmitted++;
+
+	return 0;
+}
+
+static void
+tapcfg_uring_engine_free(tapcfg_uring_engine_t *engine)
+{
+	tapcfg_uring_destroy(&engine->ring);
+	free(engine->buffers);
+	free(engine);
+}
+
+static void
+tapcfg_uring_engine_stop(tapcfg_t *tapcfg)
+{
+	tapcfg_uring_engine_t *engine = tapcfg->uring_engine;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	int i, pending = 0;
+
+	if (!engine) {
+		return;
+	}
+
+	/* Cancel the posted reads and wait until all of them are finished,
+	 * otherwise the kernel could still fill buffers after freeing them */
+	for (i=0; i<TAPCFG_URING_SLOTS; i++) {
+		if (!engine->inflight[i])
+			continue;
+
+		sqe = tapcfg_uring_get_sqe(&engine->ring);
+		if (!sqe) {
+			tapcfg_uring_submit(&engine->ring, 0);
+			sqe = tapcfg_uring_get_sqe(&engine->ring);
+		}
+		if (sqe) {
+			sqe->opcode = IORING_OP_ASYNC_CANCEL;
+			sqe->addr = i;
+			sqe->user_data = TAPCFG_URING_CANCEL;
+		}
+		pending++;
+	}
+	while (pending) {
+		cqe = tapcfg_uring_peek_cqe(&engine->ring);
+		if (!cqe) {
+			if (tapcfg_uring_submit(&engine->ring, 1) == -1)
+				break;
+			continue;
+		}
+		if (cqe->user_data != TAPCFG_URING_CANCEL &&
+		    engine->inflight[cqe->user_data]) {
+			engine->inflight[cqe->user_data] = 0;
+			pending--;
+		}
+		tapcfg_uring_cqe_seen(&engine->ring);
+	}
+
+	tapcfg_uring_engine_free(engine);
+	tapcfg->uring_engine = NULL;
+}
+
+static int
+tapcfg_uring_engine_start(tapcfg_t *tapcfg)
+{
+	tapcfg_uring_engine_t *engine;
+	int i;
+
+	engine = calloc(1, sizeof(tapcfg_uring_engine_t));
+	if (!engine) {
+		return -1;
+	}
+	if (tapcfg_uring_init(&engine->ring, 2*TAPCFG_URING_SLOTS) == -1) {
+		taplog_log(&tapcfg->taplog, TAPLOG_ERR,
+		           "Error setting up io_uring: %s",
+		           strerror(errno));
+		free(engine);
+		return -1;
+	}
+
+	/* Without fast poll every posted read would block a kernel
+	 * worker thread and the frames could complete out of order */
+	if (!(engine->ring.features & IORING_FEAT_FAST_POLL)) {
+		taplog_log(&tapcfg->taplog, TAPLOG_ERR,
+		           "The io_uring engine requires Linux 5.7 or later");
+		tapcfg_uring_engine_free(engine);
+		return -1;
+	}
+
+	engine->slotsize = tapcfg->bufsize;
+	engine->buffers = malloc(TAPCFG_URING_SLOTS * engine->slotsize);
+	if (!engine->buffers) {
+		tapcfg_uring_engine_free(engine);
+		return -1;
+	}
+	for (i=0; i<TAPCFG_URING_SLOTS; i++) {
+		engine->iov[i].iov_base = engine->buffers + i * engine->slotsize;
+		engine->iov[i].iov_len = engine->slotsize;
+	}
+
+	/* Registering the buffers saves mapping them for every read, but
+	 * it pins the memory and RLIMIT_MEMLOCK might not allow that */
+	engine->fixed = (syscall(__NR_io_uring_register, engine->ring.fd,
+	                         IORING_REGISTER_BUFFERS, engine->iov,
+	                         TAPCFG_URING_SLOTS) == 0);
+	if (!engine->fixed) {
+		taplog_log(&tapcfg->taplog, TAPLOG_INFO,
+		           "Unable to register io_uring buffers: %s",
+		           strerror(errno));
+	}
+
+	tapcfg->uring_engine = engine;
+	for (i=0; i<TAPCFG_URING_SLOTS; i++) {
+		tapcfg_uring_engine_post(tapcfg, i);
+	}
+	if (tapcfg_uring_submit(&engine->ring, 0) == -1) {
+		taplog_log(&tapcfg->taplog, TAPLOG_ERR,
+		           "Error submitting reads to io_uring: %s",
+		           strerror(errno));
+		tapcfg_uring_engine_stop(tapcfg);
+		return -1;
+	}
+	engine->unsubmitted = 0;
+
+	return 0;
+}
+
+/* Get the next completed read, waiting for at most msec if there is
+ * none, negative msec waits forever. Returns NULL if nothing is ready */
+static struct io_uring_cqe *
+tapcfg_uring_engine_next(tapcfg_t *tapcfg, int msec)
+{
+	tapcfg_uring_engine_t *engine = tapcfg->uring_engine;
+	struct io_uring_cqe *cqe;
+	struct pollfd pfd;
+
+	cqe = tapcfg_uring_peek_cqe(&engine->ring);
+	if (cqe) {
+		return cqe;
+	}
+
+	/* Entering the kernel also runs the pending reads, so do it even
+	 * if there is nothing to submit and we are not going to wait */
+	if (tapcfg_uring_submit(&engine->ring, msec < 0) == -1) {
+		return NULL;
+	}
+	engine->unsubmitted = 0;
+
+	cqe = tapcfg_uring_peek_cqe(&engine->ring);
+	if (!cqe && msec > 0) {
+		pfd.fd = engine->ring.fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, msec) > 0) {
+			cqe = tapcfg_uring_peek_cqe(&engine->ring);
+		}
+	}
+
+	return cqe;
+}
+
+/* Mark the completion handled and post the slot again, the submit
+ * happens next time the completion queue is found empty */
+static void
+tapcfg_uring_engine_consume(tapcfg_t *tapcfg, struct io_uring_cqe *cqe)
+{
+	tapcfg_uring_engine_t *engine = tapcfg->uring_engine;
+	int slot = cqe->user_data;
+
+	tapcfg_uring_cqe_seen(&engine->ring);
+	engine->inflight[slot] = 0;
+	tapcfg_uring_engine_post(tapcfg, slot);
+}
+
+/* Wait for a frame to be available, using the busy poll budget first */
+static int
+tapcfg_uring_engine_wait(tapcfg_t *tapcfg, int msec)
+{
+	struct timespec start;
+
+	if (tapcfg->busy_poll && msec != 0 &&
+	    tapcfg->busy_idle < TAPCFG_BUSY_POLL_IDLE) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		do {
+			if (tapcfg_uring_engine_next(tapcfg, 0)) {
+				tapcfg->busy_hits++;
+				tapcfg->busy_idle = 0;
+				return 1;
+			}
+		} while (tapcfg_elapsed_usec(&start) < tapcfg->busy_poll &&
+		         (msec < 0 || tapcfg_elapsed_usec(&start) < msec * 1000L));
+		tapcfg->busy_misses++;
+		tapcfg->busy_idle++;
+
+		if (msec > 0) {
+			msec -= tapcfg->busy_poll / 1000;
+			if (msec < 0)
+				msec = 0;
+		}
+	}
+
+	if (!tapcfg_uring_engine_next(tapcfg, msec)) {
+		return 0;
+	}
+	tapcfg->busy_idle = 0;
+
+	return 1;
+}
+
+static int
+tapcfg_uring_engine_read(tapcfg_t *tapcfg, tapcfg_vnet_hdr_t *hdr, void *buf, int count)
+{
+	tapcfg_uring_engine_t *engine = tapcfg->uring_engine;
+	struct io_uring_cqe *cqe;
+	int hdrlen = TAPCFG_VNET_HDRLEN(tapcfg);
+	char *data;
+	int ret;
+
+	if (tapcfg->busy_poll && !tapcfg->nonblocking) {
+		/* Spin before blocking in the read */
+		tapcfg_uring_engine_wait(tapcfg, -1);
+	}
+
+	cqe = tapcfg_uring_engine_next(tapcfg, tapcfg->nonblocking ? 0 : -1);
+	if (!cqe) {
+		return tapcfg->nonblocking ? TAPCFG_EAGAIN : -1;
+	}
+
+	ret = cqe->res;
+	data = engine->iov[cqe->user_data].iov_base;
+	if (ret < hdrlen || ret <= 0) {
+		taplog_log(&tapcfg->taplog, TAPLOG_ERR,
+		           "Error reading frame with io_uring: %s",
+		           ret < 0 ? strerror(-ret) : "short read");
+		tapcfg_uring_engine_consume(tapcfg, cqe);
+		return -1;
+	}
+	ret -= hdrlen;
+
+	if (ret > count) {
+		/* Leave the frame in the queue for the next call */
+		taplog_log(&tapcfg->taplog, TAPLOG_ERR,
+		           "Buffer not big enough for reading, "
+		           "need at least %d bytes", ret);
+		tapcfg->rx_counters.truncated++;
+		return -1;
+	}
+
+	memcpy(buf, data + hdrlen, ret);
+	if (hdr) {
+		if (hdrlen) {
+			memcpy(hdr, data, sizeof(tapcfg_vnet_hdr_t));
+		} else {
+			memset(hdr, 0, sizeof(tapcfg_vnet_hdr_t));
+		}
+	}
+	tapcfg_uring_engine_consume(tapcfg, cqe);
+
+	taplog_log(&tapcfg->taplog, TAPLOG_DEBUG, "Read ethernet frame:");
+	taplog_log_ethernet_info(&tapcfg->taplog, TAPLOG_DEBUG, buf, ret);
+
+	return ret;
+}
+
+static int
+tapcfg_uring_engine_read_batch(tapcfg_t *tapcfg, tapcfg_frame_t *frames, int nframes)
+{
+	tapcfg_uring_engine_t *engine = tapcfg->uring_engine;
+	struct io_uring_cqe *cqe;
+	int hdrlen = TAPCFG_VNET_HDRLEN(tapcfg);
+	char *data;
+	int i, ret;
+
+	if (tapcfg->busy_poll && !tapcfg->nonblocking) {
+		/* Spin before blocking for the first frame */
+		tapcfg_uring_engine_wait(tapcfg, -1);
+	}
+
+	for (i=0; i<nframes; i++) {
+		/* Only the first frame is waited for */
+		cqe = tapcfg_uring_engine_next(tapcfg,
+		                               (i || tapcfg->nonblocking) ? 0 : -1);
+		if (!cqe) {
+			break;
+		}
+
+		ret = cqe->res;
+		data = engine->iov[cqe->user_data].iov_base;
+		if (ret < hdrlen || ret <= 0) {
+			taplog_log(&tapcfg->taplog, TAPLOG_ERR,
+			           "Error reading frame with io_uring: %s",
+			           ret < 0 ? strerror(-ret) : "short read");
+			tapcfg_uring_engine_consume(tapcfg, cqe);
+			return i ? i : -1;
+		}
+		ret -= hdrlen;
+
+		if (hdrlen) {
+			memcpy(&frames[i].hdr, data, sizeof(tapcfg_vnet_hdr_t));
+		}
+		if (ret <= frames[i].size) {
+			memcpy(frames[i].buf, data + hdrlen, ret);
+		}
+		tapcfg_uring_engine_consume(tapcfg, cqe);
+		tapcfg_complete_read(tapcfg, &frames[i], ret);
+	}
+
+	if (i == 0) {
+		return tapcfg->nonblocking ? TAPCFG_EAGAIN : -1;
+	}
+
+	return i;
+}
@@ -44,6 +44,9 @@
 #define TAP_WINDOWS_MIN_MAJOR               9
 #define TAP_WINDOWS_MIN_MINOR               8
 
+/* Empty busy poll spins in a row before the device is considered idle */
+#define TAPCFG_BUSY_POLL_IDLE 8
+
 typedef unsigned char MACADDR [6];
 typedef unsigned long IPADDR;
 
@@ -54,6 +57,13 @@ struct tapcfg_s {
 	char *ifname;
 	MACADDR hwaddr;
 
+	int nonblocking;
+
+	int busy_poll;
+	int busy_idle;
+	unsigned long busy_hits;
+	unsigned long busy_misses;
+
 	int reading;
 	OVERLAPPED overlapped_in;
 	OVERLAPPED overlapped_out;
@@ -88,6 +98,8 @@ tapcfg_destroy(tapcfg_t *tapcfg)
 {
 	if (tapcfg) {
 		tapcfg_stop(tapcfg);
+		tapcapture_destroy(tapcfg->capture);
+		taplog_set_async(&tapcfg->taplog, 0);
 
 		free(tapcfg->ifname);
 
@@ -211,6 +223,130 @@ tapcfg_start(tapcfg_t *tapcfg, const char *ifname, int fallback)
 	return 0;
 }
 
+int
+tapcfg_start_multiqueue(tapcfg_t *tapcfg, const char *ifname, int nqueues)
+{
+	assert(tapcfg);
+
+	/* The TAP-Win32 driver only supports a single queue */
+	if (nqueues != 1) {
+		taplog_log(&tapcfg->taplog, TAPLOG_ERR,
+		           "Multiple queues are not supported on this system");
+		return -1;
+	}
+
+	return tapcfg_start(tapcfg, ifname, 0);
+}
+
+int
+tapcfg_get_queue_count(tapcfg_t *tapcfg)
+{
+	assert(tapcfg);
+
+	return tapcfg->started ? 1 : 0;
+}
+
+tapcfg_t *
+tapcfg_get_queue(tapcfg_t *tapcfg, int index)
+{
+	assert(tapcfg);
+
+	if (!tapcfg->started || index != 0) {
+		return NULL;
+	}
+
+	return tapcfg;
+}
+
+int
+tapcfg_queue_set_enabled(tapcfg_t *queue, int enabled)
+{
+	return -1;
+}
+
+int
+tapcfg_set_offload(tapcfg_t *tapcfg, int flags)
+{
+	assert(tapcfg);
+
+	/* The TAP-Win32 driver doesn't support any offloads */
+	return (flags ? -1 : 0);
+}
+
+int
+tapcfg_attach(tapcfg_t *tapcfg, const char *ifname)
+{
+	assert(tapcfg);
+
+	if (tapcfg->started || !ifname) {
+		return -1;
+	}
+
+	/* The adapters are installed devices, so starting always attaches */
+	return tapcfg_start(tapcfg, ifname, 0);
+}
+
+int
+tapcfg_set_persistent(tapcfg_t *tapcfg, int persistent)
+{
+	assert(tapcfg);
+
+	if (!tapcfg->started) {
+		return -1;
+	}
+
+	/* The adapters stay installed after the device is closed */
+	return persistent ? 0 : -1;
+}
+
+int
+tapcfg_set_engine(tapcfg_t *tapcfg, int engine)
+{
+	assert(tapcfg);
+
+	if (tapcfg->started || engine != TAPCFG_ENGINE_DEFAULT) {
+		return -1;
+	}
+
+	return 0;
+}
+
+int
+tapcfg_set_nonblocking(tapcfg_t *tapcfg, int enabled)
+{
+	assert(tapcfg);
+
+	/* Writes complete right away, so only reads are affected */
+	tapcfg->nonblocking = !!enabled;
+
+	return 0;
+}
+
+int
+tapcfg_set_busy_poll(tapcfg_t *tapcfg, int usec)
+{
+	assert(tapcfg);
+
+	if (usec < 0) {
+		return -1;
+	}
+	tapcfg->busy_poll = usec;
+	tapcfg->busy_idle = 0;
+
+	return 0;
+}
+
+void
+tapcfg_get_busy_poll_stats(tapcfg_t *tapcfg, unsigned long *hits, unsigned long *misses)
+{
+	assert(tapcfg);
+
+	if (hits)
+		*hits = tapcfg->busy_hits;
+	if (misses)
+		*misses = tapcfg->busy_misses;
+}
+
 void
 tapcfg_stop(tapcfg_t *tapcfg)
 {
@@ -298,20 +434,77 @@ tapcfg_wait_for_data(tapcfg_t *tapcfg, DWORD timeout)
 	return ret;
 }
 
+static int
+tapcfg_busy_poll_dev(tapcfg_t *tapcfg, int msec)
+{
+	LARGE_INTEGER freq, start, now;
+	LONGLONG budget;
+
+	budget = tapcfg->busy_poll;
+	if (msec >= 0 && msec * 1000 < budget) {
+		budget = msec * 1000;
+	}
+
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&start);
+	do {
+		if (tapcfg_wait_for_data(tapcfg, 0)) {
+			tapcfg->busy_hits++;
+			tapcfg->busy_idle = 0;
+			return 1;
+		}
+		QueryPerformanceCounter(&now);
+	} while ((now.QuadPart - start.QuadPart) * 1000000 / freq.QuadPart < budget);
+
+	tapcfg->busy_misses++;
+	tapcfg->busy_idle++;
+
+	return 0;
+}
+
 int
 tapcfg_wait_readable(tapcfg_t *tapcfg, int msec)
 {
+	int ret;
+
 	assert(tapcfg);
 
 	if (!tapcfg->started) {
 		return 0;
 	}
 
-	return tapcfg_wait_for_data(tapcfg, msec);
+	if (tapcfg->busy_poll && msec != 0 &&
+	    tapcfg->busy_idle < TAPCFG_BUSY_POLL_IDLE) {
+		if (tapcfg_busy_poll_dev(tapcfg, msec)) {
+			return 1;
+		}
+		if (msec > 0) {
+			msec -= tapcfg->busy_poll / 1000;
+			if (msec < 0)
+				msec = 0;
+		}
+	}
+
+	ret = tapcfg_wait_for_data(tapcfg, msec < 0 ? INFINITE : msec);
+	if (ret) {
+		tapcfg->busy_idle = 0;
+	}
+
+	return ret;
 }
 
-int
-tapcfg_read(tapcfg_t *tapcfg, void *buf, int count)
+static long
+tapcfg_elapsed_usec(const LARGE_INTEGER *start)
+{
+	LARGE_INTEGER freq, now;
+
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (long) ((now.QuadPart - start->QuadPart) * 1000000 / freq.QuadPart);
+}
+
+static int
+tapcfg_read_dev(tapcfg_t *tapcfg, void *buf, int count)
 {
 	int ret;
 
@@ -321,7 +514,15 @@ tapcfg_read(tapcfg_t *tapcfg, void *buf, int count)
 		return -1;
 	}
 
-	if (!tapcfg_wait_for_data(tapcfg, INFINITE)) {
+	if (tapcfg->busy_poll && !tapcfg->nonblocking) {
+		/* Spin before blocking in the read */
+		tapcfg_wait_readable(tapcfg, -1);
+	}
+
+	if (!tapcfg_wait_for_data(tapcfg, tapcfg->nonblocking ? 0 : INFINITE)) {
+		if (tapcfg->nonblocking) {
+			return TAPCFG_EAGAIN;
+		}
 		taplog_log(&tapcfg->taplog, TAPLOG_ERR,
 		           "Error waiting for data in read function");
 		return -1;
@@ -332,6 +533,7 @@ tapcfg_read(tapcfg_t *tapcfg, void *buf, int count)
 		           "Buffer not big enough for reading, "
 		           "need at least %d bytes",
 		           tapcfg->inbuflen);
+		tapcfg->rx_counters.truncated++;
 		return -1;
 	}
 
@@ -358,7 +560,29 @@ tapcfg_wait_writable(tapcfg_t *tapcfg, int msec)
 }
 
 int
-tapcfg_write(tapcfg_t *tapcfg, void *buf, int count)
+tapcfg_read(tapcfg_t *tapcfg, void *buf, int count)
+{
+	LARGE_INTEGER start;
+	int ret;
+
+	assert(tapcfg);
+
+	QueryPerformanceCounter(&start);
+	ret = tapcfg_read_dev(tapcfg, buf, count);
+	if (ret > 0) {
+		tapcfg->rx_counters.frames++;
+		tapcfg->rx_counters.bytes += ret;
+		if (tapcfg->capture) {
+			tapcapture_frame(tapcfg->capture, TAPCAPTURE_OUTBOUND, buf, ret);
+		}
+	}
+	tapcfg_count_call(&tapcfg->rx_counters, ret, tapcfg_elapsed_usec(&start));
+
+	return ret;
+}
+
+static int
+tapcfg_write_dev(tapcfg_t *tapcfg, void *buf, int count)
 {
 	DWORD retval, len;
 
@@ -399,6 +623,295 @@ tapcfg_write(tapcfg_t *tapcfg, void *buf, int count)
 	return len;
 }
 
+int
+tapcfg_write(tapcfg_t *tapcfg, void *buf, int count)
+{
+	LARGE_INTEGER start;
+	int ret;
+
+	assert(tapcfg);
+
+	QueryPerformanceCounter(&start);
+	ret = tapcfg_write_dev(tapcfg, buf, count);
+	if (ret > 0) {
+		tapcfg->tx_counters.frames++;
+		tapcfg->tx_counters.bytes += ret;
+		if (tapcfg->capture) {
+			tapcapture_frame(tapcfg->capture, TAPCAPTURE_INBOUND, buf, ret);
+		}
+	}
+	tapcfg_count_call(&tapcfg->tx_counters, ret, tapcfg_elapsed_usec(&start));
+
+	return ret;
+}
+
+int
+tapcfg_read_vnet(tapcfg_t *tapcfg, tapcfg_vnet_hdr_t *hdr, void *buf, int count)
+{
+	/* Offloads are not supported, the header is always empty */
+	if (hdr) {
+		memset(hdr, 0, sizeof(tapcfg_vnet_hdr_t));
+	}
+
+	return tapcfg_read(tapcfg, buf, count);
+}
+
+int
+tapcfg_write_vnet(tapcfg_t *tapcfg, const tapcfg_vnet_hdr_t *hdr, void *buf, int count)
+{
+	return tapcfg_write(tapcfg, buf, count);
+}
+
+int
+tapcfg_read_batch(tapcfg_t *tapcfg, tapcfg_frame_t *frames, int nframes)
+{
+	int i, ret;
+
+	assert(tapcfg);
+	assert(frames || !nframes);
+
+	if (!tapcfg->started) {
+		return -1;
+	}
+
+	/* There is no batching support in the TAP-Win32 driver, so we
+	 * simply read all the frames that are already available */
+	for (i=0; i<nframes; i++) {
+		if (i > 0 && !tapcfg_wait_for_data(tapcfg, 0)) {
+			break;
+		}
+
+		ret = tapcfg_read(tapcfg, frames[i].buf, frames[i].size);
+		if (ret < 0 && tapcfg->inbuflen) {
+			/* Frame didn't fit into the buffer, drop it */
+			frames[i].len = tapcfg->inbuflen;
+			frames[i].status = -1;
+			tapcfg->inbuflen = 0;
+			continue;
+		} else if (ret <= 0) {
+			return i ? i : (ret == TAPCFG_EAGAIN ? ret : -1);
+		}
+		memset(&frames[i].hdr, 0, sizeof(tapcfg_vnet_hdr_t));
+		frames[i].len = ret;
+		frames[i].status = 0;
+	}
+
+	return i;
+}
+
+int
+tapcfg_write_batch(tapcfg_t *tapcfg, tapcfg_frame_t *frames, int nframes)
+{
+	int i, ret, count = 0;
+
+	assert(tapcfg);
+	assert(frames || !nframes);
+
+	if (!tapcfg->started) {
+		return -1;
+	}
+
+	for (i=0; i<nframes; i++) {
+		ret = tapcfg_write(tapcfg, frames[i].buf, frames[i].len);
+		frames[i].status = (ret == frames[i].len) ? 0 : -1;
+		if (!frames[i].status)
+			count++;
+	}
+
+	return count;
+}
+
+int
+tapcfg_get_stats(tapcfg_t *tapcfg, tapcfg_stats_t *stats)
+{
+	assert(tapcfg);
+	assert(stats);
+
+	/* The TAP-Win32 driver doesn't report its drops */
+	memset(stats, 0, sizeof(tapcfg_stats_t));
+	tapcfg_add_counters(stats, &tapcfg->rx_counters, &tapcfg->tx_counters);
+
+	return 0;
+}
+
+struct tapcfg_poller_entry_s {
+	tapcfg_t *tapcfg;
+	int events;
+	void *data;
+};
+typedef struct tapcfg_poller_entry_s tapcfg_poller_entry_t;
+
+struct tapcfg_poller_s {
+	tapcfg_poller_entry_t *entries;
+	int nentries;
+	int maxentries;
+};
+
+tapcfg_poller_t *
+tapcfg_poller_init()
+{
+	return calloc(1, sizeof(tapcfg_poller_t));
+}
+
+void
+tapcfg_poller_destroy(tapcfg_poller_t *poller)
+{
+	if (poller) {
+		free(poller->entries);
+	}
+	free(poller);
+}
+
+static int
+tapcfg_poller_find(tapcfg_poller_t *poller, tapcfg_t *tapcfg)
+{
+	int i;
+
+	for (i=0; i<poller->nentries; i++) {
+		if (poller->entries[i].tapcfg == tapcfg) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+int
+tapcfg_poller_add(tapcfg_poller_t *poller, tapcfg_t *tapcfg, int events, void *data)
+{
+	assert(poller);
+	assert(tapcfg);
+
+	if (!tapcfg->started || tapcfg_poller_find(poller, tapcfg) >= 0) {
+		return -1;
+	}
+
+	if (poller->nentries == poller->maxentries) {
+		tapcfg_poller_entry_t *entries;
+		int maxentries;
+
+		maxentries = poller->maxentries ? poller->maxentries * 2 : 16;
+		entries = realloc(poller->entries,
+		                  maxentries * sizeof(tapcfg_poller_entry_t));
+		if (!entries) {
+			return -1;
+		}
+		poller->entries = entries;
+		poller->maxentries = maxentries;
+	}
+
+	poller->entries[poller->nentries].tapcfg = tapcfg;
+	poller->entries[poller->nentries].events = events;
+	poller->entries[poller->nentries].data = data;
+	poller->nentries++;
+
+	return 0;
+}
+
+int
+tapcfg_poller_modify(tapcfg_poller_t *poller, tapcfg_t *tapcfg, int events, void *data)
+{
+	int idx;
+
+	assert(poller);
+	assert(tapcfg);
+
+	idx = tapcfg_poller_find(poller, tapcfg);
+	if (idx < 0) {
+		return -1;
+	}
+	poller->entries[idx].events = events;
+	poller->entries[idx].data = data;
+
+	return 0;
+}
+
+int
+tapcfg_poller_remove(tapcfg_poller_t *poller, tapcfg_t *tapcfg)
+{
+	int idx;
+
+	assert(poller);
+	assert(tapcfg);
+
+	idx = tapcfg_poller_find(poller, tapcfg);
+	if (idx < 0) {
+		return -1;
+	}
+	poller->entries[idx] = poller->entries[--poller->nentries];
+
+	return 0;
+}
+
+static int
+tapcfg_poller_collect(tapcfg_poller_t *poller, tapcfg_poll_event_t *events, int maxevents)
+{
+	int i, count = 0;
+
+	for (i=0; i<poller->nentries && count<maxevents; i++) {
+		tapcfg_poller_entry_t *entry = &poller->entries[i];
+		int ready = 0;
+
+		/* Writes are always possible, reads start an overlapped read */
+		if ((entry->events & TAPCFG_POLL_READABLE) &&
+		    tapcfg_wait_for_data(entry->tapcfg, 0))
+			ready |= TAPCFG_POLL_READABLE;
+		if (entry->events & TAPCFG_POLL_WRITABLE)
+			ready |= TAPCFG_POLL_WRITABLE;
+		if (!ready)
+			continue;
+
+		events[count].tapcfg = entry->tapcfg;
+		events[count].events = ready;
+		events[count].data = entry->data;
+		count++;
+	}
+
+	return count;
+}
+
+int
+tapcfg_poller_wait(tapcfg_poller_t *poller, tapcfg_poll_event_t *events, int maxevents, int msec)
+{
+	HANDLE handles[MAXIMUM_WAIT_OBJECTS];
+	DWORD nhandles = 0;
+	int i, count;
+
+	assert(poller);
+	assert(events || maxevents <= 0);
+
+	if (maxevents <= 0) {
+		return -1;
+	}
+
+	count = tapcfg_poller_collect(poller, events, maxevents);
+	if (count || !msec) {
+		return count;
+	}
+
+	/* Wait for any of the pending overlapped reads to finish */
+	for (i=0; i<poller->nentries && nhandles<MAXIMUM_WAIT_OBJECTS; i++) {
+		if (poller->entries[i].tapcfg->reading) {
+			handles[nhandles++] =
+				poller->entries[i].tapcfg->overlapped_in.hEvent;
+		}
+	}
+	if (nhandles) {
+		DWORD retval;
+
+		retval = WaitForMultipleObjects(nhandles, handles, FALSE,
+		                                msec < 0 ? INFINITE : msec);
+		if (retval < WAIT_OBJECT_0 + nhandles) {
+			/* The events are auto-reset, signal it again for collecting */
+			SetEvent(handles[retval - WAIT_OBJECT_0]);
+		}
+	} else {
+		Sleep(msec < 0 ? INFINITE : msec);
+	}
+
+	return tapcfg_poller_collect(poller, events, maxevents);
+}
+
 char *
 tapcfg_get_ifname(tapcfg_t *tapcfg)
 {
@@ -522,6 +1035,16 @@ tapcfg_iface_set_mtu(tapcfg_t *tapcfg, int mtu)
 	return -1;
 }
 
+int
+tapcfg_iface_get_ipv4(tapcfg_t *tapcfg, char *addrstr, int addrlen, unsigned char *netbits)
+{
+	assert(tapcfg);
+
+	/* The address is handed out by the driver with DHCP and the
+	 * driver has no way to query the current configuration */
+	return -1;
+}
+
 int
 tapcfg_iface_set_ipv4(tapcfg_t *tapcfg, const char *addrstr, unsigned char netbits)
 {
@@ -632,6 +1155,109 @@ tapcfg_iface_set_ipv6(tapcfg_t *tapcfg, const char *addrstr, unsigned char netbi
 #endif
 }
 
+int
+tapcfg_iface_configure(tapcfg_t *tapcfg, const tapcfg_iface_config_t *config)
+{
+	assert(tapcfg);
+	assert(config);
+
+	if (!tapcfg->started) {
+		return -1;
+	}
+
+	/* The driver has no batching interface, apply one at a time */
+	if ((config->fields & TAPCFG_CONFIG_HWADDR) &&
+	    tapcfg_iface_set_hwaddr(tapcfg, config->hwaddr, 6) < 0) {
+		return -1;
+	}
+	if ((config->fields & TAPCFG_CONFIG_MTU) &&
+	    tapcfg_iface_set_mtu(tapcfg, config->mtu) < 0) {
+		return -1;
+	}
+	if ((config->fields & TAPCFG_CONFIG_IPV4) &&
+	    tapcfg_iface_set_ipv4(tapcfg, config->ipv4, config->ipv4_netbits) < 0) {
+		return -1;
+	}
+	if ((config->fields & TAPCFG_CONFIG_IPV6) &&
+	    tapcfg_iface_set_ipv6(tapcfg, config->ipv6, config->ipv6_netbits) < 0) {
+		return -1;
+	}
+	if ((config->fields & TAPCFG_CONFIG_STATUS) &&
+	    tapcfg_iface_set_status(tapcfg, config->status) < 0) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/* The driver calls are synchronous, so there is nothing to pipeline */
+struct tapcfg_async_s {
+	int pending;
+};
+
+tapcfg_async_t *
+tapcfg_async_init()
+{
+	return calloc(1, sizeof(tapcfg_async_t));
+}
+
+void
+tapcfg_async_destroy(tapcfg_async_t *async)
+{
+	free(async);
+}
+
+int
+tapcfg_async_get_fd(tapcfg_async_t *async)
+{
+	return -1;
+}
+
+int
+tapcfg_async_pending(tapcfg_async_t *async)
+{
+	assert(async);
+
+	return async->pending;
+}
+
+int
+tapcfg_async_process(tapcfg_async_t *async)
+{
+	assert(async);
+
+	return 0;
+}
+
+int
+tapcfg_iface_configure_async(tapcfg_async_t *async, tapcfg_t *tapcfg,
+                             const tapcfg_iface_config_t *config,
+                             tapcfg_async_callback_t callback, void *data)
+{
+	int ret;
+
+	assert(async);
+	assert(tapcfg);
+	assert(config);
+
+	ret = tapcfg_iface_configure(tapcfg, config);
+	if (callback) {
+		callback(tapcfg, ret, data);
+	}
+
+	return 0;
+}
+
+int
+tapcfg_set_link_monitor(tapcfg_t *tapcfg, int enabled,
+                        tapcfg_link_callback_t callback, void *data)
+{
+	assert(tapcfg);
+
+	/* Not supported on Windows, the status is known locally anyway */
+	return enabled ? -1 : 0;
+}
+
 int
 tapcfg_iface_set_dhcp_options(tapcfg_t *tapcfg, unsigned char *buffer, int buflen)
 {
@@ -16,22 +16,125 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <string.h>
 #include <assert.h>
 
 #if defined(_WIN32) || defined(_WIN64)
 #  include <windows.h>
+#else
+#  include <time.h>
 #endif
 
 #include "tapcfg.h"
 #include "taplog.h"
+#include "tapthread.h"
+
+#define TAPLOG_BUFSIZE 4096
+
+/* Entries in the ring of queued messages, has to be a power of two */
+#define TAPLOG_ASYNC_ENTRIES 1024
+
+/* Time the thread lets messages pile up after a wakeup, this keeps
+ * the number of wakeups low when messages are logged continuously */
+#define TAPLOG_ASYNC_DELAY 1
+#define TAPLOG_ASYNC_MAXARGS 12
+#define TAPLOG_ASYNC_STRSIZE 256
+
+/* Callbacks whose dropped messages are counted separately, drops of
+ * any further ones are reported to the standard error */
+#define TAPLOG_ASYNC_DROPSLOTS 8
+
+/* Summaries of suppressed messages are checked for at most this often
+ * and the logging thread polls for them while there are any pending */
+#define TAPLOG_FLUSH_INTERVAL 100
+#define TAPLOG_FLUSH_POLL 10
+#define TAPLOG_FLUSH_BATCH 16
+
+typedef union taplog_arg_u {
+	long long i;
+	double d;
+	void *p;
+} taplog_arg_t;
+
+/* A queued message keeps the format string and the raw arguments,
+ * strings are copied because they may not live until formatting */
+typedef struct taplog_entry_s {
+	volatile unsigned long seq;
+	int level;
+	taplog_callback_t callback;
+
+	/* NULL if the message didn't fit and was formatted already, into
+	 * the strings or into text if it was too long for them */
+	const char *fmt;
+	taplog_arg_t args[TAPLOG_ASYNC_MAXARGS];
+	char strings[TAPLOG_ASYNC_STRSIZE];
+	char *text;
+} taplog_entry_t;
+
+/* Messages dropped while the queue was full, counted per callback
+ * so that the warning goes where the messages would have gone */
+typedef struct taplog_drop_s {
+	taplog_callback_t callback;
+	long count;
+} taplog_drop_t;
+
+/* Bounded ring where any thread can queue messages without locking,
+ * each entry has a sequence number telling whose turn it is to use it */
+typedef struct taplog_async_s {
+	taplog_entry_t entries[TAPLOG_ASYNC_ENTRIES];
+
+	/* Written by the producers and the thread, on separate lines */
+	volatile unsigned long head;
+	char pad1[64];
+	unsigned long tail;
+	volatile long sleeping;
+	char pad2[64];
+
+	/* Protected by the mutex, only touched when the queue is full */
+	taplog_drop_t drops[TAPLOG_ASYNC_DROPSLOTS];
+	int ndrops;
+
+	int running;
+	thread_handle_t thread;
+	mutex_handle_t mutex;
+	cond_handle_t wakeup;
+} taplog_async_t;
+
+/* Shared by all the handles logging asynchronously, the lock is
+ * only taken when the mode of some handle is changed */
+static taplog_async_t *volatile taplog_async;
+static int taplog_async_users;
+static volatile long taplog_async_lock;
+
+/* Call sites with suppressed messages whose summary is not logged */
+static taplog_site_t *volatile taplog_sites;
+static volatile long taplog_sites_lock;
+static volatile unsigned long taplog_sites_checked;
+
+static void taplog_output(taplog_callback_t callback, int level, char *buffer);
+
+/* Conversion specification of a format string, without the % sign */
+typedef struct taplog_spec_s {
+	int len;
+	int stars;
+	char length;
+	char conv;
+} taplog_spec_t;
 
 void
 taplog_init(taplog_t *taplog)
 {
+	int i;
+
 	assert(taplog);
 
 	taplog->level = TAPLOG_INFO;
 	taplog->callback = NULL;
+	for (i=0; i<TAPLOG_LEVELS; i++) {
+		taplog->rate[i] = 0;
+		taplog->burst[i] = 0;
+	}
+	taplog->async = 0;
 }
 
 void
@@ -50,6 +153,177 @@ taplog_set_callback(taplog_t *taplog, taplog_callback_t callback)
 	taplog->callback = callback;
 }
 
+int
+taplog_set_rate_limit(taplog_t *taplog, int level, int rate, int burst)
+{
+	assert(taplog);
+
+	if (level < 0 || level >= TAPLOG_LEVELS || rate < 0) {
+		return -1;
+	}
+
+	taplog->burst[level] = (burst > 0) ? burst : 1;
+	taplog->rate[level] = rate;
+
+	return 0;
+}
+
+static unsigned long
+taplog_msec()
+{
+#if defined(_WIN32) || defined(_WIN64)
+	return GetTickCount();
+#else
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000UL + now.tv_nsec / 1000000;
+#endif
+}
+
+static void
+taplog_list_site(taplog_site_t *site)
+{
+	while (ATOMIC_CAS(&taplog_sites_lock, 0, 1) != 0) {
+		THREAD_YIELD();
+	}
+
+	site->next = taplog_sites;
+	taplog_sites = site;
+
+	MEMORY_BARRIER();
+	taplog_sites_lock = 0;
+}
+
+/* Log the summaries of the sites whose bucket has refilled since, the
+ * messages are logged without holding any of the locks */
+static void
+taplog_flush_sites(unsigned long now)
+{
+	taplog_callback_t callbacks[TAPLOG_FLUSH_BATCH];
+	int levels[TAPLOG_FLUSH_BATCH];
+	unsigned long counts[TAPLOG_FLUSH_BATCH];
+	taplog_site_t *site, *volatile *prev;
+	char buffer[128];
+	int count = 0, i;
+
+	if ((long) (now - taplog_sites_checked) < TAPLOG_FLUSH_INTERVAL) {
+		return;
+	}
+
+	/* Someone else is flushing or listing a site, try again later */
+	if (ATOMIC_CAS(&taplog_sites_lock, 0, 1) != 0) {
+		return;
+	}
+	taplog_sites_checked = now;
+
+	prev = &taplog_sites;
+	while ((site = *prev) != NULL && count < TAPLOG_FLUSH_BATCH) {
+		while (ATOMIC_CAS(&site->lock, 0, 1) != 0) {
+			THREAD_YIELD();
+		}
+
+		/* Summarized already if a message got through meanwhile */
+		if (!site->suppressed || (long) (now - site->due) >= 0) {
+			if (site->suppressed) {
+				callbacks[count] = site->callback;
+				levels[count] = site->level;
+				counts[count++] = site->suppressed;
+			}
+			site->suppressed = 0;
+			site->listed = 0;
+			*prev = site->next;
+		} else {
+			prev = &site->next;
+		}
+
+		MEMORY_BARRIER();
+		site->lock = 0;
+	}
+	if (site) {
+		/* Rest of the sites are checked on the next round */
+		taplog_sites_checked = now - TAPLOG_FLUSH_INTERVAL;
+	}
+
+	MEMORY_BARRIER();
+	taplog_sites_lock = 0;
+
+	/* Output directly, the logging thread may be gone if the handle
+	 * doesn't log asynchronously anymore */
+	for (i=0; i<count; i++) {
+		snprintf(buffer, sizeof(buffer),
+		         "Suppressed %lu messages like the previous one",
+		         counts[i]);
+		taplog_output(callbacks[i], levels[i], buffer);
+	}
+}
+
+int
+taplog_check_rate(taplog_t *taplog, int level, taplog_site_t *site)
+{
+	unsigned long now, elapsed, limit;
+	unsigned long suppressed = 0;
+	int rate, allowed = 0, list = 0;
+
+	rate = taplog->rate[level];
+	limit = taplog->burst[level] * 1000UL;
+	if (!rate) {
+		/* The limit was removed after the check */
+		return 1;
+	}
+	now = taplog_msec();
+
+	while (ATOMIC_CAS(&site->lock, 0, 1) != 0) {
+		THREAD_YIELD();
+	}
+
+	/* Refill the bucket with rate tokens per second */
+	elapsed = now - site->last;
+	if (!site->started || elapsed >= limit / rate + 1) {
+		site->tokens = limit;
+		site->started = 1;
+	} else {
+		site->tokens += elapsed * rate;
+		if (site->tokens > limit)
+			site->tokens = limit;
+	}
+	site->last = now;
+
+	if (site->tokens >= 1000) {
+		site->tokens -= 1000;
+		suppressed = site->suppressed;
+		site->suppressed = 0;
+		allowed = 1;
+	} else {
+		site->suppressed++;
+
+		/* Summary is due when the next message would get through */
+		site->due = now + (1000 - site->tokens + rate - 1) / rate;
+		site->level = level;
+		site->callback = taplog->callback;
+		if (!site->listed) {
+			site->listed = 1;
+			list = 1;
+		}
+	}
+
+	MEMORY_BARRIER();
+	site->lock = 0;
+
+	if (list) {
+		taplog_list_site(site);
+	}
+	if (suppressed) {
+		taplog_log_message(taplog, level,
+		                   "Suppressed %lu messages like the following one",
+		                   suppressed);
+	} else if (taplog_sites) {
+		taplog_flush_sites(now);
+	}
+
+	return allowed;
+}
+
 char *
 taplog_utf8_to_local(const char *str)
 {
@@ -80,22 +354,11 @@ taplog_utf8_to_local(const char *str)
 	return ret;
 }
 
-void
-taplog_log(taplog_t *taplog, int level, const char *fmt, ...)
+static void
+taplog_output(taplog_callback_t callback, int level, char *buffer)
 {
-	char buffer[4096];
-	va_list ap;
-
-	if (level > taplog->level)
-		return;
-
-	buffer[sizeof(buffer)-1] = '\0';
-	va_start(ap, fmt);
-	vsnprintf(buffer, sizeof(buffer)-1, fmt, ap);
-	va_end(ap);
-
-	if (taplog->callback) {
-		taplog->callback(level, buffer);
+	if (callback) {
+		callback(level, buffer);
 	} else {
 		char *local = taplog_utf8_to_local(buffer);
 
@@ -108,25 +371,477 @@ taplog_log(taplog_t *taplog, int level, const char *fmt, ...)
 	}
 }
 
+/* Parse a conversion specification, returns -1 if it's something
+ * that can't be queued and has to be formatted right away */
+static int
+taplog_parse_spec(const char *fmt, taplog_spec_t *spec)
+{
+	const char *p = fmt;
+
+	spec->stars = 0;
+	spec->length = 0;
+
+	p += strspn(p, "-+ #0");
+	if (*p == '*') {
+		spec->stars++;
+		p++;
+	} else {
+		p += strspn(p, "0123456789");
+	}
+	if (*p == '.') {
+		p++;
+		if (*p == '*') {
+			spec->stars++;
+			p++;
+		} else {
+			p += strspn(p, "0123456789");
+		}
+	}
+
+	if (*p == 'h' || *p == 'l') {
+		spec->length = *p++;
+		if (*p == spec->length) {
+			spec->length = (*p == 'h') ? 'H' : 'L';
+			p++;
+		}
+	} else if (*p == 'z') {
+		spec->length = *p++;
+	}
+
+	spec->conv = *p++;
+	spec->len = p - fmt;
+	switch (spec->conv) {
+	case 'd': case 'i': case 'u': case 'o': case 'x': case 'X':
+		return 0;
+	case 'c': case 's': case 'p':
+	case 'e': case 'E': case 'f': case 'F': case 'g': case 'G':
+		return spec->length ? -1 : 0;
+	default:
+		return -1;
+	}
+}
+
+/* Store the arguments of the message into the entry, returns -1 if
+ * the format is not supported or the arguments don't fit the entry */
+static int
+taplog_async_capture(taplog_entry_t *entry, const char *fmt, va_list ap)
+{
+	taplog_spec_t spec;
+	const char *p, *str;
+	int nargs = 0, strpos = 0;
+	int i, len;
+
+	for (p=fmt; *p; p++) {
+		if (*p != '%') {
+			continue;
+		} else if (*++p == '%') {
+			continue;
+		}
+
+		if (taplog_parse_spec(p, &spec) == -1 ||
+		    nargs + spec.stars + 1 > TAPLOG_ASYNC_MAXARGS) {
+			return -1;
+		}
+		p += spec.len - 1;
+
+		for (i=0; i<spec.stars; i++) {
+			entry->args[nargs++].i = va_arg(ap, int);
+		}
+
+		switch (spec.conv) {
+		case 's':
+			str = va_arg(ap, const char *);
+			if (!str) {
+				str = "(null)";
+			}
+			len = strlen(str);
+			if (strpos + len + 1 > TAPLOG_ASYNC_STRSIZE) {
+				return -1;
+			}
+			memcpy(entry->strings + strpos, str, len + 1);
+			entry->args[nargs++].i = strpos;
+			strpos += len + 1;
+			break;
+		case 'p':
+			entry->args[nargs++].p = va_arg(ap, void *);
+			break;
+		case 'e': case 'E': case 'f': case 'F': case 'g': case 'G':
+			entry->args[nargs++].d = va_arg(ap, double);
+			break;
+		default:
+			if (spec.length == 'l') {
+				entry->args[nargs++].i = va_arg(ap, long);
+			} else if (spec.length == 'L') {
+				entry->args[nargs++].i = va_arg(ap, long long);
+			} else if (spec.length == 'z') {
+				entry->args[nargs++].i = va_arg(ap, size_t);
+			} else {
+				entry->args[nargs++].i = va_arg(ap, int);
+			}
+			break;
+		}
+	}
+	entry->fmt = fmt;
+
+	return 0;
+}
+
+/* Format a queued message on the logging thread */
+static void
+taplog_async_format(taplog_entry_t *entry, char *buffer, int size)
+{
+	taplog_spec_t spec;
+	taplog_arg_t *arg = entry->args;
+	const char *p;
+	char specbuf[64];
+	int pos = 0, speclen, i, ret;
+
+	for (p=entry->fmt; *p && pos < size-1; p++) {
+		if (*p != '%' || *(p+1) == '%') {
+			buffer[pos++] = *p;
+			if (*p == '%')
+				p++;
+			continue;
+		}
+		p++;
+
+		/* Parsed already when queued, so it is known to be valid */
+		taplog_parse_spec(p, &spec);
+
+		/* Widths and precisions given as arguments are inlined */
+		speclen = 0;
+		specbuf[speclen++] = '%';
+		for (i=0; i<spec.len && speclen < sizeof(specbuf) - 16; i++) {
+			if (p[i] == '*') {
+				speclen += sprintf(specbuf + speclen, "%d", (int) (arg++)->i);
+			} else {
+				specbuf[speclen++] = p[i];
+			}
+		}
+		specbuf[speclen] = '\0';
+		p += spec.len - 1;
+
+		switch (spec.conv) {
+		case 's':
+			ret = snprintf(buffer + pos, size - pos, specbuf,
+			               entry->strings + arg->i);
+			break;
+		case 'p':
+			ret = snprintf(buffer + pos, size - pos, specbuf, arg->p);
+			break;
+		case 'e': case 'E': case 'f': case 'F': case 'g': case 'G':
+			ret = snprintf(buffer + pos, size - pos, specbuf, arg->d);
+			break;
+		default:
+			if (spec.length == 'l') {
+				ret = snprintf(buffer + pos, size - pos, specbuf, (long) arg->i);
+			} else if (spec.length == 'L') {
+				ret = snprintf(buffer + pos, size - pos, specbuf, arg->i);
+			} else if (spec.length == 'z') {
+				ret = snprintf(buffer + pos, size - pos, specbuf, (size_t) arg->i);
+			} else {
+				ret = snprintf(buffer + pos, size - pos, specbuf, (int) arg->i);
+			}
+			break;
+		}
+		arg++;
+
+		if (ret > 0) {
+			pos += ret;
+		}
+		if (pos > size-1) {
+			pos = size-1;
+		}
+	}
+	buffer[pos] = '\0';
+}
+
+static THREAD_RETVAL
+taplog_async_thread(void *arg)
+{
+	taplog_async_t *async = arg;
+	taplog_drop_t drops[TAPLOG_ASYNC_DROPSLOTS];
+	taplog_callback_t callback;
+	taplog_entry_t *entry;
+	char buffer[TAPLOG_BUFSIZE];
+	int ndrops, level, i;
+
+	while (1) {
+		entry = &async->entries[async->tail & (TAPLOG_ASYNC_ENTRIES-1)];
+		if (entry->seq == async->tail + 1) {
+			MEMORY_BARRIER();
+			level = entry->level;
+			callback = entry->callback;
+			if (entry->fmt) {
+				taplog_async_format(entry, buffer, sizeof(buffer));
+			} else if (entry->text) {
+				strcpy(buffer, entry->text);
+				free(entry->text);
+				entry->text = NULL;
+			} else {
+				strcpy(buffer, entry->strings);
+			}
+
+			/* Hand the entry back to the producers */
+			MEMORY_BARRIER();
+			entry->seq = async->tail + TAPLOG_ASYNC_ENTRIES;
+			async->tail++;
+
+			taplog_output(callback, level, buffer);
+			continue;
+		}
+
+		MUTEX_LOCK(async->mutex);
+		ndrops = async->ndrops;
+		if (ndrops) {
+			memcpy(drops, async->drops, ndrops * sizeof(taplog_drop_t));
+			async->ndrops = 0;
+			MUTEX_UNLOCK(async->mutex);
+
+			for (i=0; i<ndrops; i++) {
+				snprintf(buffer, sizeof(buffer),
+				         "Log queue was full, %ld messages dropped",
+				         drops[i].count);
+				taplog_output(drops[i].callback, TAPLOG_WARNING, buffer);
+			}
+			continue;
+		}
+
+		/* Queue is empty, sleep unless there is a new message
+		 * that was added after the check above */
+		if (!async->running) {
+			MUTEX_UNLOCK(async->mutex);
+			break;
+		}
+		async->sleeping = 1;
+		MEMORY_BARRIER();
+		if (entry->seq != async->tail + 1 && !taplog_sites) {
+			COND_WAIT(async->wakeup, async->mutex);
+		}
+		async->sleeping = 0;
+		MUTEX_UNLOCK(async->mutex);
+
+		if (taplog_sites) {
+			/* Summaries are due even if nothing is logged anymore */
+			taplog_flush_sites(taplog_msec());
+			THREAD_SLEEP(TAPLOG_FLUSH_POLL);
+		} else {
+			THREAD_SLEEP(TAPLOG_ASYNC_DELAY);
+		}
+	}
+
+	return 0;
+}
+
+static taplog_async_t *
+taplog_async_start()
+{
+	taplog_async_t *async;
+	unsigned long i;
+
+	async = calloc(1, sizeof(taplog_async_t));
+	if (!async) {
+		return NULL;
+	}
+	for (i=0; i<TAPLOG_ASYNC_ENTRIES; i++) {
+		async->entries[i].seq = i;
+	}
+
+	MUTEX_CREATE(async->mutex);
+	COND_CREATE(async->wakeup);
+
+	async->running = 1;
+	THREAD_CREATE(async->thread, taplog_async_thread, async);
+	if (!async->thread) {
+		COND_DESTROY(async->wakeup);
+		MUTEX_DESTROY(async->mutex);
+		free(async);
+		return NULL;
+	}
+
+	return async;
+}
+
+static void
+taplog_async_stop(taplog_async_t *async)
+{
+	/* The thread empties the queue before exiting */
+	MUTEX_LOCK(async->mutex);
+	async->running = 0;
+	COND_SIGNAL(async->wakeup);
+	MUTEX_UNLOCK(async->mutex);
+	THREAD_JOIN(async->thread);
+
+	COND_DESTROY(async->wakeup);
+	MUTEX_DESTROY(async->mutex);
+	free(async);
+}
+
+int
+taplog_set_async(taplog_t *taplog, int enabled)
+{
+	taplog_async_t *async = NULL;
+
+	assert(taplog);
+
+	enabled = enabled ? 1 : 0;
+	while (ATOMIC_CAS(&taplog_async_lock, 0, 1) != 0) {
+		THREAD_YIELD();
+	}
+
+	if (enabled != taplog->async) {
+		if (enabled && !taplog_async) {
+			taplog_async = taplog_async_start();
+		}
+		if (enabled && taplog_async) {
+			taplog_async_users++;
+			taplog->async = 1;
+		} else if (!enabled && !--taplog_async_users) {
+			/* Last user gone, stop the thread outside the lock */
+			async = taplog_async;
+			taplog_async = NULL;
+		}
+		if (!enabled) {
+			taplog->async = 0;
+		}
+	}
+
+	MEMORY_BARRIER();
+	taplog_async_lock = 0;
+
+	if (async) {
+		taplog_async_stop(async);
+	}
+
+	return (enabled && !taplog->async) ? -1 : 0;
+}
+
+static void
+taplog_async_drop(taplog_async_t *async, taplog_callback_t callback)
+{
+	int i;
+
+	MUTEX_LOCK(async->mutex);
+	for (i=0; i<async->ndrops; i++) {
+		if (async->drops[i].callback == callback)
+			break;
+	}
+	if (i == TAPLOG_ASYNC_DROPSLOTS) {
+		i--;
+		async->drops[i].callback = NULL;
+	} else if (i == async->ndrops) {
+		async->drops[i].callback = callback;
+		async->drops[i].count = 0;
+		async->ndrops++;
+	}
+	async->drops[i].count++;
+	MUTEX_UNLOCK(async->mutex);
+}
+
+static taplog_entry_t *
+taplog_async_claim(taplog_async_t *async, unsigned long *seq)
+{
+	taplog_entry_t *entry;
+	unsigned long pos;
+	long diff;
+
+	pos = async->head;
+	while (1) {
+		entry = &async->entries[pos & (TAPLOG_ASYNC_ENTRIES-1)];
+		diff = (long) (entry->seq - pos);
+		if (diff == 0) {
+			if (ATOMIC_CAS(&async->head, pos, pos + 1) == pos) {
+				*seq = pos + 1;
+				return entry;
+			}
+		} else if (diff < 0) {
+			/* The thread hasn't consumed this entry yet */
+			return NULL;
+		}
+		pos = async->head;
+	}
+}
+
+void
+taplog_log_message(taplog_t *taplog, int level, const char *fmt, ...)
+{
+	taplog_async_t *async;
+	taplog_entry_t *entry;
+	char buffer[TAPLOG_BUFSIZE];
+	unsigned long seq;
+	va_list ap;
+	int ret;
+
+	if (taplog->async) {
+		async = taplog_async;
+		entry = taplog_async_claim(async, &seq);
+		if (!entry) {
+			taplog_async_drop(async, taplog->callback);
+			return;
+		}
+		entry->level = level;
+		entry->callback = taplog->callback;
+
+		va_start(ap, fmt);
+		ret = taplog_async_capture(entry, fmt, ap);
+		va_end(ap);
+		if (ret == -1) {
+			/* Fall back to formatting the message here, with the
+			 * same length limit as when logging synchronously */
+			buffer[sizeof(buffer)-1] = '\0';
+			va_start(ap, fmt);
+			vsnprintf(buffer, sizeof(buffer)-1, fmt, ap);
+			va_end(ap);
+			if (strlen(buffer) >= sizeof(entry->strings)) {
+				entry->text = strdup(buffer);
+			}
+			if (!entry->text) {
+				strncpy(entry->strings, buffer, sizeof(entry->strings));
+				entry->strings[sizeof(entry->strings)-1] = '\0';
+			}
+			entry->fmt = NULL;
+		}
+
+		/* Publish the entry and wake up the thread if it's sleeping,
+		 * only one of the threads logging needs to do the wakeup */
+		MEMORY_BARRIER();
+		entry->seq = seq;
+		MEMORY_BARRIER();
+		if (async->sleeping && ATOMIC_CAS(&async->sleeping, 1, 0) == 1) {
+			MUTEX_LOCK(async->mutex);
+			COND_SIGNAL(async->wakeup);
+			MUTEX_UNLOCK(async->mutex);
+		}
+		return;
+	}
+
+	buffer[sizeof(buffer)-1] = '\0';
+	va_start(ap, fmt);
+	vsnprintf(buffer, sizeof(buffer)-1, fmt, ap);
+	va_end(ap);
+
+	taplog_output(taplog->callback, level, buffer);
+}
+
 void
-taplog_log_ethernet_info(taplog_t *taplog, int level, unsigned char *buffer, int len) {
+taplog_log_ethernet(taplog_t *taplog, int level, unsigned char *buffer, int len) {
 	assert(taplog);
 
 	if (len < 14)
 		return;
 
-	taplog_log(taplog, level,
-	           "Frame length %d (0x%04x) bytes",
-	           len, len);
-	taplog_log(taplog, level,
-	           "Ethernet src address: %02x:%02x:%02x:%02x:%02x:%02x",
-	           (buffer[6])&0xff, (buffer[7])&0xff, (buffer[8])&0xff, (buffer[9])&0xff,
-	           (buffer[10])&0xff, (buffer[11])&0xff);
-	taplog_log(taplog, level,
-	           "Ethernet dst address: %02x:%02x:%02x:%02x:%02x:%02x",
-	           (buffer[0])&0xff, (buffer[1])&0xff, (buffer[2])&0xff, (buffer[3])&0xff,
-	           (buffer[4])&0xff, (buffer[5])&0xff);
-	taplog_log(taplog, level,
-	           "EtherType 0x%04x",
-	           ((buffer[12] << 8) | buffer[13])&0xffff);
+	taplog_log_message(taplog, level,
+	                   "Frame length %d (0x%04x) bytes",
+	                   len, len);
+	taplog_log_message(taplog, level,
+	                   "Ethernet src address: %02x:%02x:%02x:%02x:%02x:%02x",
+	                   (buffer[6])&0xff, (buffer[7])&0xff, (buffer[8])&0xff, (buffer[9])&0xff,
+	                   (buffer[10])&0xff, (buffer[11])&0xff);
+	taplog_log_message(taplog, level,
+	                   "Ethernet dst address: %02x:%02x:%02x:%02x:%02x:%02x",
+	                   (buffer[0])&0xff, (buffer[1])&0xff, (buffer[2])&0xff, (buffer[3])&0xff,
+	                   (buffer[4])&0xff, (buffer[5])&0xff);
+	taplog_log_message(taplog, level,
+	                   "EtherType 0x%04x",
+	                   ((buffer[12] << 8) | buffer[13])&0xffff);
 }
@@ -16,19 +16,75 @@
 #ifndef TAPLOG_H
 #define TAPLOG_H
 
+#define TAPLOG_LEVELS 8
+
 struct taplog_s {
 	int level;
 	taplog_callback_t callback;
+
+	/* Messages per second and burst allowed from each call site,
+	 * zero rate means that the level is not rate limited */
+	int rate[TAPLOG_LEVELS];
+	int burst[TAPLOG_LEVELS];
+
+	/* Messages are queued and formatted by the logging thread */
+	int async;
 };
 typedef struct taplog_s taplog_t;
 
+/* Token bucket of a single call site, tokens are in thousandths */
+struct taplog_site_s {
+	volatile long lock;
+	int started;
+	unsigned long tokens;
+	unsigned long last;
+	unsigned long suppressed;
+
+	/* Listed while the suppressed messages are not summarized, with
+	 * the handle settings of the last one, as the handle may be gone
+	 * by the time the summary is due */
+	int listed;
+	unsigned long due;
+	int level;
+	taplog_callback_t callback;
+	struct taplog_site_s *next;
+};
+typedef struct taplog_site_s taplog_site_t;
+
 void taplog_init(taplog_t *taplog);
 void taplog_set_level(taplog_t *taplog, int level);
 void taplog_set_callback(taplog_t *taplog, taplog_callback_t callback);
+int taplog_set_async(taplog_t *taplog, int enabled);
+int taplog_set_rate_limit(taplog_t *taplog, int level, int rate, int burst);
 char *taplog_utf8_to_local(const char *str);
 
-void taplog_log(taplog_t *taplog, int level, const char *fmt, ...);
-void taplog_log_ethernet_info(taplog_t *taplog, int level, unsigned char *buffer, int len);
+int taplog_check_rate(taplog_t *taplog, int level, taplog_site_t *site);
+void taplog_log_message(taplog_t *taplog, int level, const char *fmt, ...);
+void taplog_log_ethernet(taplog_t *taplog, int level, unsigned char *buffer, int len);
 
-#endif /* TAPLOG_H */
+/* The level is checked before the call, so that disabled messages
+ * cost a single branch and their arguments are never evaluated */
+#define taplog_enabled(taplog, msglevel) ((msglevel) <= (taplog)->level)
+
+/* Every call site has its own bucket, so a repeating error doesn't
+ * hide the other messages of the same level */
+#define taplog_allowed(taplog, msglevel, site) \
+	(!(taplog)->rate[msglevel] || taplog_check_rate(taplog, msglevel, site))
 
+#define taplog_log(taplog, level, ...) \
+	do { \
+		static taplog_site_t taplog_site; \
+		if (taplog_enabled(taplog, level) && \
+		    taplog_allowed(taplog, level, &taplog_site)) \
+			taplog_log_message(taplog, level, __VA_ARGS__); \
+	} while (0)
+
+#define taplog_log_ethernet_info(taplog, level, buffer, len) \
+	do { \
+		static taplog_site_t taplog_site; \
+		if (taplog_enabled(taplog, level) && \
+		    taplog_allowed(taplog, level, &taplog_site)) \
+			taplog_log_ethernet(taplog, level, buffer, len); \
+	} while (0)
+
+#endif /* TAPLOG_H */
@@ -0,0 +1,95 @@
+/**
+ *  tapcfg - A cross-platform configuration utility for TAP driver
+ *  Copyright (C) 2008-2011  Juho Vähä-Herttua
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#ifndef TAPTHREAD_H
+#define TAPTHREAD_H
+
+#if defined(_WIN32) || defined(_WIN64)
+#include <windows.h>
+
+typedef HANDLE thread_handle_t;
+
+#define THREAD_RETVAL DWORD WINAPI
+#define THREAD_CREATE(handle, func, arg) \
+	handle = CreateThread(NULL, 0, func, arg, 0, NULL)
+#define THREAD_JOIN(handle) WaitForSingleObject(handle, INFINITE); CloseHandle(handle)
+
+typedef HANDLE mutex_handle_t;
+
+#define MUTEX_CREATE(handle) handle = CreateMutex(NULL, FALSE, NULL)
+#define MUTEX_LOCK(handle) WaitForSingleObject(handle, INFINITE)
+#define MUTEX_UNLOCK(handle) ReleaseMutex(handle)
+#define MUTEX_DESTROY(handle) CloseHandle(handle)
+
+/* Condition variables are missing before Vista, an auto-reset event
+ * works the same way as long as there is only a single waiter */
+typedef HANDLE cond_handle_t;
+
+#define COND_CREATE(handle) handle = CreateEvent(NULL, FALSE, FALSE, NULL)
+#define COND_WAIT(handle, mutex) \
+	ReleaseMutex(mutex); \
+	WaitForSingleObject(handle, INFINITE); \
+	WaitForSingleObject(mutex, INFINITE)
+#define COND_SIGNAL(handle) SetEvent(handle)
+#define COND_DESTROY(handle) CloseHandle(handle)
+
+#define THREAD_YIELD() Sleep(0)
+#define THREAD_SLEEP(msec) Sleep(msec)
+
+/* Atomic operations on volatile long values, both return the old value */
+#define ATOMIC_CAS(ptr, oldval, newval) \
+	InterlockedCompareExchange((volatile LONG *) (ptr), newval, oldval)
+#define ATOMIC_ADD(ptr, value) \
+	InterlockedExchangeAdd((volatile LONG *) (ptr), value)
+#define MEMORY_BARRIER() MemoryBarrier()
+
+#else /* Use pthread library */
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+typedef pthread_t thread_handle_t;
+
+#define THREAD_RETVAL void *
+#define THREAD_CREATE(handle, func, arg) \
+	if (pthread_create(&(handle), NULL, func, arg)) handle = 0
+#define THREAD_JOIN(handle) pthread_join(handle, NULL)
+
+typedef pthread_mutex_t mutex_handle_t;
+
+#define MUTEX_CREATE(handle) pthread_mutex_init(&(handle), NULL)
+#define MUTEX_LOCK(handle) pthread_mutex_lock(&(handle))
+#define MUTEX_UNLOCK(handle) pthread_mutex_unlock(&(handle))
+#define MUTEX_DESTROY(handle) pthread_mutex_destroy(&(handle))
+
+typedef pthread_cond_t cond_handle_t;
+
+#define COND_CREATE(handle) pthread_cond_init(&(handle), NULL)
+#define COND_WAIT(handle, mutex) pthread_cond_wait(&(handle), &(mutex))
+#define COND_SIGNAL(handle) pthread_cond_signal(&(handle))
+#define COND_DESTROY(handle) pthread_cond_destroy(&(handle))
+
+#define THREAD_YIELD() sched_yield()
+#define THREAD_SLEEP(msec) usleep((msec) * 1000)
+
+#define ATOMIC_CAS(ptr, oldval, newval) \
+	__sync_val_compare_and_swap(ptr, oldval, newval)
+#define ATOMIC_ADD(ptr, value) __sync_fetch_and_add(ptr, value)
+#define MEMORY_BARRIER() __sync_synchronize()
+
+#endif
+
+#endif